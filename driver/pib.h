@@ -14,14 +14,19 @@
 #include <linux/compiler.h>
 #include <linux/completion.h>
 #include <linux/list.h>
+#include <linux/llist.h>
 #include <linux/mutex.h>
 #include <linux/idr.h>
 #include <linux/spinlock.h>
+#include <linux/seqlock.h>
 #include <linux/rbtree.h>
 #include <linux/semaphore.h>
 #include <linux/net.h>
+#include <linux/uio.h> /* for struct kvec */
 #include <linux/slab.h>
 #include <linux/sched.h>
+#include <linux/ktime.h>
+#include <linux/hrtimer.h>
 #include <rdma/ib_verbs.h>
 #include <rdma/ib_umem.h>
 #include <rdma/ib_mad.h> /* for ib_mad_hdr */
@@ -83,6 +88,14 @@
 #define PIB_INTEL_OMNI_PATH_MAD_SUPPORT
 #endif
 
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 11, 0) && defined(CONFIG_NET_RX_BUSY_POLL)
+#define PIB_SOCKET_BUSY_POLL_SUPPORT
+#endif
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 18, 0)
+#define PIB_UDP_GSO_SUPPORT /* UDP_SEGMENT */
+#endif
+
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3, 13, 0)
 /*
  *  Linux kernels less than 3.13 have the bug that ib_uverbs_post_send() in
@@ -106,6 +119,8 @@
 #define PIB_LOCAL_DMA_LKEY		(0)
 
 #define PIB_DEFAULT_NICE		(-5)
+#define PIB_MAX_KTHREAD			(64)
+#define PIB_MAX_BUSY_POLL		(1000000) /* in usec */
 #define PIB_SEND_BUFFER_SIZE		(16 * 1024 * 1024)
 #define PIB_RECV_BUFFER_SIZE		(16 * 1024 * 1024)
 
@@ -121,6 +136,7 @@
 
 #define PIB_MAX_SGE			(32)
 #define PIB_MAX_RD_ATOM			(16)
+#define PIB_MAX_RD_ATOM_LIMIT		(255) /* max_dest_rd_atomic is u8 */
 
 #define PIB_MAX_INLINE			(2048)
 
@@ -129,22 +145,22 @@
 #define PIB_LOCAL_ACK_TIMEOUT_MASK	(0x1F)
 #define PIB_MIN_RNR_NAK_TIMER_MASK	(0x1F)
 
-#define PIB_MAX_MR_PER_PD		(4096)
+#define PIB_MAX_MR_PER_PD		(1U << 20)
 
 /*
  * The L_Key and R_Key format consists of the following figure:
  *
- *   31           20 19       8 7    0
- *  +---------------+----------+------+
- *  |      key1     |  index   | key2 |
- *  +---------------+----------+------+
+ *   31   28 27               8 7    0
+ *  +-------+--------------------+------+
+ *  | key1  |       index        | key2 |
+ *  +-------+--------------------+------+
  *
- * - The key1 is 12 bits system key.
+ * - The key1 is 4 bits system key.
  *   When memory registration, pib allocate the key1 value.
  *   This value cannt be changed.
  *
- * - The index is 12 bits index field.
- *   This index indicates the mr_table[] of the protection domain.
+ * - The index is 20 bits index field.
+ *   This index is the ID of the MR in mr_idr of the protection domain.
  *
  * - The key2 is 8 bits programmable key.
  *   This key can be changed by ib_update_fast_reg_key().
@@ -156,6 +172,13 @@
 #define PIB_MR_INDEX_MASK		((PIB_MAX_MR_PER_PD - 1) << PIB_MR_INDEX_SHIFT)
 
 #define PIB_PACKET_BUFFER		(8192)
+#define PIB_RECV_BATCH			(32) /* max packets received at once */
+#define PIB_SEND_BATCH			(32) /* max packets queued before sending */
+#define PIB_GSO_MAX_SIZE		(65000) /* max bytes of a UDP_SEGMENT datagram */
+#define PIB_MAX_ZCOPY_FRAGS		(8) /* max payload fragments of a zero-copy packet */
+#define PIB_ZCOPY_RX_PEEK_SIZE		(128) /* bytes peeked to find the payload destination */
+#define PIB_LOOPBACK_RING_SIZE		(128) /* must be a power of 2 */
+#define PIB_LOCAL_FABRIC_MAX_SIZE	(256 * 1024) /* max bytes moved at once by the local fabric */
 #define PIB_GID_PER_PORT		(16)
 #define PIB_MAX_PAYLOAD_LEN	        (0x40000000)
 
@@ -163,6 +186,15 @@
 
 #define PIB_SCHED_TIMEOUT		(0x3FFFFFFF) /* 1/4 of max value of unsigned long */
 
+/*
+ *  The QP scheduler keeps QPs waiting for timeouts in a hierarchical timer
+ *  wheel. Each level has 64 slots and a slot of level n covers 64^n ticks.
+ */
+#define PIB_SCHED_WHEEL_BITS		(6)
+#define PIB_SCHED_WHEEL_SIZE		(1 << PIB_SCHED_WHEEL_BITS)
+#define PIB_SCHED_WHEEL_MASK		(PIB_SCHED_WHEEL_SIZE - 1)
+#define PIB_SCHED_WHEEL_LEVELS		(4)
+
 #define PIB_PKEY_PER_BLOCK              (32)
 #define PIB_PKEY_TABLE_LEN              (PIB_PKEY_PER_BLOCK * 1)
 
@@ -182,8 +214,14 @@
 #define PIB_LINK_WIDTH_SUPPORTED	(IB_WIDTH_1X | IB_WIDTH_4X | IB_WIDTH_8X | IB_WIDTH_12X)
 #define PIB_LINK_SPEED_SUPPORTED	(7) /* 2.5 or 5.0 or 10.0 Gbps */
 
-#define PIB_MAX_CONTIG_REQUESTS		(64)
+#define PIB_DEFAULT_SEND_WINDOW		(64)
+#define PIB_MAX_SEND_WINDOW		(65536)
 #define PIB_MAX_CONTIG_READ_ACKS	(64)
+#define PIB_DEFAULT_READ_BURST		(8)
+#define PIB_DEFAULT_SEND_BURST		(16)
+#define PIB_CREDITS_UNLIMITED		(INT_MAX)
+#define PIB_DEFAULT_ACK_DELAY		(50) /* usec */
+#define PIB_MIN_RTO			(100 * NSEC_PER_USEC)
 	
 
 #define pib_debug(fmt, args...)					\
@@ -297,10 +335,18 @@ enum pib_thread_flag {
 	PIB_THREAD_STOP,
 	PIB_THREAD_WQ_SCHEDULE,
 	PIB_THREAD_READY_TO_RECV,
+	PIB_THREAD_DOORBELL,
 	PIB_THREAD_QP_SCHEDULE
 };
 
 
+enum pib_sched_state {
+	PIB_SCHED_OFF		= 0,
+	PIB_SCHED_READY,	/* in the ready list */
+	PIB_SCHED_WHEEL		/* in the timer wheel */
+};
+
+
 enum pib_mr_state {
 	PIB_MR_INVALID,
 	PIB_MR_FREE,
@@ -312,7 +358,8 @@ enum pib_mr_direction {
 	PIB_MR_COPY_TO,
 	PIB_MR_CAS,
 	PIB_MR_FETCHADD,
-	PIB_MR_CHECK
+	PIB_MR_CHECK,
+	PIB_MR_MAP /* collect page fragments for zero-copy transmit */
 };
 
 
@@ -321,7 +368,7 @@ enum pib_obj {
 	PIB_MAX_PD	         =   0x10000,
 	PIB_MAX_SRQ	         =   0x10000,
 	PIB_MAX_CQ	         =   0x10000,
-	PIB_MAX_MR	         =   0x10000,
+	PIB_MAX_MR	         = 0x1000000,
 	PIB_MAX_AH	         = 0x1000000,
 	PIB_MAX_QP	         = 0x1000000,
 
@@ -450,6 +497,9 @@ struct pib_port {
 	struct pib_qp	       *qp_info[PIB_MAD_QPS_CORE];
 	__be16			pkey_table[PIB_PKEY_TABLE_LEN];
 
+	/* LID・GID・P_Key が変わると進む。ヘッダの雛形はこれが一致するかぎり使える */
+	atomic_t		header_generation;
+
 	struct {
 		enum pib_link_cmd	cmd;
 		struct pib_work_struct	work;
@@ -460,6 +510,22 @@ struct pib_port {
 };
 
 
+/*
+ *  送信パケットの LRH, GRH, BTH を事前に組み立てたもの (big-endian)。
+ *  per-packet では複写した後に PSN・OpCode・長さだけを書き換える。
+ */
+#define PIB_PACKET_HEADER_TEMPLATE_SIZE \
+	(sizeof(struct pib_packet_lrh) + sizeof(struct ib_grh) + sizeof(struct pib_packet_bth))
+
+struct pib_packet_header_template {
+	seqcount_t		seq; /* AH の雛形は modify_ah と複数の kthread から同時に触られる */
+	u32			generation; /* 0 は無効 */
+	u8			port_num;
+	u8			length;
+	u8			buffer[PIB_PACKET_HEADER_TEMPLATE_SIZE];
+};
+
+
 struct pib_node {
 	u8                      port_count; /* 指定可能なポート数 */
 	u8                      port_start;
@@ -474,6 +540,143 @@ struct pib_debugfs_entry {
 };
 
 
+enum pib_recv_type {
+	PIB_RECV_DONE = 0, /* dropped or already processed */
+	PIB_RECV_UNICAST,
+	PIB_RECV_MULTICAST,
+	PIB_RECV_RAW
+};
+
+
+/*
+ *  A received packet in the receive ring.
+ *  Headers are parsed for all packets of a batch before dispatching them.
+ */
+struct pib_recv_desc {
+	void		       *buffer;
+	int			size;
+
+	enum pib_recv_type	type;
+	struct pib_packet_lrh  *lrh;
+	struct ib_grh          *grh;
+	struct pib_packet_bth  *bth;
+	void		       *payload;
+	int			payload_size;
+	u16			dlid;
+	u32			dest_qp_num;
+	bool			placed; /* the payload has been received into the MR directly */
+};
+
+
+/*
+ *  Payload of a zero-copy packet that is sent directly from MR pages.
+ *  The page references are held until the packet is handed to the socket.
+ */
+struct pib_zcopy_frag {
+	struct page	       *page; /* NULL for DMA MR */
+	void		       *vaddr;
+	u32			len;
+};
+
+struct pib_zcopy {
+	u32			offset; /* offset of the payload in the packet buffer */
+	u32			size;
+	int			nr_frags;
+	bool			fast_reg; /* some fragments are in a fast reg MR */
+	struct pib_zcopy_frag	frags[PIB_MAX_ZCOPY_FRAGS];
+};
+
+
+/*
+ *  A packet queued in the transmit ring.
+ *  Consecutive packets to the same destination are sent at once.
+ */
+struct pib_send_desc {
+	void		       *buffer;
+	size_t			size; /* including the footer */
+	u8			port_num;
+	bool			mcast;
+	struct sockaddr	       *sockaddr;
+	struct pib_zcopy	zcopy;
+};
+
+
+/*
+ *  A slot of the direct loopback ring (single-host-mode).
+ *
+ *  Senders in any local HCA reserve slots with cmpxchg and the receiving
+ *  kthread consumes them in order. seq tells whom the slot belongs to.
+ */
+struct pib_loopback_slot {
+	unsigned int		seq;
+	u8			port_num;
+	int			size;
+	void		       *buffer;
+};
+
+
+/*
+ *  Per-kthread state.
+ *
+ *  QPs are sharded among kthreads by QPN. Each kthread has its own scheduler
+ *  and packet buffers, and generates requests and acknowledges of its QPs.
+ *  The first kthread also receives packets from sockets and executes
+ *  pib_work_struct. Header parsing and responder-side payload copies are
+ *  done by the first kthread for every QP; they are not sharded.
+ */
+struct pib_thread {
+	struct pib_dev	       *dev;
+	int			index;
+
+	struct task_struct     *task;
+	struct completion       completion;
+	struct timer_list	timer;  /* Local ACK Tmeout & RNR NAK Timer for RC */
+	struct hrtimer		hrtimer; /* wakeup timer when hr_sched is enabled */
+
+	unsigned long	flags;
+
+	void	       *send_buffer; /* the slot of send_ring being built */
+	void	       *send_ring_buffer; /* PIB_SEND_BATCH buffers for sendmsg */
+	struct pib_send_desc send_ring[PIB_SEND_BATCH];
+	int		nr_send; /* packets queued in send_ring */
+	struct kvec	send_iov[PIB_SEND_BATCH * (PIB_MAX_ZCOPY_FRAGS + 2)];
+	void	       *recv_buffer; /* PIB_RECV_BATCH buffers for recvmsg */
+	struct pib_recv_desc recv_ring[PIB_RECV_BATCH];
+	struct pib_recv_desc loopback_ring[PIB_RECV_BATCH];
+	struct pib_zcopy rx_zcopy; /* payload destination of a zero-copy receive */
+	struct pib_zcopy rx_zcopy_check; /* the destination looked up again after receiving */
+	struct {
+		bool		valid;
+		u32		qp_num;
+		u32		psn;
+	} rx_placed; /* the packet being dispatched was received by zero-copy */
+
+	u8		port_num;
+	u16		slid;
+	u16		dlid;
+	u32		src_qp_num;
+	u32		trace_id;
+	int		ready_to_send;
+	struct pib_zcopy zcopy; /* payload of the packet in send_buffer if nr_frags > 0 */
+
+	struct llist_head	doorbell_head; /* QPs rung by pib_post_send */
+	spinlock_t		doorbell_lock; /* taken to remove entries from doorbell_head */
+
+	struct {
+		spinlock_t	lock;
+		unsigned long   wakeup_time; /* in pib_sched_now() */
+
+		/* runnable QPs in FIFO order */
+		struct list_head	ready_head;
+
+		/* QPs waiting for Local ACK Timeout or RNR NAK timer */
+		unsigned long		wheel_base; /* the wheel has been expired until this time */
+		u64			wheel_bitmap[PIB_SCHED_WHEEL_LEVELS];
+		struct list_head	wheel[PIB_SCHED_WHEEL_LEVELS][PIB_SCHED_WHEEL_SIZE];
+	} qp_sched;
+};
+
+
 struct pib_dev {
 	struct ib_device	ib_dev;
 	struct ib_device_attr   ib_dev_attr;
@@ -513,13 +716,6 @@ struct pib_dev {
 	struct list_head        qp_head;
 	struct rb_root          qp_table;
 
-	struct {
-		spinlock_t	lock;
-		unsigned long   wakeup_time; /* in jiffies */
-		unsigned long   master_tid;
-		struct rb_root  rb_root;
-	} qp_sched;
-
 	struct {
 		spinlock_t	lock;
 		struct list_head	head;
@@ -530,24 +726,19 @@ struct pib_dev {
 	u32                     imm_data_lkey;
 #endif
 
-	struct {
-		struct task_struct     *task;
-		struct completion       completion;
-		struct timer_list	timer;  /* Local ACK Tmeout & RNR NAK Timer for RC */
-
-		unsigned long	flags;
+	/* QP を処理する kthread 群。各 QP はどれか 1 つの kthread が担当する */
+	int			nr_thread;
+	struct pib_thread      *threads;
 
-		void	       *send_buffer; /* buffer for sendmsg */
-		void	       *recv_buffer; /* buffer for recvmsg */
-		int		recv_size;
+	unsigned int		busy_poll; /* kthreads spin for this usec before sleeping */
 
-		u8		port_num;
-		u16		slid;
-		u16		dlid;
-		u32		src_qp_num;
-		u32		trace_id;
-		int		ready_to_send;
-	} thread;
+	/* packets from local HCAs in single-host-mode */
+	struct {
+		atomic_t		enqueue_pos;
+		unsigned int		dequeue_pos;
+		void		       *buffer;
+		struct pib_loopback_slot *slots;
+	} loopback;
 
 	struct list_head       *mcast_table;
 	struct pib_port	       *ports;
@@ -627,7 +818,7 @@ struct pib_pd {
 	spinlock_t		lock;
 
 	int                     nr_mr;
-	struct pib_mr	      **mr_table;
+	struct idr              mr_idr; /* 更新は lock の下、参照は RCU */
 };
 
 
@@ -638,6 +829,17 @@ struct pib_ah {
 
 	u32			ah_num;
 	struct timespec		creation_time;
+
+	struct pib_packet_header_template header_template; /* BTH の P_Key と DestQP は 0 */
+};
+
+/*
+ *  A physically contiguous range of a user MR (e.g. a huge page).
+ */
+struct pib_mr_extent {
+	u64			offset; /* from the start of the first page of the umem */
+	u64			length;
+	struct page	       *page; /* first page of the range */
 };
 
 struct pib_mr {
@@ -648,6 +850,10 @@ struct pib_mr {
 	u32			mr_num;
 	struct timespec		creation_time;
 
+	atomic_t		nr_users; /* lock-free readers using this MR */
+	bool			deregistered;
+	struct rcu_head		rcu;
+
 	enum pib_mr_state	state;
 	bool			is_fast_reg_mr;
 
@@ -662,6 +868,10 @@ struct pib_mr {
 	int			page_list_len;
 	void		      **page_list;
 	unsigned int		page_shift;
+
+	/* user MR の物理的に連続した範囲。offset の昇順に並ぶ */
+	unsigned long		nr_extents;
+	struct pib_mr_extent   *extents;
 };
 
 
@@ -749,6 +959,9 @@ struct pib_ack {
 	u32			msn;
 	enum pib_syndrome	syndrome;
 
+	u32			nr_packets; /* packets coalesced into this ACK */
+	unsigned long		deadline; /* in pib_sched_now(). ACK may be delayed until this time */
+
 	union {
 		struct {
 			u64     vaddress;
@@ -782,13 +995,18 @@ struct pib_qp {
 
 	pib_spinlock_t		lock;
 
-	unsigned long           local_ack_timeout; /* in jiffies */
+	unsigned long           local_ack_timeout; /* in pib_sched_now() */
+
+	struct pib_thread      *thread; /* the kthread owning this QP */
+
+	struct pib_packet_header_template header_template; /* RC と UC で使う */
 
 	struct {
-		int             on;
-		unsigned long   time;
-		unsigned long   tid;     /* order by inserting into scheduler */
-		struct rb_node  rb_node;
+		enum pib_sched_state on;
+		unsigned long   time;    /* in pib_sched_now() */
+		struct list_head list;   /* link to ready_head or a slot of wheel */
+		int		burst;   /* 次の pick でも ready list の先頭に残す */
+		unsigned int	nr_burst_packets; /* 続けて送った SEND/RDMA WRITE のパケット数 */
 	} sched;
 
 	/* requester side */
@@ -811,12 +1029,30 @@ struct pib_qp {
 		u8                      max_rd_atomic; /* これは ib_qp_attr.max_rd_atomic をベースに flow-control のために動的に調整する */
 		int			nr_rd_atomic;
 
-		struct list_head        free_swqe_head;
+		/*
+		 * pib_post_send と kthread の間の lock-free な受け渡し。
+		 * post_lock は投入側同士の排他にだけ使い、kthread は取らない。
+		 */
+		spinlock_t		post_lock;
+		struct llist_head	posted_swqe_head;
+		struct llist_head	free_swqe_head;
+		unsigned long		doorbell; /* bit 0: linked to thread->doorbell_head */
+		struct llist_node	doorbell_node;
 
 		void		       *inline_data_buffer;
 
-		int 			nr_contig_requests; /* 連続して RC Request を送信した回数 */
+		/* RC のフロー制御 */
+		u32			acked_psn; /* ACK を受けた PSN の次 */
+		u32			send_window; /* ACK を待たずに送信できるパケット数 */
+		int			credits; /* 相手の RQ に残る RWQE 数の見積もり */
+
+		/* adaptive RTO (RFC 6298)。単位は nsec で、0 は未測定 */
+		u64			srtt;
+		u64			rttvar;
+		u64			rto;
 		int 			nr_contig_read_acks; /* 連続して RDMA READ ACK を受信した回数  */
+		int			cnp_pending; /* CNP の送信を QP を担当する kthread に頼んでいる */
+		u32			cnp_trace_id;
 	} requester;
 
 	/* responder side */
@@ -833,6 +1069,7 @@ struct pib_qp {
 		struct list_head        free_rwqe_head;
 
 		int			last_OpCode;
+		int			psn_seq_nak; /* PSN Sequence Error NAK sent for the current gap */
 		u32			offset;
 
 		struct {
@@ -841,8 +1078,10 @@ struct pib_qp {
 			u32		dmalen;
 		} rdma_write;
 
+		/* RDMA READ/ATOMIC の再送に備えた ring。大きさは QP 作成時に決める (2 の冪) */
 		int			slot_index;
-		struct pib_rd_atom_slot slots[PIB_MAX_RD_ATOM];
+		unsigned int		nr_slots;
+		struct pib_rd_atom_slot *slots;
 
 		int 			nr_contig_read_acks; /* 連続して RDMA READ ACK を送信した回数  */
 	} responder;
@@ -856,6 +1095,17 @@ struct pib_qp {
 };
 
 
+/*
+ *  SGE リストのどこまでコピーしたか。複数パケットのメッセージで
+ *  次のパケットのコピーを先頭の SGE から辿り直さずに再開する。
+ *  0 で初期化すれば先頭を指す。
+ */
+struct pib_sge_cursor {
+	int			sge_index;
+	u64			base; /* sge_array[sge_index] のメッセージ内の位置 */
+};
+
+
 struct pib_swqe_processing {
 	/* Requester Side */
 	enum pib_swqe_list      list_type;
@@ -872,6 +1122,8 @@ struct pib_swqe_processing {
 
 	unsigned long           schedule_time;
 	unsigned long           local_ack_time;
+	u64			sent_time; /* ktime in nsec when the last packet was sent */
+	int			retransmitted; /* exclude from RTT samples (Karn's algorithm) */
 
 	int                     retry_cnt;
 
@@ -879,6 +1131,8 @@ struct pib_swqe_processing {
 
 	int			done; /* request execution is done  when Local Invalidate or Fast Reg PMR */
 
+	struct pib_sge_cursor	cursor; /* SEND/RDMA WRITE の送信と RDMA READ response の受信 */
+
 	/* Responder Side */
 };
 
@@ -896,6 +1150,7 @@ struct pib_send_wqe {
 	struct ib_sge           sge_array[PIB_MAX_SGE];
 
 	struct list_head        list; /* link from QP */
+	struct llist_node	llnode; /* link from posted_swqe_head or free_swqe_head */
 
 	struct pib_swqe_processing processing;
 
@@ -945,6 +1200,7 @@ struct pib_recv_wqe {
 	int			num_sge;
 	u32                     total_length;
 	struct ib_sge           sge_array[PIB_MAX_SGE];
+	struct pib_sge_cursor	cursor;
 
 	struct list_head        list; /* link from QP or SRQ */
 };
@@ -964,11 +1220,25 @@ extern u64 pib_hca_guid_base;
 extern struct pib_dev *pib_devs[];
 extern struct pib_easy_sw pib_easy_sw;
 extern struct sockaddr **pib_lid_table;
+extern struct pib_dev **pib_lid_dev_table;
 extern unsigned int pib_num_hca;
 extern unsigned int pib_phys_port_cnt;
 extern unsigned int pib_behavior;
 extern unsigned int pib_manner_warn;
 extern unsigned int pib_manner_err;
+extern unsigned int pib_hr_sched;
+extern unsigned int pib_zcopy_tx;
+extern unsigned int pib_zcopy_rx;
+extern unsigned int pib_direct_loopback;
+extern unsigned int pib_send_window;
+extern unsigned int pib_ack_coalesce;
+extern unsigned int pib_ack_delay;
+extern unsigned int pib_selective_retransmit;
+extern unsigned int pib_adaptive_rto;
+extern unsigned int pib_local_fabric;
+extern unsigned int pib_max_rd_atom;
+extern unsigned int pib_read_burst;
+extern unsigned int pib_send_burst;
 extern struct kmem_cache *pib_ah_cachep;
 extern struct kmem_cache *pib_mr_cachep;
 extern struct kmem_cache *pib_qp_cachep;
@@ -1021,6 +1291,36 @@ static inline struct pib_cq *to_pcq(struct ib_cq *ibcq)
 	return container_of(ibcq, struct pib_cq, ib_cq);
 }
 
+static inline int pib_is_header_template_valid(struct pib_dev *dev, const struct pib_packet_header_template *template, u8 port_num)
+{
+	u32 generation = ACCESS_ONCE(template->generation);
+
+	return (generation != 0) && (template->port_num == port_num) &&
+		(generation == (u32)atomic_read(&dev->ports[port_num - 1].header_generation));
+}
+
+/*
+ *  有効な雛形を buffer に複写してその長さを返す。無効なら 0 を返す。
+ *  複写中に雛形が書き換えられた場合は seqcount で検出してやり直す。
+ */
+static inline int pib_copy_header_template(struct pib_dev *dev, const struct pib_packet_header_template *template, u8 port_num, void *buffer)
+{
+	unsigned int seq;
+	int length;
+
+	do {
+		seq = read_seqcount_begin(&template->seq);
+
+		if (!pib_is_header_template_valid(dev, template, port_num))
+			return 0;
+
+		length = template->length;
+		memcpy(buffer, template->buffer, length);
+	} while (read_seqcount_retry(&template->seq, seq));
+
+	return length;
+}
+
 static inline int pib_get_behavior(enum pib_behavior behavior)
 {
 	return (pib_behavior & (1UL << behavior)) != 0;
@@ -1036,6 +1336,22 @@ static inline int pib_error_manner(enum pib_manner manner)
 	return (pib_manner_err & (1UL << manner)) != 0;
 }
 
+/*
+ *  The clock of the QP scheduler.
+ *
+ *  All schedule times (sched.time, schedule_time, local_ack_time and
+ *  RNR NAK timer) are expressed in jiffies by default. If hr_sched is
+ *  set, they are expressed in microseconds and kthreads are woken up by
+ *  hrtimers.
+ */
+static inline unsigned long pib_sched_now(void)
+{
+	if (pib_hr_sched)
+		return (unsigned long)ktime_to_us(ktime_get());
+
+	return jiffies;
+}
+
 
 /*
  *  in pib_main.c
@@ -1048,13 +1364,20 @@ extern int pib_dealloc_pd(struct ib_pd *ibpd);
 extern u32 pib_alloc_obj_num(struct pib_dev *dev, u32 start, u32 size, u32 *last_num_p);
 extern void pib_dealloc_obj_num(struct pib_dev *dev, u32 start, u32 index);
 extern void pib_fill_grh(struct pib_dev *dev, u8 port_num, struct ib_grh *dest, const struct ib_global_route *src);
+extern u8 pib_fill_packet_header(struct pib_dev *dev, u8 port_num, const struct ib_ah_attr *ah_attr, __be16 pkey, u32 dest_qp_num, void *buffer);
+extern void pib_build_packet_header_template(struct pib_dev *dev, u8 port_num, const struct ib_ah_attr *ah_attr, __be16 pkey, u32 dest_qp_num, struct pib_packet_header_template *template);
 
 
 /*
  *  in pib_thread.c
  */
 extern void pib_util_reschedule_qp(struct pib_qp *qp);
-extern struct pib_qp *pib_util_get_first_scheduling_qp(struct pib_dev *dev);
+extern void pib_util_ring_doorbell(struct pib_qp *qp);
+extern void pib_util_cancel_doorbell(struct pib_qp *qp);
+extern struct pib_qp *pib_util_get_first_scheduling_qp(struct pib_thread *thread);
+extern bool pib_util_rx_payload_placed(struct pib_dev *dev, struct pib_qp *qp, u32 psn);
+extern struct pib_dev *pib_util_find_loopback_dev(u16 lid);
+extern struct pib_thread *pib_util_get_thread(struct pib_dev *dev, u32 qp_num);
 
 extern int pib_create_kthread(struct pib_dev *dev);
 extern void pib_release_kthread(struct pib_dev *dev);
@@ -1064,6 +1387,7 @@ extern void pib_queue_work(struct pib_dev *dev, struct pib_work_struct *work);
 extern void pib_queue_delayed_work(struct pib_dev *dev, struct pib_work_struct *work, unsigned long delay);
 extern void pib_cancel_work(struct pib_dev *dev, struct pib_work_struct *work);
 extern void pib_stop_delayed_queue(struct pib_dev *dev);
+extern void pib_set_busy_poll(struct pib_dev *dev, unsigned int usec);
 
 /*
  *  in pib_ah.c
@@ -1086,9 +1410,12 @@ extern struct ib_mr *pib_alloc_fast_reg_mr(struct ib_pd *pd,
 extern struct ib_fast_reg_page_list *pib_alloc_fast_reg_page_list(struct ib_device *ibdev,
 								  int page_list_len);
 extern void pib_free_fast_reg_page_list(struct ib_fast_reg_page_list *page_list);
-extern enum ib_wc_status pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction);
+extern enum ib_wc_status pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, struct pib_sge_cursor *cursor, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction);
 extern enum ib_wc_status pib_util_mr_verify_rkey_validation(struct pib_pd *pd, u32 rkey, u64 address, u64 size, int access_flag);
 extern enum ib_wc_status pib_util_mr_copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64 size, int access_flags, enum pib_mr_direction direction);
+extern enum ib_wc_status pib_util_mr_map_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, struct pib_sge_cursor *cursor, struct pib_zcopy *zcopy, u64 offset, u64 size, int access_flags);
+extern enum ib_wc_status pib_util_mr_map_data_with_rkey(struct pib_pd *pd, u32 rkey, struct pib_zcopy *zcopy, u64 address, u64 size, int access_flags);
+extern void pib_util_zcopy_release(struct pib_zcopy *zcopy);
 extern enum ib_wc_status pib_util_mr_atomic(struct pib_pd *pd, u32 rkey, u64 address, u64 swap, u64 compare, u64 *result, enum pib_mr_direction direction);
 extern enum ib_wc_status pib_util_mr_invalidate(struct pib_pd *pd, u32 rkey);
 extern enum ib_wc_status pib_util_mr_fast_reg_pmr(struct pib_pd *pd, u32 rkey, u64 iova_start, struct ib_fast_reg_page_list *page_list, unsigned int page_shift, unsigned int page_list_len, u32 length, int access_flags);
@@ -1113,6 +1440,7 @@ extern int pib_poll_cq(struct ib_cq *ibcq, int num_entries, struct ib_wc *wc);
 extern int pib_req_notify_cq(struct ib_cq *ibcq, enum ib_cq_notify_flags flags);
 extern int pib_util_remove_cq(struct pib_cq *cq, struct pib_qp *qp);
 extern int pib_util_insert_wc_success(struct pib_cq *cq, const struct ib_wc *wc, int solicited);
+extern void pib_util_insert_wc_success_bulk(struct pib_qp *qp, struct list_head *completed_head);
 extern int pib_util_insert_wc_error(struct pib_cq *cq, struct pib_qp *qp, u64 wr_id, enum ib_wc_status status, enum ib_wc_opcode opcode);
 extern void pib_util_insert_async_cq_error(struct pib_dev *dev, struct pib_cq *cq);
 
@@ -1150,6 +1478,7 @@ extern void pib_util_free_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_
 extern void pib_util_free_recv_wqe(struct pib_qp *qp, struct pib_recv_wqe *recv_wqe);
 extern struct pib_qp *pib_util_find_qp(struct pib_dev *dev, int qp_num);
 extern void pib_util_flush_qp(struct pib_qp *qp, int send_only);
+extern void pib_util_drain_posted_swqe(struct pib_qp *qp);
 extern void pib_util_insert_async_qp_error(struct pib_qp *qp, enum ib_event_type event);
 extern void pib_util_insert_async_qp_event(struct pib_qp *qp, enum ib_event_type event);
 
@@ -1175,9 +1504,14 @@ extern void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num,
  *  in pib_rc.c
  */
 extern int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+extern bool pib_is_rc_qp_request_blocked(const struct pib_qp *qp, const struct pib_send_wqe *send_wqe);
+extern void pib_rewind_rc_qp_request(struct pib_qp *qp, u32 psn);
 extern int pib_process_local_only_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 extern void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
+extern int pib_prepare_rc_qp_zcopy_rx(struct pib_dev *dev, u8 port_num, void *buffer, int peeked_size, int packet_size, struct pib_zcopy *zcopy);
 extern int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp);
+extern int pib_generate_rc_qp_cnp(struct pib_dev *dev, struct pib_qp *qp);
+extern unsigned long pib_get_rc_qp_acknowledge_time(const struct pib_qp *qp, unsigned long now);
 
 /*
  *  in pib_mad.c
@@ -1233,9 +1567,12 @@ extern bool pib_opcode_is_acknowledge(int OpCode);
 extern bool pib_opcode_is_in_order_sequence(int OpCode, int last_OpCode);
 enum ib_wc_opcode pib_convert_wr_opcode_to_wc_opcode(enum ib_wr_opcode);
 extern u32 pib_get_num_of_packets(struct pib_qp *qp, u32 length);
-extern u32 pib_get_rnr_nak_time(int timeout);
+extern unsigned long pib_get_rnr_nak_time(int timeout);
 extern unsigned long pib_get_local_ack_time(int timeout);
+extern unsigned long pib_get_ack_delay_time(void);
+extern unsigned long pib_get_rto_time(u64 nsec);
 extern u8 pib_get_local_ca_ack_delay(void);
+extern int pib_get_max_rd_atom(void);
 extern bool pib_is_unicast_lid(u16 lid);
 extern bool pib_is_permissive_lid(u16 lid);
 extern const char *pib_get_mgmt_method(u8 method);
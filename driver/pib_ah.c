@@ -12,6 +12,22 @@
 #include "pib_trace.h"
 
 
+static void refresh_header_template(struct pib_dev *dev, struct pib_ah *ah)
+{
+	u8 port_num = ah->ib_ah_attr.port_num;
+
+	if ((port_num < 1) || (dev->ib_dev.phys_port_cnt < port_num) ||
+	    ((ah->ib_ah_attr.ah_flags & IB_AH_GRH) && (PIB_GID_PER_PORT <= ah->ib_ah_attr.grh.sgid_index))) {
+		/* 不正な AH は送信時にエラーになるので雛形は作らない */
+		ah->header_template.generation = 0;
+		return;
+	}
+
+	/* P_Key と DestQP は Send WR ごとに決まる */
+	pib_build_packet_header_template(dev, port_num, &ah->ib_ah_attr, 0, 0, &ah->header_template);
+}
+
+
 struct ib_ah *
 pib_create_ah(struct ib_pd *ibpd, struct ib_ah_attr *ah_attr)
 {
@@ -31,6 +47,7 @@ pib_create_ah(struct ib_pd *ibpd, struct ib_ah_attr *ah_attr)
 
 	INIT_LIST_HEAD(&ah->list);
 	getnstimeofday(&ah->creation_time);
+	seqcount_init(&ah->header_template.seq);
 
 	spin_lock_irqsave(&dev->lock, flags);
 	ah_num = pib_alloc_obj_num(dev, PIB_BITMAP_AH_START, PIB_MAX_AH, &dev->last_ah_num);
@@ -45,6 +62,8 @@ pib_create_ah(struct ib_pd *ibpd, struct ib_ah_attr *ah_attr)
 
 	ah->ib_ah_attr = *ah_attr;
 
+	refresh_header_template(dev, ah);
+
 	pib_trace_api(dev, IB_USER_VERBS_CMD_CREATE_AH, ah_num);
 
 	return &ah->ib_ah;
@@ -71,6 +90,8 @@ int pib_modify_ah(struct ib_ah *ibah, struct ib_ah_attr *ah_attr)
 
 	ah->ib_ah_attr = *ah_attr;
 
+	refresh_header_template(dev, ah);
+
 	return 0;
 }
 
@@ -14,6 +14,8 @@
 
 
 static int insert_wc(struct pib_cq *cq, const struct ib_wc *wc, int solicited);
+static int insert_wc_locked(struct pib_cq *cq, const struct ib_wc *wc);
+static void notify_cq(struct pib_cq *cq, int solicited);
 static void cq_overflow_handler(struct pib_work_struct *work);
 
 
@@ -346,24 +348,84 @@ static int insert_wc(struct pib_cq *cq, const struct ib_wc *wc, int solicited)
 {
 	int ret;
 	unsigned long flags;
-	struct pib_cqe *cqe;
 
 	pib_trace_comp(to_pdev(cq->ib_cq.device), cq, wc);
 
 	pib_spin_lock_irqsave(&cq->lock, flags);
 
-	if (cq->state != PIB_STATE_OK) {
-		ret = -EACCES;
-		goto done;
+	ret = insert_wc_locked(cq, wc);
+
+	if (ret == 0)
+		notify_cq(cq, solicited);
+
+	pib_spin_unlock_irqrestore(&cq->lock, flags);
+
+	return ret;
+}
+
+
+/*
+ *  ACK でまとめて完了した Send WQE の WC を一度の CQ ロックで挿入する。
+ *  completion handler は高々 1 回だけ呼ぶ。
+ *  completed_head の Send WQE はすべて解放する。
+ *
+ *  Lock: qp
+ */
+void pib_util_insert_wc_success_bulk(struct pib_qp *qp, struct list_head *completed_head)
+{
+	int inserted = 0;
+	unsigned long flags;
+	struct pib_cq *cq = qp->send_cq;
+	struct pib_send_wqe *send_wqe, *next_send_wqe;
+
+	if (list_empty(completed_head))
+		return;
+
+	pib_spin_lock_irqsave(&cq->lock, flags);
+
+	list_for_each_entry_safe(send_wqe, next_send_wqe, completed_head, list) {
+		if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) || 
+		    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
+			struct ib_wc wc = {
+				.wr_id    = send_wqe->wr_id,
+				.status   = IB_WC_SUCCESS,
+				.opcode   = pib_convert_wr_opcode_to_wc_opcode(send_wqe->opcode),
+				.qp       = &qp->ib_qp,
+			};
+
+			pib_trace_comp(to_pdev(cq->ib_cq.device), cq, &wc);
+
+			if (insert_wc_locked(cq, &wc) == 0)
+				inserted = 1;
+		}
+
+		list_del_init(&send_wqe->list);
+		pib_util_free_send_wqe(qp, send_wqe);
 	}
 
+	if (inserted)
+		notify_cq(cq, 0);
+
+	pib_spin_unlock_irqrestore(&cq->lock, flags);
+}
+
+
+/*
+ *  Lock: cq
+ */
+static int insert_wc_locked(struct pib_cq *cq, const struct ib_wc *wc)
+{
+	struct pib_cqe *cqe;
+
+	if (cq->state != PIB_STATE_OK)
+		return -EACCES;
+
 	if (list_empty(&cq->free_cqe_head)) {
 		/* CQ overflow */
 		cq->state     = PIB_STATE_ERR;
 		pib_queue_work(to_pdev(cq->ib_cq.device), &cq->work);
 
-		ret = -ENOMEM;
-		goto done;
+		return -ENOMEM;
 	}
 
 	cqe = list_first_entry(&cq->free_cqe_head, struct pib_cqe, list);
@@ -378,6 +440,15 @@ static int insert_wc(struct pib_cq *cq, const struct ib_wc *wc, int solicited)
 
 	list_add_tail(&cqe->list, &cq->cqe_head);
 
+	return 0;
+}
+
+
+/*
+ *  Lock: cq
+ */
+static void notify_cq(struct pib_cq *cq, int solicited)
+{
 	/* tell completion channel */
 	if ((cq->notify_flag == IB_CQ_NEXT_COMP) ||
 	    ((cq->notify_flag == IB_CQ_SOLICITED) && solicited)) {
@@ -390,13 +461,6 @@ static int insert_wc(struct pib_cq *cq, const struct ib_wc *wc, int solicited)
 			cq->ib_cq.comp_handler(&cq->ib_cq, cq->ib_cq.cq_context);
 		}
 	}
-
-	ret = 0;
-
-done:
-	pib_spin_unlock_irqrestore(&cq->lock, flags);
-
-	return ret;
 }
 
 
@@ -141,6 +141,9 @@ struct pib_qp_record {
 	int	nr_rwqe;
 	u8	qp_type;
 	u8	state;
+	u32	srtt;	/* usec */
+	u32	rttvar;	/* usec */
+	u32	rto;	/* usec */
 };
 
 
@@ -198,8 +201,9 @@ static void *inspection_seq_start(struct seq_file *file, loff_t *pos)
 		break;
 
 	case PIB_DEBUGFS_QP:
-		seq_printf(file, "%-4s %-3s %-5s %-4s %-4s %-4s %-5s %-5s %-5s %-5s\n",
-			   "PD", "QT", "STATE", "S-CQ", "R-CQ", "SRQ", "MAX-S", "CUR-S", "MAX-R", "CUR-R");
+		seq_printf(file, "%-4s %-3s %-5s %-4s %-4s %-4s %-5s %-5s %-5s %-5s %-8s %-8s %-8s\n",
+			   "PD", "QT", "STATE", "S-CQ", "R-CQ", "SRQ", "MAX-S", "CUR-S", "MAX-R", "CUR-R",
+			   "SRTT", "RTTVAR", "RTO");
 		break;
 
 	default:
@@ -327,12 +331,13 @@ static int inspection_seq_show(struct seq_file *file, void *iter)
 
 	case PIB_DEBUGFS_QP: {
 		struct pib_qp_record *qp_rec = (struct pib_qp_record *)record;
-		seq_printf(file, " %04x %-3s %-5s %04x %04x %04x %5u %5u %5u %5u",
+		seq_printf(file, " %04x %-3s %-5s %04x %04x %04x %5u %5u %5u %5u %8u %8u %8u",
 			   qp_rec->pd_num,
 			   pib_get_qp_type(qp_rec->qp_type), pib_get_qp_state(qp_rec->state),
 			   qp_rec->send_cq_num, qp_rec->recv_cq_num, qp_rec->srq_num,
 			   qp_rec->max_swqe, qp_rec->nr_swqe,
-			   qp_rec->max_rwqe, qp_rec->nr_rwqe);
+			   qp_rec->max_rwqe, qp_rec->nr_rwqe,
+			   qp_rec->srtt, qp_rec->rttvar, qp_rec->rto);
 		break;
 	}
 
@@ -587,6 +592,9 @@ static int inspection_open(struct inode *inode, struct file *file)
 			records[i].nr_rwqe	      = qp->ib_qp_init_attr.cap.max_recv_wr - qp->responder.nr_recv_wqe;
 			records[i].qp_type	      = qp->qp_type;
 			records[i].state	      = qp->state;
+			records[i].srtt		      = div_u64(qp->requester.srtt,   NSEC_PER_USEC);
+			records[i].rttvar	      = div_u64(qp->requester.rttvar, NSEC_PER_USEC);
+			records[i].rto		      = div_u64(qp->requester.rto,    NSEC_PER_USEC);
 			set_pid_and_handle(&records[i].base, qp->ib_qp.uobject);
 			i++;
 		}
@@ -999,7 +1007,7 @@ void pib_trace_api(struct pib_dev *dev, int cmd, u32 oid)
 }
 
 
-void pib_trace_send(struct pib_dev *dev, u8 port_num, int size)
+void pib_trace_send(struct pib_dev *dev, struct pib_thread *thread, u8 port_num, int size)
 {
 	struct pib_trace_entry entry;
 	void *buffer;
@@ -1010,12 +1018,12 @@ void pib_trace_send(struct pib_dev *dev, u8 port_num, int size)
 
 	entry.port	= port_num;
 	entry.u.send.len = size;
-	entry.u.send.slid = dev->thread.slid;
-	entry.u.send.dlid = dev->thread.dlid;
-	entry.u.send.sqpn = dev->thread.src_qp_num;
-	entry.u.send.trace_id = dev->thread.trace_id;
+	entry.u.send.slid = thread->slid;
+	entry.u.send.dlid = thread->dlid;
+	entry.u.send.sqpn = thread->src_qp_num;
+	entry.u.send.trace_id = thread->trace_id;
 
-	buffer = dev->thread.send_buffer;
+	buffer = thread->send_buffer;
 	
 	lrh = buffer;
 	buffer += sizeof(*lrh);
@@ -1067,14 +1075,14 @@ void pib_trace_recv_ok(struct pib_dev *dev, u8 port_num, u8 opcode, u32 psn, u32
 }
 
 
-void pib_trace_retry(struct pib_dev *dev, u8 port_num, struct pib_send_wqe *send_wqe)
+void pib_trace_retry(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_send_wqe *send_wqe)
 {
 	struct pib_trace_entry entry;
 
 	memset(&entry, 0, sizeof(entry));
 
 	entry.port	= port_num;
-	entry.u.retry.sqpn = dev->thread.src_qp_num;
+	entry.u.retry.sqpn = qp->ib_qp.qp_num;
 	entry.u.retry.trace_id = send_wqe->trace_id;
 	entry.u.retry.count = send_wqe->processing.retry_cnt;
 
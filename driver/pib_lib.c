@@ -7,6 +7,7 @@
  */
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/math64.h>
 #include <rdma/ib_pack.h>
 #include <rdma/ib_mad.h>
 #include <rdma/ib_sa.h>
@@ -171,85 +172,78 @@ static const char *str_trans_op[] = {
 
 
 
-#define USEC_TO_JIFFIES(value) \
-	((u32)(((value ## ULL) * 1000) / (HZ * 1000ULL)))
-
-
+/* IBA Spec. Vol.1 9.7.5.2.8 (in microseconds) */
 static const u32 rnr_nak_timeout[] = {
-	[IB_RNR_TIMER_655_36] = USEC_TO_JIFFIES(655360),
-	[IB_RNR_TIMER_000_01] = USEC_TO_JIFFIES(    10),
-	[IB_RNR_TIMER_000_02] = USEC_TO_JIFFIES(    20),
-	[IB_RNR_TIMER_000_03] = USEC_TO_JIFFIES(    30),
-	[IB_RNR_TIMER_000_04] = USEC_TO_JIFFIES(    40),
-	[IB_RNR_TIMER_000_06] = USEC_TO_JIFFIES(    60),
-	[IB_RNR_TIMER_000_08] = USEC_TO_JIFFIES(    80),
-	[IB_RNR_TIMER_000_12] = USEC_TO_JIFFIES(   120),
-	[IB_RNR_TIMER_000_16] = USEC_TO_JIFFIES(   160),
-	[IB_RNR_TIMER_000_24] = USEC_TO_JIFFIES(   240),
-	[IB_RNR_TIMER_000_32] = USEC_TO_JIFFIES(   320),
-	[IB_RNR_TIMER_000_48] = USEC_TO_JIFFIES(   480),
-	[IB_RNR_TIMER_000_64] = USEC_TO_JIFFIES(   640),
-	[IB_RNR_TIMER_000_96] = USEC_TO_JIFFIES(   960),
-	[IB_RNR_TIMER_001_28] = USEC_TO_JIFFIES(  1280),
-	[IB_RNR_TIMER_001_92] = USEC_TO_JIFFIES(  1920),
-	[IB_RNR_TIMER_002_56] = USEC_TO_JIFFIES(  2560),
-	[IB_RNR_TIMER_003_84] = USEC_TO_JIFFIES(  3840),
-	[IB_RNR_TIMER_005_12] = USEC_TO_JIFFIES(  5120),
-	[IB_RNR_TIMER_007_68] = USEC_TO_JIFFIES(  7680),
-	[IB_RNR_TIMER_010_24] = USEC_TO_JIFFIES( 10240),
-	[IB_RNR_TIMER_015_36] = USEC_TO_JIFFIES( 15360),
-	[IB_RNR_TIMER_020_48] = USEC_TO_JIFFIES( 20480),
-	[IB_RNR_TIMER_030_72] = USEC_TO_JIFFIES( 30720),
-	[IB_RNR_TIMER_040_96] = USEC_TO_JIFFIES( 40960),
-	[IB_RNR_TIMER_061_44] = USEC_TO_JIFFIES( 61440),
-	[IB_RNR_TIMER_081_92] = USEC_TO_JIFFIES( 81920),
-	[IB_RNR_TIMER_122_88] = USEC_TO_JIFFIES(122880),
-	[IB_RNR_TIMER_163_84] = USEC_TO_JIFFIES(163840),
-	[IB_RNR_TIMER_245_76] = USEC_TO_JIFFIES(245760),
-	[IB_RNR_TIMER_327_68] = USEC_TO_JIFFIES(327680),
-	[IB_RNR_TIMER_491_52] = USEC_TO_JIFFIES(491520),
+	[IB_RNR_TIMER_655_36] = 655360,
+	[IB_RNR_TIMER_000_01] =     10,
+	[IB_RNR_TIMER_000_02] =     20,
+	[IB_RNR_TIMER_000_03] =     30,
+	[IB_RNR_TIMER_000_04] =     40,
+	[IB_RNR_TIMER_000_06] =     60,
+	[IB_RNR_TIMER_000_08] =     80,
+	[IB_RNR_TIMER_000_12] =    120,
+	[IB_RNR_TIMER_000_16] =    160,
+	[IB_RNR_TIMER_000_24] =    240,
+	[IB_RNR_TIMER_000_32] =    320,
+	[IB_RNR_TIMER_000_48] =    480,
+	[IB_RNR_TIMER_000_64] =    640,
+	[IB_RNR_TIMER_000_96] =    960,
+	[IB_RNR_TIMER_001_28] =   1280,
+	[IB_RNR_TIMER_001_92] =   1920,
+	[IB_RNR_TIMER_002_56] =   2560,
+	[IB_RNR_TIMER_003_84] =   3840,
+	[IB_RNR_TIMER_005_12] =   5120,
+	[IB_RNR_TIMER_007_68] =   7680,
+	[IB_RNR_TIMER_010_24] =  10240,
+	[IB_RNR_TIMER_015_36] =  15360,
+	[IB_RNR_TIMER_020_48] =  20480,
+	[IB_RNR_TIMER_030_72] =  30720,
+	[IB_RNR_TIMER_040_96] =  40960,
+	[IB_RNR_TIMER_061_44] =  61440,
+	[IB_RNR_TIMER_081_92] =  81920,
+	[IB_RNR_TIMER_122_88] = 122880,
+	[IB_RNR_TIMER_163_84] = 163840,
+	[IB_RNR_TIMER_245_76] = 245760,
+	[IB_RNR_TIMER_327_68] = 327680,
+	[IB_RNR_TIMER_491_52] = 491520,
 };
 
 
-#define NSEC_TO_JIFFIES(value)					\
-	((unsigned long)(((value ## ULL) * 1000) / (HZ * 1000000ULL)))
-
-
-/* IBA Spec. Vol.1 9.7.6.1.3 */
-static const unsigned long local_ack_timeout[] = {
+/* IBA Spec. Vol.1 9.7.6.1.3 (in nanoseconds) */
+static const u64 local_ack_timeout[] = {
 	/* [ 0] is inifinity */
-	[ 1] = NSEC_TO_JIFFIES(         8192),
-	[ 2] = NSEC_TO_JIFFIES(        16384),
-	[ 3] = NSEC_TO_JIFFIES(        32768),
-	[ 4] = NSEC_TO_JIFFIES(        65536),
-	[ 5] = NSEC_TO_JIFFIES(       131072),
-	[ 6] = NSEC_TO_JIFFIES(       262144),
-	[ 7] = NSEC_TO_JIFFIES(       524288),
-	[ 8] = NSEC_TO_JIFFIES(      1048576),
-	[ 9] = NSEC_TO_JIFFIES(      2087152),
-	[10] = NSEC_TO_JIFFIES(      4194304),
-	[11] = NSEC_TO_JIFFIES(      8388608),
-	[12] = NSEC_TO_JIFFIES(     16777216),
-	[13] = NSEC_TO_JIFFIES(     33554432),
-	[14] = NSEC_TO_JIFFIES(     67108864),
-	[15] = NSEC_TO_JIFFIES(    134217728),
-
-	[16] = NSEC_TO_JIFFIES(    268435456),
-	[17] = NSEC_TO_JIFFIES(    536870912),
-	[18] = NSEC_TO_JIFFIES(   1073741824),
-	[19] = NSEC_TO_JIFFIES(   2147483648),
-	[20] = NSEC_TO_JIFFIES(   4294967296),
-	[21] = NSEC_TO_JIFFIES(   8589934592),
-	[22] = NSEC_TO_JIFFIES(  17179869184),
-	[23] = NSEC_TO_JIFFIES(  34359738368),
-	[24] = NSEC_TO_JIFFIES(  68719476736),
-	[25] = NSEC_TO_JIFFIES( 137438953472),
-	[26] = NSEC_TO_JIFFIES( 274877906944),
-	[27] = NSEC_TO_JIFFIES( 549755813888),
-	[28] = NSEC_TO_JIFFIES(1099511627776),
-	[29] = NSEC_TO_JIFFIES(2199023255552),
-	[30] = NSEC_TO_JIFFIES(4398046511104),
-	[31] = NSEC_TO_JIFFIES(8796093022208),
+	[ 1] =          8192ULL,
+	[ 2] =         16384ULL,
+	[ 3] =         32768ULL,
+	[ 4] =         65536ULL,
+	[ 5] =        131072ULL,
+	[ 6] =        262144ULL,
+	[ 7] =        524288ULL,
+	[ 8] =       1048576ULL,
+	[ 9] =       2097152ULL,
+	[10] =       4194304ULL,
+	[11] =       8388608ULL,
+	[12] =      16777216ULL,
+	[13] =      33554432ULL,
+	[14] =      67108864ULL,
+	[15] =     134217728ULL,
+
+	[16] =     268435456ULL,
+	[17] =     536870912ULL,
+	[18] =    1073741824ULL,
+	[19] =    2147483648ULL,
+	[20] =    4294967296ULL,
+	[21] =    8589934592ULL,
+	[22] =   17179869184ULL,
+	[23] =   34359738368ULL,
+	[24] =   68719476736ULL,
+	[25] =  137438953472ULL,
+	[26] =  274877906944ULL,
+	[27] =  549755813888ULL,
+	[28] = 1099511627776ULL,
+	[29] = 2199023255552ULL,
+	[30] = 4398046511104ULL,
+	[31] = 8796093022208ULL,
 };
 
 
@@ -526,24 +520,94 @@ u32 pib_get_num_of_packets(struct pib_qp *qp, u32 length)
 }
 
 
-u32 pib_get_rnr_nak_time(int timeout)
+/*
+ *  Convert nanoseconds into the clock of the QP scheduler (jiffies or
+ *  microseconds). The result is limited under PIB_SCHED_TIMEOUT because
+ *  the scheduler regards it as infinity.
+ */
+static unsigned long nsec_to_sched_time(u64 nsec)
+{
+	u64 value;
+
+	if (pib_hr_sched)
+		value = div_u64(nsec, NSEC_PER_USEC);
+	else
+		value = div_u64(nsec * HZ, NSEC_PER_SEC);
+
+	if (PIB_SCHED_TIMEOUT <= value)
+		value = PIB_SCHED_TIMEOUT - 1;
+
+	return (unsigned long)value;
+}
+
+
+unsigned long pib_get_rnr_nak_time(int timeout)
 {
-	if (rnr_nak_timeout[timeout] == 0)
+	unsigned long value;
+
+	value = nsec_to_sched_time((u64)rnr_nak_timeout[timeout] * NSEC_PER_USEC);
+
+	if (value == 0)
 		return 1;
 
-	return rnr_nak_timeout[timeout];
+	return value;
 }
 
 
 unsigned long pib_get_local_ack_time(int timeout)
 {
+	unsigned long value;
+
 	if (timeout == 0)
 		return PIB_SCHED_TIMEOUT;
 
-	if (local_ack_timeout[timeout] == 0)
+	value = nsec_to_sched_time(local_ack_timeout[timeout]);
+
+	if (value == 0)
 		return 1;
 
-	return local_ack_timeout[timeout];
+	return value;
+}
+
+
+unsigned long pib_get_rto_time(u64 nsec)
+{
+	unsigned long value;
+
+	value = nsec_to_sched_time(nsec);
+
+	if (value == 0)
+		return 1;
+
+	return value;
+}
+
+
+/*
+ *  遅延 ACK の猶予。スケジューラの時刻の単位に切り上げる。
+ */
+unsigned long pib_get_ack_delay_time(void)
+{
+	unsigned long value;
+
+	value = nsec_to_sched_time((u64)pib_ack_delay * NSEC_PER_USEC);
+
+	if ((value == 0) && (pib_ack_delay > 0))
+		return 1;
+
+	return value;
+}
+
+
+int pib_get_max_rd_atom(void)
+{
+	if (pib_max_rd_atom < 1)
+		return 1;
+
+	if (PIB_MAX_RD_ATOM_LIMIT < pib_max_rd_atom)
+		return PIB_MAX_RD_ATOM_LIMIT;
+
+	return pib_max_rd_atom;
 }
 
 
@@ -552,7 +616,7 @@ u8 pib_get_local_ca_ack_delay(void)
 	u8 i;
 
 	for (i=1 ; i<ARRAY_SIZE(local_ack_timeout) ; i++)
-		if (local_ack_timeout[i] > 0)
+		if (nsec_to_sched_time(local_ack_timeout[i]) > 0)
 			return i;
 
 	return 31;
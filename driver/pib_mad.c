@@ -552,11 +552,15 @@ static int subn_set_portinfo(struct ib_smp *smp, struct pib_dev *dev, u8 in_port
 
 	if (!pib_multi_host_mode) {
 		if (old_lid != new_lid) {
-			if (old_lid != 0)
-				pib_lid_table[old_lid] = NULL;
-			if (new_lid != 0)
+			if (old_lid != 0) {
+				pib_lid_table[old_lid]     = NULL;
+				RCU_INIT_POINTER(pib_lid_dev_table[old_lid], NULL);
+			}
+			if (new_lid != 0) {
 				pib_lid_table[new_lid] =
 					dev->ports[port_num - 1].sockaddr;
+				rcu_assign_pointer(pib_lid_dev_table[new_lid], dev);
+			}
 		}
 	}
 
@@ -635,6 +639,7 @@ void pib_subn_set_portinfo(struct ib_smp *smp, struct pib_port *port, u8 port_nu
 		port->ib_port_attr.sm_lid	= be16_to_cpu(port_info->sm_lid);
 		port->gid[0].global.subnet_prefix = port_info->gid_prefix;
 		port->mkey_lease_period		= be16_to_cpu(port_info->mkey_lease_period);
+		atomic_inc(&port->header_generation);
 	}
 
 	if (type != PIB_PORT_BASE_SP0) { 
@@ -814,6 +819,7 @@ static int subn_set_pkey_table(struct ib_smp *smp, struct pib_dev *dev, u8 in_po
 
 		dev->ports[in_port_num - 1].pkey_table[i] = nkey;
 	}
+	atomic_inc(&dev->ports[in_port_num - 1].header_generation);
 	spin_unlock_irqrestore(&dev->lock, flags);
 
 	if (changed) {
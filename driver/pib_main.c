@@ -10,6 +10,7 @@
 #include <linux/cpumask.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
 #include <linux/errno.h>
 #include <linux/netdevice.h>
 #include <linux/inetdevice.h>
@@ -46,6 +47,7 @@ u64 pib_hca_guid_base;
 struct pib_dev *pib_devs[PIB_MAX_HCA];
 struct pib_easy_sw  pib_easy_sw;
 struct sockaddr **pib_lid_table;
+struct pib_dev **pib_lid_dev_table;
 
 
 int pib_debug_level;
@@ -80,6 +82,62 @@ static u16 server_port = PIB_NETD_DEFAULT_PORT;
 module_param_named(port, server_port, ushort, S_IRUGO);
 MODULE_PARM_DESC(port, "pibnetd's port number");
 
+unsigned int pib_hr_sched;
+module_param_named(hr_sched, pib_hr_sched, uint, S_IRUGO);
+MODULE_PARM_DESC(hr_sched, "Use high resolution timers for QP scheduling if > 0");
+
+unsigned int pib_zcopy_tx;
+module_param_named(zcopy_tx, pib_zcopy_tx, uint, S_IRUGO);
+MODULE_PARM_DESC(zcopy_tx, "Send RC payloads of messages this size or larger directly from MR pages (0: disabled)");
+
+unsigned int pib_zcopy_rx;
+module_param_named(zcopy_rx, pib_zcopy_rx, uint, S_IRUGO);
+MODULE_PARM_DESC(zcopy_rx, "Receive RC SEND/RDMA WRITE payloads directly into MR pages if > 0");
+
+unsigned int pib_direct_loopback = 0;
+module_param_named(direct_loopback, pib_direct_loopback, uint, S_IRUGO);
+MODULE_PARM_DESC(direct_loopback, "Deliver packets between local HCAs without UDP sockets in single-host-mode if > 0");
+
+unsigned int pib_send_window = PIB_DEFAULT_SEND_WINDOW;
+module_param_named(send_window, pib_send_window, uint, 0644);
+MODULE_PARM_DESC(send_window, "Maximum unacknowledged packets per RC QP (applied when QP moves to RTS)");
+
+unsigned int pib_ack_coalesce = 1;
+module_param_named(ack_coalesce, pib_ack_coalesce, uint, 0644);
+MODULE_PARM_DESC(ack_coalesce, "Acknowledge up to this many RC packets with one coalesced ACK (1: disabled)");
+
+unsigned int pib_ack_delay = PIB_DEFAULT_ACK_DELAY;
+module_param_named(ack_delay, pib_ack_delay, uint, 0644);
+MODULE_PARM_DESC(ack_delay, "Microseconds a coalesced RC ACK may be delayed");
+
+unsigned int pib_selective_retransmit;
+module_param_named(selective_retransmit, pib_selective_retransmit, uint, 0644);
+MODULE_PARM_DESC(selective_retransmit, "Resend only RC packets after the NAK'ed or last acknowledged PSN if > 0");
+
+unsigned int pib_adaptive_rto;
+module_param_named(adaptive_rto, pib_adaptive_rto, uint, 0644);
+MODULE_PARM_DESC(adaptive_rto, "Derive RC local ACK timeouts from measured RTT, bounded by the QP's timeout attribute, if > 0");
+
+unsigned int pib_local_fabric;
+module_param_named(local_fabric, pib_local_fabric, uint, 0644);
+MODULE_PARM_DESC(local_fabric, "Move RC RDMA WRITE/READ data directly between MRs when both QPs are on this host in single-host-mode if > 0");
+
+unsigned int pib_max_rd_atom = PIB_MAX_RD_ATOM;
+module_param_named(max_rd_atom, pib_max_rd_atom, uint, S_IRUGO);
+MODULE_PARM_DESC(max_rd_atom, "Maximum outstanding RDMA READ/ATOMIC requests per QP (from 1 to 255)");
+
+unsigned int pib_read_burst = PIB_DEFAULT_READ_BURST;
+module_param_named(read_burst, pib_read_burst, uint, 0644);
+MODULE_PARM_DESC(read_burst, "RDMA READ response packets sent per scheduling turn of a QP");
+
+unsigned int pib_send_burst = PIB_DEFAULT_SEND_BURST;
+module_param_named(send_burst, pib_send_burst, uint, 0644);
+MODULE_PARM_DESC(send_burst, "RC/UC SEND and RDMA WRITE packets sent per scheduling turn of a QP");
+
+static unsigned int pib_busy_poll;
+module_param_named(busy_poll, pib_busy_poll, uint, S_IRUGO);
+MODULE_PARM_DESC(busy_poll, "Microseconds for kthreads to busy-poll before sleeping (0: disabled)");
+
 static struct class *dummy_parent_class; /* /sys/class/pib */
 static struct device *dummy_parent_device;
 static u64 dummy_parent_device_dma_mask = DMA_BIT_MASK(32);
@@ -230,6 +288,58 @@ void pib_fill_grh(struct pib_dev *dev, u8 port_num, struct ib_grh *dest, const s
 }
 
 
+/*
+ *  LRH, GRH (AH に GRH があれば), BTH を buffer に書き込み、その長さを返す。
+ *  BTH の OpCode と PSN は 0 のまま。
+ */
+u8 pib_fill_packet_header(struct pib_dev *dev, u8 port_num, const struct ib_ah_attr *ah_attr, __be16 pkey, u32 dest_qp_num, void *buffer)
+{
+	void *top = buffer;
+	struct pib_packet_lrh *lrh;
+	struct pib_packet_bth *bth;
+	u8 lnh;
+
+	memset(buffer, 0, PIB_PACKET_HEADER_TEMPLATE_SIZE);
+
+	lrh = (struct pib_packet_lrh*)buffer;
+	buffer += sizeof(*lrh);
+	if (ah_attr->ah_flags & IB_AH_GRH) {
+		pib_fill_grh(dev, port_num, (struct ib_grh*)buffer, &ah_attr->grh);
+		buffer += sizeof(struct ib_grh);
+		lnh = 0x3;
+	} else
+		lnh = 0x2;
+	bth = (struct pib_packet_bth*)buffer;
+	buffer += sizeof(*bth);
+
+	lrh->sl_rsv_lnh = (ah_attr->sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
+	lrh->dlid   = cpu_to_be16(ah_attr->dlid);
+	lrh->slid   = cpu_to_be16(dev->ports[port_num - 1].ib_port_attr.lid);
+
+	bth->pkey   = pkey;
+	bth->destQP = cpu_to_be32(dest_qp_num);
+
+	return buffer - top;
+}
+
+
+void pib_build_packet_header_template(struct pib_dev *dev, u8 port_num, const struct ib_ah_attr *ah_attr, __be16 pkey, u32 dest_qp_num, struct pib_packet_header_template *template)
+{
+	u32 generation;
+
+	/* 組み立て中に LID などが変わっても、古い世代が残るので次回作り直される */
+	generation = atomic_read(&dev->ports[port_num - 1].header_generation);
+
+	write_seqcount_begin(&template->seq);
+
+	template->port_num   = port_num;
+	template->length     = pib_fill_packet_header(dev, port_num, ah_attr, pkey, dest_qp_num, template->buffer);
+	template->generation = generation;
+
+	write_seqcount_end(&template->seq);
+}
+
+
 static int pib_query_pkey(struct ib_device *ibdev, u8 port_num, u16 index, u16 *pkey)
 {
 	struct pib_dev *dev;
@@ -373,6 +483,37 @@ static ssize_t show_local_ack_timeout(struct device *device, struct device_attri
 }
 
 
+static ssize_t show_busy_poll(struct device *device, struct device_attribute *attr,
+			      char *buf)
+{
+	struct pib_dev *dev =
+		container_of(device, struct pib_dev, ib_dev.dev);
+
+	return sprintf(buf, "%u\n", dev->busy_poll);
+}
+
+
+static ssize_t store_busy_poll(struct device *device, struct device_attribute *attr,
+			       const char *buf, size_t count)
+{
+	unsigned int busy_poll;
+	ssize_t result;	
+	struct pib_dev *dev =
+		container_of(device, struct pib_dev, ib_dev.dev);
+
+	result = sscanf(buf, "%u", &busy_poll);
+	if (result != 1)
+		return -EINVAL;
+
+	if (PIB_MAX_BUSY_POLL < busy_poll)
+		return -EINVAL;
+
+	pib_set_busy_poll(dev, busy_poll);
+
+	return count;
+}
+
+
 #ifdef PIB_HACK_IMM_DATA_LKEY
 static ssize_t show_imm_data_lkey(struct device *device, struct device_attribute *attr,
 			     char *buf)
@@ -387,6 +528,7 @@ static ssize_t show_imm_data_lkey(struct device *device, struct device_attribute
 
 static DEVICE_ATTR(local_ca_ack_delay,	S_IRUGO|S_IWUSR, show_local_ca_ack_delay, store_local_ca_ack_delay);
 static DEVICE_ATTR(local_ack_timeout,	S_IRUGO,         show_local_ack_timeout,  NULL);
+static DEVICE_ATTR(busy_poll,		S_IRUGO|S_IWUSR, show_busy_poll,          store_busy_poll);
 
 #ifdef PIB_HACK_IMM_DATA_LKEY
 static DEVICE_ATTR(imm_data_lkey, S_IRUGO, show_imm_data_lkey, NULL);
@@ -396,6 +538,7 @@ static DEVICE_ATTR(imm_data_lkey, S_IRUGO, show_imm_data_lkey, NULL);
 static struct device_attribute *pib_class_attributes[] = {
 	&dev_attr_local_ca_ack_delay,
 	&dev_attr_local_ack_timeout,
+	&dev_attr_busy_poll,
 #ifdef PIB_HACK_IMM_DATA_LKEY
 	&dev_attr_imm_data_lkey,
 #endif
@@ -424,10 +567,10 @@ static struct pib_dev *pib_dev_add(struct device *dma_device, int dev_id)
 		.max_cqe             = 4194303,
 		.max_mr              = PIB_MAX_MR - 1, /* MR0 is invalid */
 		.max_pd              = PIB_MAX_PD - 1, /* PD0 is invalid */
-		.max_qp_rd_atom      = PIB_MAX_RD_ATOM,
+		.max_qp_rd_atom      = pib_get_max_rd_atom(),
 		.max_ee_rd_atom      =       0,
 		.max_res_rd_atom     = 2096128,
-		.max_qp_init_rd_atom =     128,
+		.max_qp_init_rd_atom = max(128, pib_get_max_rd_atom()),
 		.max_ee_init_rd_atom =       0,
 		.atomic_cap          = IB_ATOMIC_GLOB,
 		.masked_atomic_cap   = IB_ATOMIC_GLOB,
@@ -570,10 +713,6 @@ static struct pib_dev *pib_dev_add(struct device *dma_device, int dev_id)
 	dev->last_qp_num		= pib_random() & PIB_QPN_MASK;
 	dev->qp_table			= RB_ROOT;
 
-	spin_lock_init(&dev->qp_sched.lock);
-	dev->qp_sched.wakeup_time	= jiffies;
-	dev->qp_sched.rb_root		= RB_ROOT;
-
 	spin_lock_init(&dev->wq_sched.lock);
 	INIT_LIST_HEAD(&dev->wq_sched.head);
 	INIT_LIST_HEAD(&dev->wq_sched.timer_head);
@@ -582,6 +721,8 @@ static struct pib_dev *pib_dev_add(struct device *dma_device, int dev_id)
 
 	dev->ib_dev_attr		= ib_dev_attr;
 
+	dev->busy_poll			= min_t(unsigned int, pib_busy_poll, PIB_MAX_BUSY_POLL);
+
 	dev->mcast_table		= vzalloc(sizeof(struct list_head) * (PIB_MAX_LID - PIB_MCAST_LID_BASE));
 	if (!dev->mcast_table)
 		goto err_mcast_table;
@@ -717,6 +858,8 @@ static int init_port(struct pib_dev *dev, u8 port_num)
 	for (j=0 ; j < PIB_PKEY_TABLE_LEN ; j++)
 		port->pkey_table[j] = IB_DEFAULT_PKEY_FULL;
 
+	atomic_set(&port->header_generation, 1);
+
 	if (pib_multi_host_mode) {
 		port->is_connected = false;
 		port->ib_port_attr.phys_state = PIB_PHYS_PORT_POLLING;
@@ -890,6 +1033,9 @@ static void pib_kmem_cache_destroy(void)
 	if (pib_ah_cachep)
 		kmem_cache_destroy(pib_ah_cachep);
 
+	/* call_rcu で解放待ちの MR */
+	rcu_barrier();
+
 	if (pib_mr_cachep)
 		kmem_cache_destroy(pib_mr_cachep);
 
@@ -1064,6 +1210,10 @@ static int __init pib_init(void)
 		pib_lid_table = vzalloc(sizeof(struct sockaddr*) * PIB_MAX_LID);
 		if (!pib_lid_table)
 			goto err_alloc_lid_table;
+
+		pib_lid_dev_table = vzalloc(sizeof(struct pib_dev*) * PIB_MAX_LID);
+		if (!pib_lid_dev_table)
+			goto err_alloc_lid_dev_table;
 	}
 
 	if (pib_kmem_cache_create()) {
@@ -1109,6 +1259,12 @@ err_create_switch:
 	pib_kmem_cache_destroy();
 err_kmem_cache_destroy:
 
+	if (pib_lid_dev_table)
+		vfree(pib_lid_dev_table);
+	pib_lid_dev_table = NULL;
+
+err_alloc_lid_dev_table:
+
 	if (pib_lid_table)
 		vfree(pib_lid_table);
 	pib_lid_table = NULL;
@@ -1149,6 +1305,11 @@ static void __exit pib_cleanup(void)
 
 	pib_kmem_cache_destroy();
 
+	if (pib_lid_dev_table) {
+		vfree(pib_lid_dev_table);
+		pib_lid_dev_table = NULL;
+	}
+
 	if (pib_lid_table) {
 		vfree(pib_lid_table);
 		pib_lid_table = NULL;
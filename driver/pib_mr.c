@@ -7,6 +7,9 @@
  */
 #include <linux/module.h>
 #include <linux/init.h>
+#include <linux/mm.h>
+#include <linux/vmalloc.h>
+#include <linux/rcupdate.h>
 #include <asm/atomic.h>
 
 
@@ -15,10 +18,63 @@
 #include "pib_trace.h"
 
 
-static struct pib_mr *create_mr(struct pib_dev *dev, struct pib_pd *pd, enum pib_mr_state init_state, bool fast_reg_mr, int max_page_list_len);
+static struct pib_mr *create_mr(struct pib_dev *dev, enum pib_mr_state init_state, bool fast_reg_mr, int max_page_list_len);
+static void free_mr(struct pib_dev *dev, struct pib_mr *mr);
+static void free_mr_rcu(struct rcu_head *head);
 static enum ib_wc_status copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64 size, int access_flags, enum pib_mr_direction direction, bool check_only);
 static int mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction);
 static bool mr_copy_data_sub(void *buffer, void *target_vaddr, u64 range, u64 swap, u64 compare, enum pib_mr_direction direction);
+static bool mr_map_data_sub(struct pib_zcopy *zcopy, struct page *page, void *target_vaddr, u64 range);
+static struct pib_mr_extent *alloc_extent_array(struct ib_umem *umem, unsigned long *nr_extents_p);
+static void free_extent_array(struct pib_mr_extent *extents);
+static void add_extent(struct pib_mr_extent *extents, unsigned long *nr_extents_p, struct pib_mr_extent *last, struct page *page, unsigned int length);
+static int fast_reg_mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction);
+static bool map_extent(struct pib_zcopy *zcopy, const struct pib_mr_extent *extent, u64 delta, u64 range);
+static int copy_mr_data(struct pib_pd *pd, struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction);
+
+
+/*
+ *  mr_idr の参照は RCU で保護する。
+ *  MR は初期化し終えてから reg_mr で mr_idr に登録して公開する。
+ *  データコピーは rcu_read_lock の中で行い、pd->lock は取らない。
+ *  mr_idr の更新と MR の invalidate・fast reg は pd->lock の下で行う。
+ */
+static inline struct pib_mr *lookup_mr(struct pib_pd *pd, u32 key)
+{
+	return idr_find(&pd->mr_idr, (key & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT);
+}
+
+
+/*
+ *  pd->lock を取らない読み手は MR を使う間 nr_users を上げておく。
+ *  pib_dereg_mr は deregistered を立ててから nr_users が 0 になるのを待つので、
+ *  ページを解放するのに grace period を待たなくてよい。
+ *  構造体は lookup_mr から nr_users を上げるまでの間も参照されるので call_rcu で解放する。
+ */
+static inline void put_mr(struct pib_mr *mr)
+{
+	/* 値を返す atomic 操作は前後のメモリアクセスと順序付けられる */
+	atomic_dec_return(&mr->nr_users);
+}
+
+
+static inline struct pib_mr *get_mr(struct pib_pd *pd, u32 key)
+{
+	struct pib_mr *mr;
+
+	mr = lookup_mr(pd, key);
+	if (!mr)
+		return NULL;
+
+	atomic_inc_return(&mr->nr_users);
+
+	if (ACCESS_ONCE(mr->deregistered)) {
+		put_mr(mr);
+		return NULL;
+	}
+
+	return mr;
+}
 
 
 static int
@@ -27,14 +83,21 @@ reg_mr(struct pib_pd *pd, struct pib_mr *mr)
 	int i;
 	unsigned long flags;
 
-	/* find an empty slot in mr_table[] */
+	idr_preload(GFP_KERNEL);
 	spin_lock_irqsave(&pd->lock, flags);
-	for (i=0 ; i<PIB_MAX_MR_PER_PD ; i++)
-		if (pd->mr_table[i] == NULL)
-			goto generate_new_key;
-	spin_unlock_irqrestore(&pd->lock, flags);
 
-	return -1;
+	/*
+	 *  キーが決まるまでは NULL でスロットを予約しておく。
+	 *  key1 は 4 ビットしかないので、解放直後の index をすぐ再利用すると
+	 *  古いキーが 1/16 の確率で新しい MR に一致してしまう。
+	 *  idr_alloc_cyclic で index を一巡するまで再利用しない。
+	 */
+	i = idr_alloc_cyclic(&pd->mr_idr, NULL, 0, PIB_MAX_MR_PER_PD, GFP_NOWAIT);
+	if (i < 0) {
+		spin_unlock_irqrestore(&pd->lock, flags);
+		idr_preload_end();
+		return -1;
+	}
 
 generate_new_key:
 	mr->ib_mr.lkey = (i + pib_random() * PIB_MAX_MR_PER_PD) << PIB_MR_INDEX_SHIFT;
@@ -48,11 +111,13 @@ generate_new_key:
 		goto generate_new_key;
 #endif
 
-	pd->mr_table[i] = mr;
+	/* idr_replace は rcu_assign_pointer で公開するので、ここまでの初期化が先に見える */
+	idr_replace(&pd->mr_idr, mr, i);
 
 	pd->nr_mr++;
 
 	spin_unlock_irqrestore(&pd->lock, flags);
+	idr_preload_end();
 
 	return 0;
 }
@@ -71,7 +136,7 @@ pib_get_dma_mr(struct ib_pd *ibpd, int access_flags)
 	dev = to_pdev(ibpd->device);
 	pd = to_ppd(ibpd);
 
-	mr = create_mr(dev, pd, PIB_MR_VALID, false, 0);
+	mr = create_mr(dev, PIB_MR_VALID, false, 0);
 	if (IS_ERR(mr))
 		return (struct ib_mr *)mr;
 
@@ -81,6 +146,11 @@ pib_get_dma_mr(struct ib_pd *ibpd, int access_flags)
 	mr->access_flags = access_flags;
 	mr->is_dma	= 1;
 
+	if (reg_mr(pd, mr)) {
+		free_mr(dev, mr);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	pib_trace_api(dev, IB_USER_VERBS_CMD_REG_MR, mr->mr_num);
 
 	return &mr->ib_mr;
@@ -96,6 +166,8 @@ pib_reg_user_mr(struct ib_pd *ibpd, u64 start, u64 length,
 	struct pib_pd *pd;
 	struct ib_umem *umem;
 	struct pib_mr *mr;
+	struct pib_mr_extent *extents;
+	unsigned long nr_extents;
 
 	if (!ibpd)
 		return ERR_PTR(-EINVAL);
@@ -107,8 +179,12 @@ pib_reg_user_mr(struct ib_pd *ibpd, u64 start, u64 length,
 			   access_flags, 0);
 	if (IS_ERR(umem))
 		return (struct ib_mr *)umem;
+
+	extents = alloc_extent_array(umem, &nr_extents);
+	if (!extents)
+		goto err_alloc_extents;
 	
-	mr = create_mr(dev, pd, PIB_MR_VALID, false, 0);
+	mr = create_mr(dev, PIB_MR_VALID, false, 0);
 	if (IS_ERR(mr))
 		goto err_alloc_mr;
 
@@ -117,20 +193,34 @@ pib_reg_user_mr(struct ib_pd *ibpd, u64 start, u64 length,
 	mr->virt_addr	= virt_addr;
 	mr->access_flags = access_flags;
 	mr->ib_umem	= umem;
+	mr->extents	= extents;
+	mr->nr_extents	= nr_extents;
+
+	if (reg_mr(pd, mr))
+		goto err_reg_mr;
 
 	pib_trace_api(dev, IB_USER_VERBS_CMD_REG_MR, mr->mr_num);
 
 	return &mr->ib_mr;
 
+err_reg_mr:
+	free_mr(dev, mr);
+
 err_alloc_mr:
+	free_extent_array(extents);
+
+err_alloc_extents:
 	ib_umem_release(umem);
 
 	return ERR_PTR(-ENOMEM);
 }
 
 
+/*
+ *  MR を作るだけで PD には登録しない。属性を設定してから reg_mr を呼ぶこと。
+ */
 static struct pib_mr *
-create_mr(struct pib_dev *dev, struct pib_pd *pd, enum pib_mr_state init_state,
+create_mr(struct pib_dev *dev, enum pib_mr_state init_state,
 	  bool fast_reg_mr, int max_page_list_len)
 {
 	struct pib_mr *mr;
@@ -162,23 +252,14 @@ create_mr(struct pib_dev *dev, struct pib_pd *pd, enum pib_mr_state init_state,
 	mr->mr_num = mr_num;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	if (reg_mr(pd, mr))
-		goto err_reg_mr;
-
 	mr->state = init_state;
+	mr->is_fast_reg_mr = fast_reg_mr;
 
 	mr->page_list = page_list;
 	mr->max_page_list_len = max_page_list_len;
 
 	return mr;
 
-err_reg_mr:
-	spin_lock_irqsave(&dev->lock, flags);
-	list_del(&mr->list);
-	dev->nr_mr--;
-	pib_dealloc_obj_num(dev, PIB_BITMAP_MR_START, mr_num);
-	spin_unlock_irqrestore(&dev->lock, flags);
-
 err_alloc_page_list:
 	if (page_list)
 		kfree(page_list);
@@ -198,7 +279,7 @@ pib_dereg_mr(struct ib_mr *ibmr)
 	struct pib_mr *mr, *mr_comp;
 	struct pib_pd *pd;
 	unsigned long flags;
-	u32 lkey;
+	u32 index;
 
 	if (!ibmr)
 		return -EINVAL;
@@ -210,10 +291,10 @@ pib_dereg_mr(struct ib_mr *ibmr)
 	pib_trace_api(dev, IB_USER_VERBS_CMD_DEREG_MR, mr->mr_num);
 
 	spin_lock_irqsave(&pd->lock, flags);
-	lkey = (mr->ib_mr.lkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT;
-	mr_comp = pd->mr_table[lkey];
+	index = (mr->ib_mr.lkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT;
+	mr_comp = idr_find(&pd->mr_idr, index);
 	if (mr == mr_comp) {
-		pd->mr_table[lkey] = NULL;
+		idr_remove(&pd->mr_idr, index);
 		pd->nr_mr--;
 	} else {
 		pr_err("pib: MR(%u) don't be registered in PD(%u) (pib_dereg_mr)\n",
@@ -222,9 +303,33 @@ pib_dereg_mr(struct ib_mr *ibmr)
 	}
 	spin_unlock_irqrestore(&pd->lock, flags);
 
+	/*
+	 *  データコピー中の kthread が MR を使い終えるまで待つ。
+	 *  これ以降に get_mr した読み手は deregistered を見て引き返す。
+	 */
+	mr->deregistered = true;
+	smp_mb();
+
+	while (atomic_read(&mr->nr_users) != 0)
+		cpu_relax();
+
 	if (mr->ib_umem)
 		ib_umem_release(mr->ib_umem);
 
+	if (mr->extents)
+		free_extent_array(mr->extents);
+
+	free_mr(dev, mr);
+
+	return ret;
+}
+
+
+static void
+free_mr(struct pib_dev *dev, struct pib_mr *mr)
+{
+	unsigned long flags;
+
 	spin_lock_irqsave(&dev->lock, flags);
 	list_del(&mr->list);
 	dev->nr_mr--;
@@ -234,9 +339,14 @@ pib_dereg_mr(struct ib_mr *ibmr)
 	if (mr->page_list)
 		kfree(mr->page_list);
 
-	kmem_cache_free(pib_mr_cachep, mr);
+	call_rcu(&mr->rcu, free_mr_rcu);
+}
 
-	return ret;
+
+static void
+free_mr_rcu(struct rcu_head *head)
+{
+	kmem_cache_free(pib_mr_cachep, container_of(head, struct pib_mr, rcu));
 }
 
 
@@ -254,7 +364,7 @@ pib_alloc_fast_reg_mr(struct ib_pd *ibpd,
 	dev = to_pdev(ibpd->device);
 	pd = to_ppd(ibpd);
 
-	mr = create_mr(dev, pd, PIB_MR_FREE, true, max_page_list_len);
+	mr = create_mr(dev, PIB_MR_FREE, true, max_page_list_len);
 	if (IS_ERR(mr))
 		return (struct ib_mr *)mr;
 
@@ -263,6 +373,11 @@ pib_alloc_fast_reg_mr(struct ib_pd *ibpd,
 	mr->virt_addr	= 0;
 	mr->access_flags = 0;
 
+	if (reg_mr(pd, mr)) {
+		free_mr(dev, mr);
+		return ERR_PTR(-ENOMEM);
+	}
+
 	pib_trace_api(dev, PIB_USER_VERBS_CMD_ALLOC_FAST_REG_MR, mr->mr_num);
 
 	return &mr->ib_mr;
@@ -323,57 +438,79 @@ pib_free_fast_reg_page_list(struct ib_fast_reg_page_list *page_list)
 }
 
 
+/*
+ *  cursor が与えられれば、前回のコピーが終わった SGE から探し始める。
+ *  offset が cursor より前に戻った場合 (再送など) は先頭から辿る。
+ *
+ *  Lock: rcu_read_lock
+ */
 enum ib_wc_status
-pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction)
+pib_util_mr_copy_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, struct pib_sge_cursor *cursor, void *buffer, u64 offset, u64 size, int access_flags, enum pib_mr_direction direction)
 {
-	int i;
+	int i = 0;
+	u64 base = 0;
+	struct pib_mr *mr;
 
 	if (PIB_MAX_PAYLOAD_LEN < size)
 		return IB_WC_LOC_LEN_ERR;
 
-	for (i=0 ; i<num_sge ; i++) {
+	if (cursor && (cursor->sge_index < num_sge) && (cursor->base <= offset)) {
+		i    = cursor->sge_index;
+		base = cursor->base;
+	}
+
+	for ( ; i<num_sge ; base += sge_array[i].length, i++) {
 		struct ib_sge sge = sge_array[i];
-		struct pib_mr *mr;
-		u64 range, mr_base, offset_tmp;
+		u64 sge_offset, chunk_size;
+
+		if (base + sge.length <= offset)
+			/* この SGE は既にコピー済み */
+			continue;
 
-		mr = pd->mr_table[(sge.lkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+		mr = get_mr(pd, sge.lkey);
 
 		if (!mr)
 			return IB_WC_LOC_PROT_ERR;
 
 		if (mr->state != PIB_MR_VALID)
-			return IB_WC_LOC_PROT_ERR; /* @todo */
+			goto prot_err; /* @todo */
 
 		if (sge.lkey != mr->ib_mr.lkey)
-			return IB_WC_LOC_PROT_ERR;
+			goto prot_err;
 
 		if ((mr->access_flags & access_flags) != access_flags)
-			return IB_WC_LOC_PROT_ERR;
-
-		range = min_t(u64, sge.length, offset + size);
+			goto prot_err;
 
-		offset_tmp = offset;
+		sge_offset = offset - base;
+		chunk_size = min_t(u64, sge.length - sge_offset, size);
 
-		if (0 < offset)
-			offset = (sge.length < offset) ? (offset - sge.length) : 0;
-
-		if ((sge.addr         <  mr->start) || (mr->start + mr->length <= sge.addr) ||
-		    (sge.addr + range <= mr->start) || (mr->start + mr->length <  sge.addr + range))
-			continue;
+		if ((sge.addr                           <  mr->start) || (mr->start + mr->length <= sge.addr) ||
+		    (sge.addr + sge_offset + chunk_size <= mr->start) ||
+		    (mr->start + mr->length <  sge.addr + sge_offset + chunk_size))
+			goto prot_err;
 
-		mr_base = sge.addr - mr->start;
+		copy_mr_data(pd, mr, buffer, sge.addr - mr->start + sge_offset, chunk_size, 0, 0, direction);
+		put_mr(mr);
 
-		if (offset_tmp < range) {
-			u64 chunk_size = range - offset_tmp;
-			mr_copy_data(mr, buffer, mr_base + offset_tmp, chunk_size, 0, 0, direction);
+		if (direction != PIB_MR_MAP) /* PIB_MR_MAP では buffer は struct pib_zcopy */
 			buffer += chunk_size;
-			size   -= chunk_size;
-		}
+		offset += chunk_size;
+		size   -= chunk_size;
 
-		if (size == 0)
+		if (size == 0) {
+			if (cursor) {
+				cursor->sge_index = i;
+				cursor->base      = base;
+			}
 			return IB_WC_SUCCESS;
+		}
 	}
 
+	return IB_WC_LOC_PROT_ERR;
+
+prot_err:
+	put_mr(mr);
+
 	return IB_WC_LOC_PROT_ERR;
 }
 
@@ -396,39 +533,45 @@ static enum ib_wc_status
 copy_data_with_rkey(struct pib_pd *pd, u32 rkey, void *buffer, u64 address, u64 size, int access_flags, enum pib_mr_direction direction, bool check_only)
 {
 	struct pib_mr *mr;
+	enum ib_wc_status status = IB_WC_LOC_PROT_ERR;
 
 	if (PIB_MAX_PAYLOAD_LEN < size)
 		return IB_WC_LOC_LEN_ERR;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = get_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_LOC_PROT_ERR;
 
 	if (mr->state != PIB_MR_VALID)
-		return IB_WC_LOC_PROT_ERR; /* @todo */
+		goto done; /* @todo */
 
 	if (rkey != mr->ib_mr.rkey)
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
 	if ((mr->access_flags & access_flags) != access_flags)
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
 	if (mr->is_dma) {
 		pr_err("pib: Can't use DMA MR in copy_data_with_rkey\n"); /* @todo */
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 	}
 
 	if ((address        <  mr->start) || (mr->start + mr->length <= address) ||
 	    (address + size <= mr->start) || (mr->start + mr->length <  address + size))
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
 	if (!check_only) {
-		if (mr_copy_data(mr, buffer, address - mr->start, size, 0, 0, direction))
-			return IB_WC_LOC_PROT_ERR;
+		if (copy_mr_data(pd, mr, buffer, address - mr->start, size, 0, 0, direction))
+			goto done;
 	}
 
-	return IB_WC_SUCCESS;
+	status = IB_WC_SUCCESS;
+
+done:
+	put_mr(mr);
+
+	return status;
 }
 
 
@@ -436,30 +579,36 @@ enum ib_wc_status
 pib_util_mr_atomic(struct pib_pd *pd, u32 rkey, u64 address, u64 swap, u64 compare, u64 *result, enum pib_mr_direction direction)
 {
 	struct pib_mr *mr;
+	enum ib_wc_status status = IB_WC_LOC_PROT_ERR;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = get_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_LOC_PROT_ERR;
 
 	if (mr->state != PIB_MR_VALID)
-		return IB_WC_LOC_PROT_ERR; /* @todo */
+		goto done; /* @todo */
 
 	if (rkey != mr->ib_mr.rkey)
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
 	if ((mr->access_flags & IB_ACCESS_REMOTE_ATOMIC) != IB_ACCESS_REMOTE_ATOMIC)
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
 	if ((address     <  mr->start) || (mr->start + mr->length <= address) ||
 	    (address + 8 <= mr->start) || (mr->start + mr->length <  address + 8))
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
-	if (mr_copy_data(mr, result, address - mr->start, 8, swap, compare,
+	if (copy_mr_data(pd, mr, result, address - mr->start, 8, swap, compare,
 			 (direction == PIB_MR_FETCHADD) ? PIB_MR_FETCHADD : PIB_MR_CAS))
-		return IB_WC_LOC_PROT_ERR;
+		goto done;
 
-	return IB_WC_SUCCESS;
+	status = IB_WC_SUCCESS;
+
+done:
+	put_mr(mr);
+
+	return status;
 }
 
 #ifndef PIB_NO_NEED_TO_DEFINE_IB_UMEM_OFFSET
@@ -469,139 +618,281 @@ static inline int ib_umem_offset(struct ib_umem *umem)
 }
 #endif
 
-static int
-mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction)
+/*
+ *  ib_umem のページを物理的に連続する範囲ごとにまとめる。
+ *  huge page で確保されたバッファは少数の大きな範囲になるので、
+ *  mr_copy_data は範囲ごとに 1 回の memcpy で済む。
+ */
+static struct pib_mr_extent *
+alloc_extent_array(struct ib_umem *umem, unsigned long *nr_extents_p)
 {
-	u64 addr;
-	struct ib_umem *umem;
+	unsigned long nr_extents;
+	size_t size;
+	struct pib_mr_extent *extents = NULL;
+	struct pib_mr_extent last;
 #if PIB_IB_DMA_MAPPING_VERSION >= 1 
 	struct scatterlist *sg;
 	int entry;
 #else
 	struct ib_umem_chunk *chunk;
+	int j;
 #endif
 
-	if (mr->state != PIB_MR_VALID)
-		return -EPERM;
+	/* 1 回目は範囲の数を数え、2 回目で配列に書き込む */
+	for (;;) {
+		nr_extents = 0;
+		memset(&last, 0, sizeof(last));
 
-	if (mr->is_dma)
-		goto dma;
+#if PIB_IB_DMA_MAPPING_VERSION >= 1
+		for_each_sg(umem->sg_head.sgl, sg, umem->nmap, entry)
+			add_extent(extents, &nr_extents, &last, sg_page(sg), sg->length);
+#else
+		list_for_each_entry(chunk, &umem->chunk_list, list)
+			for (j = 0; j < chunk->nents; j++)
+				add_extent(extents, &nr_extents, &last,
+					   sg_page(&chunk->page_list[j]), chunk->page_list[j].length);
+#endif
 
-	if (size == 0)
-		return 0;
+		if (extents)
+			break;
 
-	umem = mr->ib_umem;
+		/*
+		 *  ほとんどの MR は範囲が少ないので kcalloc で足りる。
+		 *  vzalloc はページ単位の確保と vmap を伴うので大きな配列だけに使う。
+		 *  どちらも 0 要素では確保できないので少なくとも 1 要素は確保する。
+		 */
+		size = sizeof(struct pib_mr_extent) * max(nr_extents, 1UL);
 
-	offset += ib_umem_offset(umem);
+		if (size <= PAGE_SIZE)
+			extents = kcalloc(max(nr_extents, 1UL), sizeof(struct pib_mr_extent), GFP_KERNEL);
+		else
+			extents = vzalloc(size);
 
-	addr = 0;
+		if (!extents)
+			return NULL;
+	}
 
-	if (mr->is_fast_reg_mr)
-		goto fast_reg_mr;
+	*nr_extents_p = nr_extents;
 
-#if PIB_IB_DMA_MAPPING_VERSION >= 1
-	for_each_sg(umem->sg_head.sgl, sg, umem->nmap, entry) {
-		void *vaddr;
+	return extents;
+}
 
-		vaddr = page_address(sg_page(sg));
-		if (!vaddr)
-			return -EINVAL;
 
-		if ((addr <= offset) && (offset < addr + umem->page_size)) {
-			u64 range;
-			void *target_vaddr;
+static void
+free_extent_array(struct pib_mr_extent *extents)
+{
+	if (is_vmalloc_addr(extents))
+		vfree(extents);
+	else
+		kfree(extents);
+}
 
-			range = min_t(u64, (addr + umem->page_size - offset), size);
-			target_vaddr = vaddr + (offset & (umem->page_size - 1));
 
-			if (mr_copy_data_sub(buffer, target_vaddr, range, swap, compare, direction))
-				return 0;
+/*
+ *  直前の範囲と物理的に連続していれば延長し、そうでなければ新しい範囲を始める。
+ *  extents が NULL の場合は数えるだけ。
+ */
+static void
+add_extent(struct pib_mr_extent *extents, unsigned long *nr_extents_p, struct pib_mr_extent *last, struct page *page, unsigned int length)
+{
+	if ((0 < *nr_extents_p) &&
+	    !PageHighMem(last->page) && !PageHighMem(page) &&
+	    PAGE_ALIGNED(last->length) &&
+	    (page_to_pfn(last->page) + (last->length >> PAGE_SHIFT) == page_to_pfn(page))) {
+		last->length += length;
+	} else {
+		last->offset += last->length;
+		last->length  = length;
+		last->page    = page;
+		(*nr_extents_p)++;
+	}
+
+	if (extents)
+		extents[*nr_extents_p - 1] = *last;
+}
 
-			offset += range;
-			buffer += range;
-			size   -= range;
-		}
 
-		if (size == 0)
-			return 0;
+/*
+ *  offset を含む範囲の添字を二分探索で求める。
+ */
+static inline unsigned long
+find_extent(const struct pib_mr *mr, u64 offset)
+{
+	unsigned long low = 0, high = mr->nr_extents;
+
+	while (low + 1 < high) {
+		unsigned long mid = low + (high - low) / 2;
 
-		addr  += umem->page_size;
+		if (mr->extents[mid].offset <= offset)
+			low = mid;
+		else
+			high = mid;
 	}
-#else
-	list_for_each_entry(chunk, &umem->chunk_list, list) {
-		int i;
-		for (i = 0; i < chunk->nents; i++) {
-			void *vaddr;
 
-			vaddr = page_address(sg_page(&chunk->page_list[i]));
-			if (!vaddr)
-				return -EINVAL;
+	return low;
+}
 
-			if ((addr <= offset) && (offset < addr + umem->page_size)) {
-				u64 range;
-				void *target_vaddr;
 
-				range = min_t(u64, (addr + umem->page_size - offset), size);
-				target_vaddr = vaddr + (offset & (umem->page_size - 1));
+/*
+ *  Fast Reg MR は invalidate と再登録で page_list が書き換わるので、
+ *  それらと同じく pd->lock の下でコピーする。それ以外の MR はロックを取らない。
+ */
+static int
+copy_mr_data(struct pib_pd *pd, struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction)
+{
+	int ret;
+	unsigned long flags;
 
-				if (mr_copy_data_sub(buffer, target_vaddr, range, swap, compare, direction))
-					return 0;
+	if (!mr->is_fast_reg_mr)
+		return mr_copy_data(mr, buffer, offset, size, swap, compare, direction);
 
-				offset += range;
-				buffer += range;
-				size   -= range;
-			}
+	spin_lock_irqsave(&pd->lock, flags);
+	ret = mr_copy_data(mr, buffer, offset, size, swap, compare, direction);
+	spin_unlock_irqrestore(&pd->lock, flags);
+
+	return ret;
+}
+
+
+static int
+mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction)
+{
+	unsigned long index;
+	struct pib_zcopy *zcopy = buffer; /* only for PIB_MR_MAP */
 
-			if (size == 0)
+	if (mr->state != PIB_MR_VALID)
+		return -EPERM;
+
+	if (mr->is_dma)
+		goto dma;
+
+	if (size == 0)
+		return 0;
+
+	if (mr->is_fast_reg_mr)
+		return fast_reg_mr_copy_data(mr, buffer, offset, size, swap, compare, direction);
+
+	offset += ib_umem_offset(mr->ib_umem);
+
+	for (index = find_extent(mr, offset) ; (index < mr->nr_extents) && (0 < size) ; index++) {
+		const struct pib_mr_extent *extent = &mr->extents[index];
+		u64 delta, range;
+		void *vaddr;
+
+		delta = offset - extent->offset;
+		if (extent->length <= delta)
+			break;
+
+		range = min_t(u64, extent->length - delta, size);
+
+		if (direction == PIB_MR_MAP) {
+			if (map_extent(zcopy, extent, delta, range))
 				return 0;
+		} else {
+			vaddr = page_address(extent->page);
+			if (!vaddr)
+				return -EINVAL;
 
-			addr  += umem->page_size;
+			if (mr_copy_data_sub(buffer, vaddr + delta, range, swap, compare, direction))
+				return 0;
 		}
+
+		offset += range;
+		buffer += range;
+		size   -= range;
 	}
-#endif
 
 	return 0;
 
-fast_reg_mr:
-	{
-		int i;
-		size_t page_size = 1UL << mr->page_shift;
+dma:
+	if (direction == PIB_MR_MAP)
+		mr_map_data_sub(zcopy, NULL, (void*)(uintptr_t)offset, size);
+	else
+		mr_copy_data_sub(buffer, (void*)(uintptr_t)offset, size, swap, compare, direction);
 
-		for (i = 0 ; i < mr->page_list_len ; i++) {
-			void *vaddr;
+	return 0;
+}
 
-			vaddr = mr->page_list[i];
 
-			if ((addr <= offset) && (offset < addr + page_size)) {
-				u64 range;
-				void *target_vaddr;
+static int
+fast_reg_mr_copy_data(struct pib_mr *mr, void *buffer, u64 offset, u64 size, u64 swap, u64 compare, enum pib_mr_direction direction)
+{
+	unsigned long index, nr_pages;
+	size_t page_size;
+	struct pib_zcopy *zcopy = buffer; /* only for PIB_MR_MAP */
 
-				range = min_t(u64, (addr + page_size - offset), size);
-				target_vaddr = vaddr + (offset & (page_size - 1));
+	nr_pages  = mr->page_list_len;
+	page_size = 1UL << mr->page_shift;
 
-				if (mr_copy_data_sub(buffer, target_vaddr, range, swap, compare, direction))
-					return 0;
+	for (index = offset >> mr->page_shift ; (index < nr_pages) && (0 < size) ; ) {
+		u64 range;
+		void *vaddr, *next_vaddr, *target_vaddr;
+		struct page *page;
 
-				offset += range;
-				buffer += range;
-				size   -= range;
-			}
+		vaddr = mr->page_list[index++];
+		if (!vaddr)
+			return -EINVAL;
+
+		range = min_t(u64, (page_size - (offset & (page_size - 1))), size);
+		target_vaddr = vaddr + (offset & (page_size - 1));
 
-			if (size == 0)
+		if (direction == PIB_MR_MAP) {
+			zcopy->fast_reg = true;
+			page = virt_addr_valid(vaddr) ? virt_to_page(vaddr) : NULL;
+			if (mr_map_data_sub(zcopy, page, target_vaddr, range))
 				return 0;
+		} else {
+			/* 仮想アドレスが連続するページは 1 回の memcpy で済ませる */
+			next_vaddr = vaddr + page_size;
+			while ((range < size) && (index < nr_pages) &&
+			       (mr->page_list[index] == next_vaddr)) {
+				range = min_t(u64, range + page_size, size);
+				next_vaddr += page_size;
+				index++;
+			}
 
-			addr  += page_size;
+			if (mr_copy_data_sub(buffer, target_vaddr, range, swap, compare, direction))
+				return 0;
 		}
+
+		offset += range;
+		buffer += range;
+		size   -= range;
 	}
 
 	return 0;
+}
 
-dma:
-	mr_copy_data_sub(buffer, (void*)(uintptr_t)offset, size, swap, compare, direction);
 
-	return 0;
+/*
+ *  zcopy の断片はページ単位で参照を持つので、範囲をページごとに区切って集める。
+ */
+static bool
+map_extent(struct pib_zcopy *zcopy, const struct pib_mr_extent *extent, u64 delta, u64 range)
+{
+	while (0 < range) {
+		struct page *page;
+		void *vaddr;
+		u64 chunk;
+
+		page  = nth_page(extent->page, delta >> PAGE_SHIFT);
+		vaddr = page_address(page);
+		if (!vaddr)
+			return true;
+
+		chunk = min_t(u64, PAGE_SIZE - offset_in_page(delta), range);
+
+		if (mr_map_data_sub(zcopy, page, vaddr + offset_in_page(delta), chunk))
+			return true;
+
+		delta += chunk;
+		range -= chunk;
+	}
+
+	return false;
 }
 
+
 static bool
 mr_copy_data_sub(void *buffer, void *target_vaddr, u64 range, u64 swap, u64 compare, enum pib_mr_direction direction)
 {
@@ -633,12 +924,98 @@ mr_copy_data_sub(void *buffer, void *target_vaddr, u64 range, u64 swap, u64 comp
 	return false;
 }
 
+/*
+ *  PIB_MR_MAP: コピーの代わりにページの断片を zcopy に集める。
+ *  ページへの参照はパケットを送信し終わるまで保持する。
+ *  断片数が上限に達した場合は true を返して中断する。
+ */
+static bool
+mr_map_data_sub(struct pib_zcopy *zcopy, struct page *page, void *target_vaddr, u64 range)
+{
+	struct pib_zcopy_frag *frag;
+
+	if (PIB_MAX_ZCOPY_FRAGS <= zcopy->nr_frags)
+		return true;
+
+	frag = &zcopy->frags[zcopy->nr_frags++];
+
+	if (page)
+		get_page(page);
+
+	frag->page  = page;
+	frag->vaddr = target_vaddr;
+	frag->len   = range;
+
+	zcopy->size += range;
+
+	return false;
+}
+
+
+/*
+ *  Zero-copy 送信のために MR のページ断片を集める。
+ *  失敗した場合 (断片が多すぎる場合を含む) は呼び出し側でコピーを行うこと。
+ */
+enum ib_wc_status
+pib_util_mr_map_data(struct pib_pd *pd, struct ib_sge *sge_array, int num_sge, struct pib_sge_cursor *cursor, struct pib_zcopy *zcopy, u64 offset, u64 size, int access_flags)
+{
+	enum ib_wc_status status;
+
+	zcopy->size     = 0;
+	zcopy->nr_frags = 0;
+	zcopy->fast_reg = false;
+
+	status = pib_util_mr_copy_data(pd, sge_array, num_sge, cursor, zcopy, offset, size, access_flags, PIB_MR_MAP);
+
+	if ((status == IB_WC_SUCCESS) && (zcopy->size == size))
+		return IB_WC_SUCCESS;
+
+	pib_util_zcopy_release(zcopy);
+
+	return (status != IB_WC_SUCCESS) ? status : IB_WC_LOC_LEN_ERR;
+}
+
+
+enum ib_wc_status
+pib_util_mr_map_data_with_rkey(struct pib_pd *pd, u32 rkey, struct pib_zcopy *zcopy, u64 address, u64 size, int access_flags)
+{
+	enum ib_wc_status status;
+
+	zcopy->size     = 0;
+	zcopy->nr_frags = 0;
+	zcopy->fast_reg = false;
+
+	status = copy_data_with_rkey(pd, rkey, zcopy, address, size, access_flags, PIB_MR_MAP, false);
+
+	if ((status == IB_WC_SUCCESS) && (zcopy->size == size))
+		return IB_WC_SUCCESS;
+
+	pib_util_zcopy_release(zcopy);
+
+	return (status != IB_WC_SUCCESS) ? status : IB_WC_LOC_LEN_ERR;
+}
+
+
+void pib_util_zcopy_release(struct pib_zcopy *zcopy)
+{
+	int i;
+
+	for (i=0 ; i < zcopy->nr_frags ; i++)
+		if (zcopy->frags[i].page)
+			put_page(zcopy->frags[i].page);
+
+	zcopy->size     = 0;
+	zcopy->nr_frags = 0;
+	zcopy->fast_reg = false;
+}
+
+
 enum ib_wc_status
 pib_util_mr_invalidate(struct pib_pd *pd, u32 rkey)
 {
 	struct pib_mr *mr;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_MW_BIND_ERR;
@@ -671,7 +1048,7 @@ pib_util_mr_fast_reg_pmr(struct pib_pd *pd, u32 rkey, u64 iova_start, struct ib_
 	struct pib_mr *mr;
 	size_t ps;
 
-	mr = pd->mr_table[(rkey & PIB_MR_INDEX_MASK) >> PIB_MR_INDEX_SHIFT];
+	mr = lookup_mr(pd, rkey);
 
 	if (!mr)
 		return IB_WC_MW_BIND_ERR;
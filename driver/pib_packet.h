@@ -39,6 +39,10 @@ enum pib_syndrome {
 	/* Major code mask */
 	PIB_SYND_CODE_MASK		 = 0xE0,
 
+	/* Credit count of ACK (bit[4:0]) */
+	PIB_SYND_CREDIT_MASK		 = 0x1F,
+	PIB_SYND_CREDIT_INVALID		 = 0x1F, /* no end-to-end flow control */
+
 	/* Subcode */
 	PIB_SYND_NAK_CODE_PSN_SEQ_ERR    = 0x60, /* PSN Sequence Error       */
 	PIB_SYND_NAK_CODE_INV_REQ_ERR    = 0x61, /* Invalid Request          */
@@ -132,6 +136,19 @@ static inline void pib_packet_bth_set_solicited(struct pib_packet_bth *bth, int
 }
 
 
+static inline int pib_packet_bth_get_ackreq(const struct pib_packet_bth *bth)
+{
+	return (be32_to_cpu(bth->psn) >> 31) & 0x1;
+}
+
+
+static inline void pib_packet_bth_set_ackreq(struct pib_packet_bth *bth, int ackreq)
+{
+	bth->psn &= ~cpu_to_be32(1U << 31);
+	bth->psn |= cpu_to_be32((u32)!!ackreq << 31);
+}
+
+
 /* Datagram Extended Transport Header */
 struct pib_packet_deth {
 	__be32	qkey;	/* Queue Key */
@@ -7,7 +7,6 @@
  */
 #include <linux/module.h>
 #include <linux/init.h>
-#include <linux/vmalloc.h>
 
 #include "pib.h"
 #include "pib_spinlock.h"
@@ -37,6 +36,7 @@ pib_alloc_pd(struct ib_device *ibdev,
 	getnstimeofday(&pd->creation_time);
 
 	spin_lock_init(&pd->lock);
+	idr_init(&pd->mr_idr);
 
 	spin_lock_irqsave(&dev->lock, flags);
 	pd_num = pib_alloc_obj_num(dev, PIB_BITMAP_PD_START, PIB_MAX_PD, &dev->last_pd_num);
@@ -49,21 +49,10 @@ pib_alloc_pd(struct ib_device *ibdev,
 	pd->pd_num = pd_num;
 	spin_unlock_irqrestore(&dev->lock, flags);
 
-	pd->mr_table = vzalloc(sizeof(struct pib_mr*) * PIB_MAX_MR_PER_PD);
-	if (!pd->mr_table)
-		goto err_mr_table;
-
 	pib_trace_api(dev, IB_USER_VERBS_CMD_ALLOC_PD, pd_num);
 
 	return &pd->ib_pd;
 
-err_mr_table:
-	spin_lock_irqsave(&dev->lock, flags);
-	list_del(&pd->list);
-	dev->nr_pd--;
-	pib_dealloc_obj_num(dev, PIB_BITMAP_PD_START, pd_num);
-	spin_unlock_irqrestore(&dev->lock, flags);
-
 err_alloc_pd_num:
 	kfree(pd);
 
@@ -90,7 +79,7 @@ int pib_dealloc_pd(struct ib_pd *ibpd)
 		pr_err("pib: pib_dealloc_pd: nr_mr=%d\n", pd->nr_mr);
 	spin_unlock_irqrestore(&pd->lock, flags);
 
-	vfree(pd->mr_table);
+	idr_destroy(&pd->mr_idr);
 
 	spin_lock_irqsave(&dev->lock, flags);
 	list_del(&pd->list);
@@ -8,6 +8,8 @@
 #include <linux/module.h>
 #include <linux/init.h>
 #include <linux/vmalloc.h>
+#include <linux/slab.h>
+#include <linux/log2.h>
 #include <rdma/ib_pack.h>
 
 #include "pib.h"
@@ -19,6 +21,7 @@ static bool qp_init_attr_is_ok(const struct pib_dev *dev, const struct ib_qp_ini
 static bool qp_cap_is_ok(const struct pib_dev *dev, const struct ib_qp_cap *cap, int use_srq);
 static void dealloc_free_wqe(struct pib_qp *qp);
 static bool modify_qp_is_ok(const struct pib_dev *dev, const struct pib_qp *qp, enum ib_qp_state cur_state, const struct ib_qp_attr *attr, int attr_mask);
+static void refresh_header_template(struct pib_dev *dev, struct pib_qp *qp);
 static void get_ready_to_send(struct pib_dev *dev, struct pib_qp *qp);
 static void flush_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 static int reset_qp(struct pib_qp *qp);
@@ -91,6 +94,8 @@ void pib_util_flush_qp(struct pib_qp *qp, int send_only)
 
 	BUG_ON(!pib_spin_is_locked(&qp->lock));
 
+	pib_util_drain_posted_swqe(qp);
+
 	list_for_each_entry_safe(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
 		flush_send_wqe(qp, send_wqe);
 	}
@@ -133,9 +138,9 @@ void pib_util_flush_qp(struct pib_qp *qp, int send_only)
 
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
 	qp->requester.nr_contig_read_acks = 0;
 	qp->responder.nr_contig_read_acks = 0;
+	qp->requester.cnp_pending = 0;
 }
 
 
@@ -170,6 +175,8 @@ static int reset_qp(struct pib_qp *qp)
 	count = 0;
 	signal_all_wr = qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR;
 
+	pib_util_drain_posted_swqe(qp);
+
 	list_for_each_entry_safe(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
 		if (signal_all_wr || (send_wqe->send_flags & IB_SEND_SIGNALED))
 			count++;
@@ -217,9 +224,9 @@ static int reset_qp(struct pib_qp *qp)
 
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
 	qp->requester.nr_contig_read_acks = 0;
 	qp->responder.nr_contig_read_acks = 0;
+	qp->requester.cnp_pending = 0;
 
 	return count;
 }
@@ -232,14 +239,23 @@ static void reset_qp_attr(struct pib_qp *qp)
 	qp->requester.psn	   = 0;
 	qp->requester.expected_psn = 0;
 	qp->requester.nr_rd_atomic = 0;
+	qp->requester.acked_psn    = 0;
+	qp->requester.send_window  = PIB_DEFAULT_SEND_WINDOW;
+	qp->requester.credits      = PIB_CREDITS_UNLIMITED;
+	qp->requester.srtt         = 0;
+	qp->requester.rttvar       = 0;
+	qp->requester.rto          = 0;
 
 	qp->responder.psn	   = 0;
-	qp->responder.last_OpCode  = (qp->qp_type == IB_QPT_RC) ?
+	qp->responder.last_OpCode  = ((qp->qp_type == IB_QPT_RC) || (qp->qp_type == IB_QPT_UC)) ?
 		IB_OPCODE_RC_SEND_ONLY : IB_OPCODE_UD_SEND_ONLY; /* dummy opcode */
 	qp->responder.offset       = 0;
+	qp->responder.psn_seq_nak  = 0;
 	qp->responder.nr_rd_atomic = 0;
 
-	memset(&qp->responder.slots, 0, sizeof(qp->responder.slots));
+	if (qp->responder.slots)
+		memset(qp->responder.slots, 0,
+		       sizeof(struct pib_rd_atom_slot) * qp->responder.nr_slots);
 
 	qp->push_rcqe              = 0;
 	qp->issue_comm_est         = 0;
@@ -277,6 +293,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 
 	INIT_LIST_HEAD(&qp->list);
 	getnstimeofday(&qp->creation_time);
+	seqcount_init(&qp->header_template.seq);
 
 	qp->ib_qp_init_attr = *init_attr;
 	qp->ib_qp_attr.cap  = init_attr->cap;
@@ -293,7 +310,9 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 	INIT_LIST_HEAD(&qp->requester.submitted_swqe_head);
 	INIT_LIST_HEAD(&qp->requester.sending_swqe_head);
 	INIT_LIST_HEAD(&qp->requester.waiting_swqe_head);
-	INIT_LIST_HEAD(&qp->requester.free_swqe_head);
+	spin_lock_init(&qp->requester.post_lock);
+	init_llist_head(&qp->requester.posted_swqe_head);
+	init_llist_head(&qp->requester.free_swqe_head);
 
 	INIT_LIST_HEAD(&qp->responder.recv_wqe_head);
 	INIT_LIST_HEAD(&qp->responder.ack_head);
@@ -301,6 +320,8 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 
 	INIT_LIST_HEAD(&qp->mcast_head);
 
+	INIT_LIST_HEAD(&qp->sched.list);
+
 	reset_qp_attr(qp);
 
 	switch (qp->qp_type) {
@@ -315,6 +336,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 
 	special_qp:
 		qp->ib_qp.qp_num = qp_num;
+		qp->thread       = pib_util_get_thread(dev, qp_num);
 
 		spin_lock_irqsave(&dev->lock, flags);
 		if (dev->ports[init_attr->port_num - 1].qp_info[qp_num])
@@ -326,6 +348,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 		break;
 
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 	case IB_QPT_UD:
 		if (pib_get_behavior(PIB_BEHAVIOR_QPN_REALLOCATION))
 			dev->last_qp_num = PIB_QP1 + 1;
@@ -340,6 +363,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 		list_add_tail(&qp->list, &dev->qp_head);
 		pib_util_find_qp(dev, qp_num);
 		qp->ib_qp.qp_num = qp_num;
+		qp->thread       = pib_util_get_thread(dev, qp_num);
 		dev->last_qp_num = qp_num;
 		insert_qp(dev, qp);
 		spin_unlock_irqrestore(&dev->lock, flags);
@@ -354,6 +378,15 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 		return ERR_PTR(-ENOSYS);
 	}
 
+	/* allocate the ring of RDMA READ/ATOMIC slots */
+	if (qp->qp_type == IB_QPT_RC) {
+		qp->responder.nr_slots = roundup_pow_of_two(dev->ib_dev_attr.max_qp_rd_atom);
+		qp->responder.slots = kcalloc(qp->responder.nr_slots,
+					      sizeof(struct pib_rd_atom_slot), GFP_KERNEL);
+		if (!qp->responder.slots)
+			goto err_alloc_slots;
+	}
+
 	/* allocate inline data area */
 	if (init_attr->cap.max_inline_data > 0) {
 		qp->requester.inline_data_buffer = vzalloc(
@@ -372,7 +405,7 @@ struct ib_qp *pib_create_qp(struct ib_pd *ibpd,
 			goto err_alloc_wqe;
 
 		INIT_LIST_HEAD(&send_wqe->list);
-		list_add_tail(&send_wqe->list, &qp->requester.free_swqe_head);
+		llist_add(&send_wqe->llnode, &qp->requester.free_swqe_head);
 
 		if (init_attr->cap.max_inline_data > 0)
 			send_wqe->inline_data_buffer = 
@@ -403,6 +436,9 @@ err_alloc_wqe:
 		vfree(qp->requester.inline_data_buffer);
 
 err_alloc_inlin_data_buffer:
+	kfree(qp->responder.slots);
+
+err_alloc_slots:
 	if (is_register_qp_table) {
 		spin_lock_irqsave(&dev->lock, flags);
 		rb_erase(&qp->rb_node, &dev->qp_table);
@@ -432,6 +468,7 @@ static bool qp_init_attr_is_ok(const struct pib_dev *dev, const struct ib_qp_ini
 	case IB_QPT_SMI:
 	case IB_QPT_GSI:
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 	case IB_QPT_UD:
 		break;
 
@@ -508,6 +545,8 @@ int pib_destroy_qp(struct ib_qp *ibqp)
 
 	pib_detach_all_mcast(dev, qp);
 
+	pib_util_cancel_doorbell(qp);
+
 	spin_lock_irqsave(&dev->lock, flags);
 
 	pib_spin_lock(&qp->lock);
@@ -518,6 +557,8 @@ int pib_destroy_qp(struct ib_qp *ibqp)
 	if (qp->requester.inline_data_buffer)
 		vfree(qp->requester.inline_data_buffer);
 
+	kfree(qp->responder.slots);
+
 	if ((qp_num == PIB_QP0) || (qp_num == PIB_QP1))
 		dev->ports[qp->ib_qp_init_attr.port_num - 1].qp_info[qp_num] = NULL;
 	else
@@ -540,10 +581,13 @@ int pib_destroy_qp(struct ib_qp *ibqp)
 
 static void dealloc_free_wqe(struct pib_qp *qp)
 {
-	while (!list_empty(&qp->requester.free_swqe_head)) {
+	struct llist_node *node;
+
+	node = llist_del_all(&qp->requester.free_swqe_head);
+	while (node) {
 		struct pib_send_wqe *send_wqe;
-		send_wqe = list_first_entry(&qp->requester.free_swqe_head, struct pib_send_wqe, list);
-		list_del_init(&send_wqe->list);
+		send_wqe = llist_entry(node, struct pib_send_wqe, llnode);
+		node = llist_next(node);
 		kmem_cache_free(pib_send_wqe_cachep, send_wqe);
 	}
 
@@ -620,6 +664,7 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 	if (attr_mask & IB_QP_SQ_PSN) {
 		qp->requester.psn          = attr->sq_psn & PIB_PSN_MASK;
 		qp->requester.expected_psn = attr->sq_psn & PIB_PSN_MASK;
+		qp->requester.acked_psn    = attr->sq_psn & PIB_PSN_MASK;
 	}
 
 	if (attr_mask & IB_QP_DEST_QPN)
@@ -727,6 +772,12 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 			break;
 
 		case IB_QPS_RTS:
+			if (cur_state == IB_QPS_RTR) {
+				/* 相手の RQ の状態は最初の ACK を受けるまで分からない */
+				qp->requester.send_window = clamp_t(u32, pib_send_window, 1, PIB_MAX_SEND_WINDOW);
+				qp->requester.credits     = PIB_CREDITS_UNLIMITED;
+			}
+			pib_util_drain_posted_swqe(qp);
 			pending_send_wr = get_send_wr_num(qp);
 			break;
 
@@ -752,6 +803,8 @@ int pib_modify_qp(struct ib_qp *ibqp, struct ib_qp_attr *attr,
 			qp->issue_sq_drained = 0;
 	}
 
+	refresh_header_template(dev, qp);
+
 	/* 送信可能状態に */
 	if (pending_send_wr)
 		get_ready_to_send(dev, qp);
@@ -763,6 +816,41 @@ done:
 }
 
 
+/*
+ *  RC と UC は送信ヘッダの大部分が QP の属性だけで決まるので、
+ *  modify_qp のたびに雛形を作り直しておく。
+ */
+static void refresh_header_template(struct pib_dev *dev, struct pib_qp *qp)
+{
+	u8 port_num = qp->ib_qp_attr.port_num;
+	const struct ib_ah_attr *ah_attr = &qp->ib_qp_attr.ah_attr;
+
+	qp->header_template.generation = 0;
+
+	if ((qp->qp_type != IB_QPT_RC) && (qp->qp_type != IB_QPT_UC))
+		return;
+
+	switch (qp->state) {
+	case IB_QPS_RTR:
+	case IB_QPS_RTS:
+	case IB_QPS_SQD:
+		break;
+	default:
+		return;
+	}
+
+	if ((port_num < 1) || (dev->ib_dev.phys_port_cnt < port_num) ||
+	    (PIB_PKEY_TABLE_LEN <= qp->ib_qp_attr.pkey_index) ||
+	    ((ah_attr->ah_flags & IB_AH_GRH) && (PIB_GID_PER_PORT <= ah_attr->grh.sgid_index)))
+		return;
+
+	pib_build_packet_header_template(dev, port_num, ah_attr,
+					 dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index],
+					 qp->ib_qp_attr.dest_qp_num,
+					 &qp->header_template);
+}
+
+
 static bool modify_qp_is_ok(const struct pib_dev *dev, const struct pib_qp *qp, enum ib_qp_state cur_state, const struct ib_qp_attr *attr, int attr_mask)
 {
 	/* IB_QP_ACCESS_FLAGS */
@@ -913,11 +1001,13 @@ int pib_post_send(struct ib_qp *ibqp, struct ib_send_wr *ibwr,
 		  struct ib_send_wr **bad_wr)
 {
 	int i, ret = 0;
-	int pending_send_wr = 0;
+	int nr_posted = 0;
 	struct pib_qp *qp;
 	struct pib_dev *dev;
 	unsigned long flags;
 	struct pib_send_wqe *send_wqe;
+	struct llist_node *node;
+	enum ib_qp_state state;
 	u64 total_length = 0;
 	u32 imm_data;
 
@@ -929,16 +1019,20 @@ int pib_post_send(struct ib_qp *ibqp, struct ib_send_wr *ibwr,
 
 	pib_trace_api(dev, IB_USER_VERBS_CMD_POST_SEND, qp->ib_qp.qp_num);
 
-	pib_spin_lock_irqsave(&qp->lock, flags);
+	/*
+	 * qp->lock は取らない。状態の変化との競合は kthread が
+	 * pib_util_drain_posted_swqe で回収するときに解消する。
+	 */
+	state = ACCESS_ONCE(qp->state);
 
-	if ((qp->state == IB_QPS_RESET) || (qp->state == IB_QPS_INIT)) {
-		ret = -EINVAL;
-		goto done;		
-	}
+	if ((state == IB_QPS_RESET) || (state == IB_QPS_INIT))
+		return -EINVAL;
+
+	spin_lock_irqsave(&qp->requester.post_lock, flags);
 
 next_wr:
 	/* QP check */
-	switch (qp->state) {
+	switch (state) {
 
 	case IB_QPS_RESET:
 	case IB_QPS_INIT:
@@ -953,9 +1047,6 @@ next_wr:
 		goto skip;
 
 	case IB_QPS_RTS:
-		pending_send_wr = 1;
-		break;
-
 	case IB_QPS_RTR:
 	case IB_QPS_SQD:
 		break;
@@ -983,12 +1074,13 @@ next_wr:
 	}
 
 	/* free swqe は max_send_wr しか用意されてないのでチェックも兼ねている */
-	if (list_empty(&qp->requester.free_swqe_head)) {
+	node = llist_del_first(&qp->requester.free_swqe_head);
+	if (!node) {
 		ret = -ENOMEM;
 		goto done;
 	}
 
-	send_wqe = list_first_entry(&qp->requester.free_swqe_head, struct pib_send_wqe, list);
+	send_wqe = llist_entry(node, struct pib_send_wqe, llnode);
 
 	send_wqe->wr_id      = ibwr->wr_id;
 	send_wqe->opcode     = ibwr->opcode;
@@ -1015,7 +1107,7 @@ next_wr:
 
 	if (PIB_MAX_PAYLOAD_LEN < total_length) { 
 		ret = -EMSGSIZE;
-		goto done;
+		goto put_wqe;
 	}
 
 	send_wqe->total_length = (u32)total_length;
@@ -1024,10 +1116,18 @@ next_wr:
 	if (send_wqe->send_flags & IB_SEND_INLINE)
 		if (copy_inline_data(qp, send_wqe, total_length)) {
 			ret = -EFAULT;
-			goto done;
+			goto put_wqe;
 		}
 
 	switch (qp->qp_type) {
+	case IB_QPT_UC:
+		/* UC には RDMA READ、Atomic、SEND with Invalidate はない */
+		if (pib_is_wr_opcode_rd_atomic(ibwr->opcode) || (ibwr->opcode == IB_WR_SEND_WITH_INV)) {
+			ret = -EINVAL;
+			goto put_wqe;
+		}
+		/* pass through */
+
 	case IB_QPT_RC:
 		switch (ibwr->opcode) {
 		case IB_WR_RDMA_WRITE:
@@ -1083,7 +1183,7 @@ next_wr:
 			if (!pib_get_behavior(PIB_BEHAVIOR_AH_PD_VIOLATOIN_COMP_ERR))
 				if (!ibwr->wr.ud.ah || qp->ib_qp.pd != ibwr->wr.ud.ah->pd) {
 					ret = -EINVAL;
-					goto done;
+					goto put_wqe;
 				}
 			send_wqe->wr.ud.ah		= ibwr->wr.ud.ah;
 			send_wqe->wr.ud.remote_qpn	= ibwr->wr.ud.remote_qpn;
@@ -1103,9 +1203,8 @@ next_wr:
 	send_wqe->processing.list_type = PIB_SWQE_SUBMITTED;
 	send_wqe->processing.status    = IB_WC_SUCCESS;
 
-	list_del_init(&send_wqe->list); /* list_del でいい？ */
-	list_add_tail(&send_wqe->list, &qp->requester.submitted_swqe_head);
-	qp->requester.nr_submitted_swqe++;
+	llist_add(&send_wqe->llnode, &qp->requester.posted_swqe_head);
+	nr_posted++;
 
 skip:
 	ibwr = ibwr->next;
@@ -1113,11 +1212,17 @@ skip:
 	if (ibwr)
 		goto next_wr;
 
+	goto done;
+
+put_wqe:
+	llist_add(&send_wqe->llnode, &qp->requester.free_swqe_head);
+
 done:
-	if (pending_send_wr)
-		get_ready_to_send(dev, qp);
+	spin_unlock_irqrestore(&qp->requester.post_lock, flags);
 
-	pib_spin_unlock_irqrestore(&qp->lock, flags);
+	/* submitted_swqe_head への移動は QP を担当する kthread に任せる */
+	if (nr_posted)
+		pib_util_ring_doorbell(qp);
 
 	if (ret && bad_wr)
 		*bad_wr = ibwr;
@@ -1221,6 +1326,7 @@ next_wr:
 
 	recv_wqe->wr_id   = ibwr->wr_id;
 	recv_wqe->num_sge = ibwr->num_sge;
+	memset(&recv_wqe->cursor, 0, sizeof(recv_wqe->cursor));
 
 	for (i=0 ; i<ibwr->num_sge ; i++) {
 		recv_wqe->sge_array[i] = ibwr->sg_list[i];
@@ -1264,7 +1370,44 @@ void pib_util_free_send_wqe(struct pib_qp *qp, struct pib_send_wqe *send_wqe)
 
 	INIT_LIST_HEAD(&send_wqe->list);
 
-	list_add_tail(&send_wqe->list, &qp->requester.free_swqe_head);
+	/* pib_post_send は post_lock だけで取り出すので llist で返す */
+	llist_add(&send_wqe->llnode, &qp->requester.free_swqe_head);
+}
+
+
+/*
+ *  pib_post_send が posted_swqe_head に積んだ Send WQE を submitted_swqe_head へ移す。
+ *  llist は LIFO なので先頭に挿入し直して投入順に戻す。
+ */
+void pib_util_drain_posted_swqe(struct pib_qp *qp)
+{
+	struct llist_node *node;
+	struct pib_send_wqe *send_wqe, *next_send_wqe;
+	LIST_HEAD(head);
+
+	BUG_ON(!pib_spin_is_locked(&qp->lock));
+
+	node = llist_del_all(&qp->requester.posted_swqe_head);
+	if (!node)
+		return;
+
+	while (node) {
+		send_wqe = llist_entry(node, struct pib_send_wqe, llnode);
+		node = llist_next(node);
+		list_add(&send_wqe->list, &head);
+	}
+
+	/* 投入後に QP がエラーになっていれば flush する */
+	if ((qp->state == IB_QPS_ERR) || (qp->state == IB_QPS_SQE)) {
+		list_for_each_entry_safe(send_wqe, next_send_wqe, &head, list)
+			flush_send_wqe(qp, send_wqe);
+		return;
+	}
+
+	list_for_each_entry(send_wqe, &head, list)
+		qp->requester.nr_submitted_swqe++;
+
+	list_splice_tail(&head, &qp->requester.submitted_swqe_head);
 }
 
 
@@ -1292,11 +1435,10 @@ static void get_ready_to_send(struct pib_dev *dev, struct pib_qp *qp)
 {
 	pib_util_reschedule_qp(qp);
 
-	qp->requester.nr_contig_requests = 0;
 	qp->requester.nr_contig_read_acks = 0;
 	qp->responder.nr_contig_read_acks = 0;
 
-	complete(&dev->thread.completion);
+	complete(&qp->thread->completion);
 }
 
 
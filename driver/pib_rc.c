@@ -1,5 +1,5 @@
 /*
- * pib_rc.c - Reliable Connection service processing
+ * pib_rc.c - Reliable Connection (and Unreliable Connection) service processing
  *
  * Copyright (c) 2013-2015 Minoru NAKAMURA <nminoru@nminoru.jp>
  *
@@ -37,6 +37,8 @@ static enum ib_wc_status process_Atomic_request(struct pib_dev *dev, struct pib_
 
 static enum ib_wc_status process_LOCAL_INVALIDATE_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
 static enum ib_wc_status process_FAST_REGISTER_PMR_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static int process_local_fabric_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static enum ib_wc_status copy_local_fabric_data(struct pib_pd *pd, struct pib_send_wqe *send_wqe, struct pib_pd *dest_pd, int access_flags, enum pib_mr_direction direction);
 
 /*
  *  Responder: Receiving Inbound Request Packets
@@ -47,6 +49,8 @@ static int receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn,
 static int receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_qp *qp, void *buffer, int siz, int new_request, int slot_index);
 static int receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, struct pib_qp *qp,  void *buffer, int size);
 static void push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome);
+static void flush_acknowledge(struct pib_qp *qp);
+static bool is_ack_requested(const struct pib_qp *qp, const struct pib_send_wqe *send_wqe, u32 psn);
 static void remove_overlapped_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn);
 static void push_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn, u64 vaddress, u32 rkey, u32 size);
 static void push_atomic_acknowledge(struct pib_qp *qp, u32 psn, u64 res);
@@ -65,13 +69,15 @@ static int receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 static int receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn);
 static int process_acknowledge(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe, u32 psn);
 static void set_send_wqe_to_error(struct pib_qp *qp, u32 psn, enum ib_wc_status status);
+static void update_acked_psn(struct pib_qp *qp, u32 psn);
+static void update_credits(struct pib_qp *qp, u32 psn, int credit_code);
 static int receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn, void *buffer, int size);
 static int receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn, void *buffer, int size);
 
 /*
  *  Congestion Notification Packet
  */
-static void process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
+static void process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp);
 static void receive_cnp_notify(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 
 /*
@@ -79,9 +85,13 @@ static void receive_cnp_notify(struct pib_dev *dev, u8 port_num, struct pib_qp *
  */
 static void insert_async_qp_error(struct pib_dev *dev, struct pib_qp *qp, enum ib_event_type event);
 static void abort_active_rwqe(struct pib_dev *dev, struct pib_qp *qp);
+static void abort_uc_message(struct pib_qp *qp);
 static struct pib_send_wqe *match_send_wqe(struct pib_qp *qp, u32 psn, int *first_send_wqe_p, int **nr_swqe_pp);
 static void issue_comm_est(struct pib_qp *qp);
 static void postpone_local_ack_timeout(struct pib_qp *qp);
+static unsigned long get_local_ack_timeout(const struct pib_qp *qp);
+static void update_rtt(struct pib_qp *qp, const struct pib_send_wqe *send_wqe);
+static void *copy_header_template(struct pib_dev *dev, struct pib_qp *qp, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p);
 
 
 /******************************************************************************/
@@ -92,6 +102,72 @@ static s32 get_psn_diff(u32 psn, u32 based_psn)
 }
 
 
+/*
+ *  QP の雛形から LRH, GRH, BTH を send_buffer に複写し、その直後を返す。
+ *  BTH の OpCode と PSN は呼び出し側で埋める。
+ */
+static void *copy_header_template(struct pib_dev *dev, struct pib_qp *qp, struct pib_packet_lrh **lrh_p, struct ib_grh **grh_p, struct pib_packet_bth **bth_p)
+{
+	u8 port_num = qp->ib_qp_attr.port_num;
+	void *buffer = qp->thread->send_buffer;
+	struct pib_packet_header_template *template = &qp->header_template;
+
+	if (!pib_is_header_template_valid(dev, template, port_num))
+		pib_build_packet_header_template(dev, port_num, &qp->ib_qp_attr.ah_attr,
+						 dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index],
+						 qp->ib_qp_attr.dest_qp_num,
+						 template);
+
+	memcpy(buffer, template->buffer, template->length);
+
+	*lrh_p = (struct pib_packet_lrh*)buffer;
+	*grh_p = (qp->ib_qp_attr.ah_attr.ah_flags & IB_AH_GRH) ?
+		(struct ib_grh*)(buffer + sizeof(struct pib_packet_lrh)) : NULL;
+	*bth_p = (struct pib_packet_bth*)(buffer + template->length - sizeof(struct pib_packet_bth));
+
+	return buffer + template->length;
+}
+
+
+/* AETH の Credit Count が表す RWQE 数 (IBA 9.7.5.1) */
+static const int credit_table[PIB_SYND_CREDIT_INVALID] = {
+	    0,     1,     2,     3,     4,     6,     8,    12,
+	   16,    24,    32,    48,    64,    96,   128,   192,
+	  256,   384,   512,   768,  1024,  1536,  2048,  3072,
+	 4096,  6144,  8192, 12288, 16384, 24576, 32768,
+};
+
+
+static int get_credit_code(const struct pib_qp *qp)
+{
+	int code;
+
+	/* SRQ の空きは QP ごとに保証できない */
+	if (qp->ib_qp_init_attr.srq)
+		return PIB_SYND_CREDIT_INVALID;
+
+	for (code = PIB_SYND_CREDIT_INVALID - 1 ; 0 < code ; code--)
+		if (credit_table[code] <= qp->responder.nr_recv_wqe)
+			break;
+
+	return code;
+}
+
+
+static bool is_consuming_rwqe(enum ib_wr_opcode opcode)
+{
+	switch (opcode) {
+	case IB_WR_SEND:
+	case IB_WR_SEND_WITH_IMM:
+	case IB_WR_SEND_WITH_INV:
+	case IB_WR_RDMA_WRITE_WITH_IMM:
+		return true;
+	default:
+		return false;
+	}
+}
+
+
 static enum pib_syndrome get_resources_not_ready(struct pib_qp *qp)
 {
 	return PIB_SYND_RNR_NAK_CODE | (qp->ib_qp_attr.min_rnr_timer & ~PIB_SYND_CODE_MASK);
@@ -102,6 +178,34 @@ static enum pib_syndrome get_resources_not_ready(struct pib_qp *qp)
 /* Requester: Generating Request Packets                                      */
 /******************************************************************************/
 
+/*
+ *  送信ウィンドウか相手の RQ のクレジットを使い切っていれば Request の送信を止める。
+ *  ただし ACK 待ちのパケットがなければ、相手の状態を確かめるために送信を許す。
+ */
+bool pib_is_rc_qp_request_blocked(const struct pib_qp *qp, const struct pib_send_wqe *send_wqe)
+{
+	s32 outstanding;
+
+	if (qp->qp_type != IB_QPT_RC)
+		return false;
+
+	outstanding = get_psn_diff(send_wqe->processing.based_psn + send_wqe->processing.sent_packets,
+				   qp->requester.acked_psn);
+
+	if (outstanding <= 0)
+		return false;
+
+	if ((s32)qp->requester.send_window <= outstanding)
+		return true;
+
+	if ((send_wqe->processing.sent_packets == 0) && is_consuming_rwqe(send_wqe->opcode) &&
+	    (qp->requester.credits <= 0))
+		return true;
+
+	return false;
+}
+
+
 int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe)
 {
 	int with_reth = 0;
@@ -109,12 +213,10 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	int with_inv = 0;
 	void *buffer;
 	u8 port_num;
-	struct ib_ah_attr ah_attr;
 	u16 slid, dlid;
 	struct pib_packet_lrh *lrh;
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
-	u32 lnh;
 	u32 psn;
 	enum ib_wc_status status;
 
@@ -139,39 +241,26 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 		goto completion_error;
 	}
 
-	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
+	if (pib_local_fabric && !pib_multi_host_mode && (qp->qp_type == IB_QPT_RC) &&
+	    (send_wqe->processing.sent_packets == 0) &&
+	    (send_wqe->total_length <= PIB_LOCAL_FABRIC_MAX_SIZE) &&
+	    ((send_wqe->opcode == IB_WR_RDMA_WRITE) || (send_wqe->opcode == IB_WR_RDMA_READ)))
+		if (process_local_fabric_request(dev, qp, send_wqe)) {
+			if (send_wqe->processing.list_type == PIB_SWQE_FREE)
+				return 0;
+			goto skip_to_send_packet;
+		}
 
-	buffer = dev->thread.send_buffer;
+	port_num = qp->ib_qp_attr.port_num;
 
 	slid = dev->ports[port_num - 1].ib_port_attr.lid;
-	dlid = ah_attr.dlid;
-
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth));
+	dlid = qp->ib_qp_attr.ah_attr.dlid;
 
 	/* write IB Packet Header (LRH, GRH, BTH) */
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
-
-	lrh->sl_rsv_lnh = (ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(dlid);
-	lrh->slid   = cpu_to_be16(slid);
+	buffer = copy_header_template(dev, qp, &lrh, &grh, &bth);
 
 	psn = send_wqe->processing.based_psn + send_wqe->processing.sent_packets;
 
-	bth->pkey   = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
 	bth->psn    = cpu_to_be32(psn & PIB_PSN_MASK); /* A-bit is 0 */
 
 	switch (send_wqe->opcode) {
@@ -271,16 +360,25 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	if (status != IB_WC_SUCCESS)
 		goto completion_error;
 
-	dev->thread.port_num	= port_num;
-	dev->thread.slid	= slid;
-	dev->thread.dlid	= dlid;
-	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.trace_id    = send_wqe->trace_id;
-	dev->thread.ready_to_send = 1;
+	if (qp->qp_type == IB_QPT_UC)
+		/* UC の OpCode は下位 5 bit が RC と同じ */
+		bth->OpCode = IB_OPCODE_UC + (bth->OpCode & 0x1F);
+	else if (is_ack_requested(qp, send_wqe, psn))
+		pib_packet_bth_set_ackreq(bth, 1);
+
+	qp->thread->port_num	= port_num;
+	qp->thread->slid	= slid;
+	qp->thread->dlid	= dlid;
+	qp->thread->src_qp_num	= qp->ib_qp.qp_num;
+	qp->thread->trace_id    = send_wqe->trace_id;
+	qp->thread->ready_to_send = 1;
 
 	if (send_wqe->opcode != IB_WR_RDMA_READ) {
+		if ((send_wqe->processing.sent_packets == 0) && is_consuming_rwqe(send_wqe->opcode))
+			if (qp->requester.credits != PIB_CREDITS_UNLIMITED)
+				qp->requester.credits--;
+
 		send_wqe->processing.sent_packets++;
-		qp->requester.nr_contig_requests++;
 
 		if (send_wqe->processing.sent_packets < send_wqe->processing.all_packets) {
 			/* Send WQE にはまだ送信すべきパケットが残っている。 */
@@ -288,11 +386,35 @@ int pib_process_rc_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 		}
 	}
 
+	if (qp->qp_type == IB_QPT_UC) {
+		/* UC は ACK を待たずに最後のパケットを送信した時点で完了する */
+		if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) || 
+		    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
+			struct ib_wc wc = {
+				.wr_id    = send_wqe->wr_id,
+				.status   = IB_WC_SUCCESS,
+				.opcode   = pib_convert_wr_opcode_to_wc_opcode(send_wqe->opcode),
+				.qp       = &qp->ib_qp,
+			};
+
+			pib_util_insert_wc_success(qp->send_cq, &wc, 0);
+		}
+
+		qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
+
+		list_del_init(&send_wqe->list);
+		qp->requester.nr_sending_swqe--;
+		send_wqe->processing.list_type = PIB_SWQE_FREE;
+
+		return 0;
+	}
+
 skip_to_send_packet:
 	send_wqe->processing.list_type = PIB_SWQE_WAITING;
 
 	/* Calucate the next time in jififes to resend this request by local ACK timer */
-	send_wqe->processing.local_ack_time = jiffies + qp->local_ack_timeout;
+	send_wqe->processing.local_ack_time = pib_sched_now() + get_local_ack_timeout(qp);
+	send_wqe->processing.sent_time      = ktime_to_ns(ktime_get());
 
 	return 0;
 
@@ -304,6 +426,245 @@ completion_error:
 }
 
 
+/*
+ *  このパケットの後に送信が途切れる場合は AckReq を立てて、
+ *  相手に ACK を遅延させない。
+ */
+static bool
+is_ack_requested(const struct pib_qp *qp, const struct pib_send_wqe *send_wqe, u32 psn)
+{
+	/* RDMA READ と Atomic には ACK の代わりに応答が返る */
+	if (pib_is_wr_opcode_rd_atomic(send_wqe->opcode))
+		return false;
+
+	/* 送信ウィンドウがこのパケットで閉じる */
+	if ((s32)qp->requester.send_window <= get_psn_diff(psn + 1, qp->requester.acked_psn))
+		return true;
+
+	if (send_wqe->processing.sent_packets + 1 < send_wqe->processing.all_packets)
+		return false;
+
+	/* メッセージの最後のパケットでクレジットを使い切る */
+	if (is_consuming_rwqe(send_wqe->opcode) && (qp->requester.credits <= 1))
+		return true;
+
+	/* 後続の Send WQE がない */
+	return list_is_last(&send_wqe->list, &qp->requester.sending_swqe_head) &&
+		list_empty(&qp->requester.submitted_swqe_head);
+}
+
+
+/*
+ *  local fabric: 相手の QP が同じホストにあれば、パケットに分割せずに
+ *  MR から MR へ直接データを移す。
+ *
+ *  RDMA WRITE は相手の responder が最後の PSN に対する ACK を 1 つだけ返し、
+ *  完了は通常どおり ACK の受信で行う。
+ *  RDMA READ は先行する Send WQE がない場合に限り、その場で完了させる。
+ *
+ *  相手の QP のロックが取れない場合や、通常の受信処理で受理されない
+ *  リクエストの場合は 0 を返す。呼び出し側は通常どおりパケットを送信し、
+ *  エラーはそちらで検出させる。
+ *
+ *  両方の QP のロックを持ったままコピーするので、呼び出し側は
+ *  PIB_LOCAL_FABRIC_MAX_SIZE を超えるリクエストを渡さないこと。
+ */
+static int
+process_local_fabric_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+{
+	int j, ret = 0;
+	int OpCode;
+	u8 port_num;
+	u16 slid, dlid;
+	u32 psn, num_packets;
+	struct pib_dev *dest;
+	struct pib_qp *dest_qp;
+	enum ib_wc_status status;
+
+	port_num = qp->ib_qp_attr.port_num;
+	slid     = dev->ports[port_num - 1].ib_port_attr.lid;
+	dlid     = qp->ib_qp_attr.ah_attr.dlid;
+
+	if (send_wqe->opcode == IB_WR_RDMA_READ) {
+		/* 完了の順序を守れない */
+		if (!list_empty(&qp->requester.waiting_swqe_head) ||
+		    (send_wqe != list_first_entry(&qp->requester.sending_swqe_head, struct pib_send_wqe, list)))
+			return 0;
+		OpCode = IB_OPCODE_RC_RDMA_READ_REQUEST;
+	} else if (send_wqe->processing.all_packets == 1)
+		OpCode = IB_OPCODE_RC_RDMA_WRITE_ONLY;
+	else
+		OpCode = IB_OPCODE_RC_RDMA_WRITE_LAST;
+
+	if ((slid == 0) || (dlid == 0) || !pib_is_unicast_lid(dlid))
+		return 0;
+
+	/* 相手の HCA は RCU で保護する */
+	rcu_read_lock();
+
+	dest = pib_util_find_loopback_dev(dlid);
+	if (!dest)
+		goto done_rcu;
+
+	for (j=0 ; j < dest->ib_dev.phys_port_cnt ; j++)
+		if (dest->ports[j].ib_port_attr.lid == dlid)
+			break;
+
+	if (j == dest->ib_dev.phys_port_cnt)
+		goto done_rcu;
+
+	/* ロックの入れ子関係に逆らうので、取れなければ諦める */
+	if (!spin_trylock(&dest->lock))
+		goto done_rcu;
+
+	dest_qp = pib_util_find_qp(dest, qp->ib_qp_attr.dest_qp_num);
+	if (!dest_qp || (dest_qp->qp_type != IB_QPT_RC) || !pib_spin_trylock(&dest_qp->lock)) {
+		spin_unlock(&dest->lock);
+		goto done_rcu;
+	}
+
+	spin_unlock(&dest->lock);
+
+	psn         = send_wqe->processing.based_psn;
+	num_packets = get_psn_diff(send_wqe->processing.expected_psn, psn);
+
+	/* 通常の受信処理で受理されるリクエストだけを対象にする */
+	if (!pib_is_recv_ok(dest_qp->state) ||
+	    (dest_qp->ib_qp_attr.port_num != j + 1) ||
+	    (dest_qp->ib_qp_attr.dest_qp_num != qp->ib_qp.qp_num) ||
+	    (dest_qp->ib_qp_attr.ah_attr.dlid != slid) ||
+	    (dest->ports[j].pkey_table[dest_qp->ib_qp_attr.pkey_index] !=
+	     dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index]) ||
+	    (get_psn_diff(psn, dest_qp->responder.psn) != 0) ||
+	    !pib_opcode_is_in_order_sequence(OpCode, dest_qp->responder.last_OpCode))
+		goto done;
+
+	if (send_wqe->opcode == IB_WR_RDMA_READ) {
+		if (dest_qp->ib_qp_attr.max_dest_rd_atomic <= dest_qp->responder.nr_rd_atomic)
+			goto done;
+
+		status = copy_local_fabric_data(to_ppd(qp->ib_qp.pd), send_wqe, to_ppd(dest_qp->ib_qp.pd),
+						IB_ACCESS_REMOTE_READ, PIB_MR_COPY_TO);
+	} else
+		status = copy_local_fabric_data(to_ppd(qp->ib_qp.pd), send_wqe, to_ppd(dest_qp->ib_qp.pd),
+						IB_ACCESS_REMOTE_WRITE, PIB_MR_COPY_FROM);
+
+	if (status != IB_WC_SUCCESS)
+		goto done;
+
+	/* Responder */
+	issue_comm_est(dest_qp);
+
+	dest_qp->responder.psn        += num_packets;
+	dest_qp->responder.last_OpCode = OpCode;
+	dest_qp->responder.psn_seq_nak = 0;
+
+	if (send_wqe->opcode == IB_WR_RDMA_READ) {
+		/* Requester: RDMA READ response を全て受信したのと同じ扱い */
+		if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) || 
+		    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
+			struct ib_wc wc = {
+				.wr_id    = send_wqe->wr_id,
+				.status   = IB_WC_SUCCESS,
+				.opcode   = IB_WC_RDMA_READ,
+				.qp       = &qp->ib_qp,
+			};
+
+			pib_util_insert_wc_success(qp->send_cq, &wc, 0);
+		}
+
+		qp->requester.nr_rd_atomic--;
+		BUG_ON(qp->requester.nr_rd_atomic < 0);
+
+		qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
+		update_acked_psn(qp, send_wqe->processing.expected_psn - 1);
+
+		list_del_init(&send_wqe->list);
+		qp->requester.nr_sending_swqe--;
+		send_wqe->processing.list_type = PIB_SWQE_FREE;
+	} else {
+		/* 最後の PSN に対する ACK を 1 つだけ返させる */
+		push_acknowledge(dest_qp, psn + num_packets - 1, PIB_SYND_ACK_CODE);
+		flush_acknowledge(dest_qp);
+		pib_util_reschedule_qp(dest_qp);
+
+		/* Requester: 全てのパケットを送信済みとして ACK を待つ */
+		send_wqe->processing.sent_packets = send_wqe->processing.all_packets;
+	}
+
+	ret = 1;
+
+done:
+	pib_spin_unlock(&dest_qp->lock);
+
+done_rcu:
+	rcu_read_unlock();
+
+	return ret;
+}
+
+
+/*
+ *  rkey 側の範囲をページ断片単位で zcopy に集め、断片と SGE の間で
+ *  直接コピーする。PD のロックは同時には取らない。
+ */
+static enum ib_wc_status
+copy_local_fabric_data(struct pib_pd *pd, struct pib_send_wqe *send_wqe, struct pib_pd *dest_pd, int access_flags, enum pib_mr_direction direction)
+{
+	int i;
+	u64 offset, chunk;
+	struct pib_zcopy zcopy;
+	enum ib_wc_status status;
+
+	if (send_wqe->send_flags & IB_SEND_INLINE) {
+		rcu_read_lock();
+		status = pib_util_mr_copy_data_with_rkey(dest_pd, send_wqe->wr.rdma.rkey,
+							 send_wqe->inline_data_buffer,
+							 send_wqe->wr.rdma.remote_addr,
+							 send_wqe->total_length,
+							 access_flags, PIB_MR_COPY_TO);
+		rcu_read_unlock();
+		return status;
+	}
+
+	for (offset = 0 ; offset < send_wqe->total_length ; ) {
+		/* 断片数が PIB_MAX_ZCOPY_FRAGS を超えない大きさに区切る */
+		chunk = min_t(u64, send_wqe->total_length - offset,
+			      (PIB_MAX_ZCOPY_FRAGS - 1) * PAGE_SIZE);
+
+		rcu_read_lock();
+		status = pib_util_mr_map_data_with_rkey(dest_pd, send_wqe->wr.rdma.rkey, &zcopy,
+							send_wqe->wr.rdma.remote_addr + offset,
+							chunk, access_flags);
+		rcu_read_unlock();
+
+		if (status != IB_WC_SUCCESS)
+			return status;
+
+		/* ページへの参照を持っているので相手の PD のロックは外してよい */
+		rcu_read_lock();
+		for (i=0 ; i < zcopy.nr_frags ; i++) {
+			status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+						       &send_wqe->processing.cursor,
+						       zcopy.frags[i].vaddr, offset, zcopy.frags[i].len,
+						       (direction == PIB_MR_COPY_TO) ? IB_ACCESS_LOCAL_WRITE : 0,
+						       direction);
+			if (status != IB_WC_SUCCESS)
+				break;
+			offset += zcopy.frags[i].len;
+		}
+		rcu_read_unlock();
+
+		pib_util_zcopy_release(&zcopy);
+
+		if (status != IB_WC_SUCCESS)
+			return status;
+	}
+
+	return IB_WC_SUCCESS;
+}
+
+
 static enum ib_wc_status
 process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int with_reth, int with_imm, int with_inv)
 {
@@ -311,7 +672,6 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 	u64 mr_offset;
 	u32 payload_size, packet_length, fix_packet_length;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	if (PIB_MAX_PAYLOAD_LEN < send_wqe->total_length)
 		return IB_WC_LOC_LEN_ERR;
@@ -323,8 +683,6 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 		reth->vaddr  = cpu_to_be64(send_wqe->wr.rdma.remote_addr);
 		reth->rkey   = cpu_to_be32(send_wqe->wr.rdma.rkey);
 		reth->dmalen = cpu_to_be32(send_wqe->total_length);
-
-		qp->requester.nr_contig_requests = 0;
 	}
 
 	if (with_imm) {
@@ -351,12 +709,25 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 	} else {
 		pd = to_ppd(qp->ib_qp.pd);
 
-		spin_lock_irqsave(&pd->lock, flags);
-		status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
-					       buffer, mr_offset, payload_size,
-					       0,
-					       PIB_MR_COPY_FROM);
-		spin_unlock_irqrestore(&pd->lock, flags);
+		rcu_read_lock();
+		/*
+		 * UC は最後のパケットを組み立てた時点で完了するので、送信前に
+		 * ユーザがバッファを再利用しうる。zero-copy 送信は RC に限る。
+		 */
+		if (pib_zcopy_tx && (qp->qp_type == IB_QPT_RC) &&
+		    (pib_zcopy_tx <= send_wqe->total_length) &&
+		    (pib_util_mr_map_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+					  &send_wqe->processing.cursor, &qp->thread->zcopy, mr_offset, payload_size,
+					  0) == IB_WC_SUCCESS))
+			/* ペイロードはコピーせず送信時に MR のページから直接送る */
+			qp->thread->zcopy.offset = buffer - qp->thread->send_buffer;
+		else
+			status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+						       &send_wqe->processing.cursor,
+						       buffer, mr_offset, payload_size,
+						       0,
+						       PIB_MR_COPY_FROM);
+		rcu_read_unlock();
 	}
 
 	if (status != IB_WC_SUCCESS)
@@ -365,7 +736,7 @@ process_SEND_or_RDMA_WRITE_request(struct pib_dev *dev, struct pib_qp *qp, struc
 	buffer += payload_size;
 
 	/* calculate packet length & pad count */
-	packet_length     = buffer - dev->thread.send_buffer;
+	packet_length     = buffer - qp->thread->send_buffer;
 	fix_packet_length = (packet_length + 3) & ~3;
 
 	pib_packet_lrh_set_pktlen(lrh, (fix_packet_length + 4) / 4); /* add ICRC size */
@@ -422,7 +793,7 @@ process_RDMA_READ_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_sen
 	reth->dmalen = cpu_to_be32(dmalen);
 
 	/* calculate packet length & pad count */
-	packet_length     = buffer - dev->thread.send_buffer;
+	packet_length     = buffer - qp->thread->send_buffer;
 	fix_packet_length = (packet_length + 3) & ~3;
 
 	pib_packet_lrh_set_pktlen(lrh, (fix_packet_length + 4) / 4); /* add ICRC size */
@@ -448,7 +819,7 @@ process_Atomic_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_w
 	atomiceth->cmp_dt  = cpu_to_be64(send_wqe->wr.atomic.compare_add);
 
 	/* calculate packet length & pad count */
-	packet_length     = buffer - dev->thread.send_buffer;
+	packet_length     = buffer - qp->thread->send_buffer;
 	fix_packet_length = (packet_length + 3) & ~3;
 
 	pib_packet_lrh_set_pktlen(lrh, (fix_packet_length + 4) / 4); /* add ICRC size */
@@ -546,6 +917,13 @@ void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 		/* silently drop */
 		return;
 
+	if (qp->qp_type == IB_QPT_UC) {
+		/* UC には ACK も CNP もない */
+		if ((bth->OpCode & 0xE0) == IB_OPCODE_UC)
+			receive_request(dev, port_num, qp, lrh, grh, bth, buffer, size);
+		return;
+	}
+
 	if (bth->OpCode == PIB_OPCODE_CNP_SEND_NOTIFY) {
 		receive_cnp_notify(dev, port_num, qp, lrh, grh, bth, buffer, size);
 		return;
@@ -560,6 +938,190 @@ void pib_receive_rc_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 }
 
 
+/*
+ *  Zero-copy 受信の準備。
+ *
+ *  先頭だけを覗き見たパケット (packet_size は全体の長さ) が次に期待する
+ *  PSN の RC SEND または RDMA WRITE なら、ペイロードの書き込み先の
+ *  ページ断片を zcopy に集めてパケット中のペイロードの位置を返す。
+ *  対象外なら 0 を返す。この場合パケットは通常どおり受信する。
+ *
+ *  recvmsg はスリープしうるのでロックは戻る前にすべて解放する。
+ *  書き込み先のページは zcopy の参照で保持されるので、受信中に MR が
+ *  登録解除されても解放されない。書き込み先がまだ正しいかは受信後に
+ *  もう一度この関数を呼んで断片を比較すること。
+ *  ページを持たない DMA MR と、invalidate と fast reg で書き換わる
+ *  Fast Reg MR は対象外。
+ */
+int pib_prepare_rc_qp_zcopy_rx(struct pib_dev *dev, u8 port_num, void *buffer, int peeked_size, int packet_size, struct pib_zcopy *zcopy)
+{
+	int header_size, size, offset, i;
+	int with_reth = 0, with_imm = 0, init = 0, is_send = 0;
+	u32 dest_qp_num, psn;
+	u16 dlid;
+	struct pib_port *port;
+	struct pib_packet_lrh *lrh;
+	struct ib_grh         *grh;
+	struct pib_packet_bth *bth;
+	struct pib_qp *qp;
+	struct pib_pd *pd;
+	enum ib_wc_status status;
+	unsigned long flags;
+
+	port = &dev->ports[port_num - 1];
+
+	if (port->ib_port_attr.state != IB_PORT_ACTIVE)
+		return 0;
+
+	size = packet_size - sizeof(union pib_packet_footer);
+
+	if ((peeked_size < sizeof(*lrh)) || (size <= 0))
+		return 0;
+
+	header_size = pib_parse_packet_header(buffer, size, &lrh, &grh, &bth);
+	if ((header_size < 0) || ((lrh->sl_rsv_lnh & 0x3) == 0))
+		return 0;
+
+	switch (bth->OpCode) {
+
+	case IB_OPCODE_RC_SEND_FIRST:
+	case IB_OPCODE_RC_SEND_ONLY:
+		init = 1;
+		/* pass through */
+	case IB_OPCODE_RC_SEND_MIDDLE:
+	case IB_OPCODE_RC_SEND_LAST:
+		is_send = 1;
+		break;
+
+	case IB_OPCODE_RC_SEND_ONLY_WITH_IMMEDIATE:
+		init = 1;
+		/* pass through */
+	case IB_OPCODE_RC_SEND_LAST_WITH_IMMEDIATE:
+		is_send  = 1;
+		with_imm = 1;
+		break;
+
+	case IB_OPCODE_RC_RDMA_WRITE_ONLY_WITH_IMMEDIATE:
+		with_imm  = 1;
+		/* pass through */
+	case IB_OPCODE_RC_RDMA_WRITE_FIRST:
+	case IB_OPCODE_RC_RDMA_WRITE_ONLY:
+		with_reth = 1;
+		break;
+
+	case IB_OPCODE_RC_RDMA_WRITE_LAST_WITH_IMMEDIATE:
+		with_imm  = 1;
+		/* pass through */
+	case IB_OPCODE_RC_RDMA_WRITE_MIDDLE:
+	case IB_OPCODE_RC_RDMA_WRITE_LAST:
+		break;
+
+	default:
+		return 0;
+	}
+
+	offset = header_size +
+		(with_reth ? sizeof(struct pib_packet_reth) : 0) + (with_imm ? 4 : 0);
+
+	/* Pad Count & ICRC */
+	size -= offset + pib_packet_bth_get_padcnt(bth) + 4;
+
+	if ((size <= 0) || (peeked_size < offset))
+		return 0;
+
+	dlid        = be16_to_cpu(lrh->dlid);
+	dest_qp_num = be32_to_cpu(bth->destQP) & PIB_QPN_MASK;
+	psn         = be32_to_cpu(bth->psn) & PIB_PSN_MASK;
+
+	if (!pib_is_unicast_lid(dlid) || (dlid != port->ib_port_attr.lid))
+		return 0;
+
+	spin_lock_irqsave(&dev->lock, flags);
+
+	qp = pib_util_find_qp(dev, dest_qp_num);
+	if (!qp || (qp->qp_type != IB_QPT_RC)) {
+		spin_unlock_irqrestore(&dev->lock, flags);
+		return 0;
+	}
+
+	pib_spin_lock(&qp->lock);
+	spin_unlock(&dev->lock);
+
+	/* 通常の受信処理で受理されるパケットだけを対象にする */
+	if (!pib_is_recv_ok(qp->state) ||
+	    (qp->ib_qp_attr.port_num != port_num) ||
+	    (port->pkey_table[qp->ib_qp_attr.pkey_index] != bth->pkey) ||
+	    (psn != qp->responder.psn) ||
+	    !pib_opcode_is_in_order_sequence(bth->OpCode, qp->responder.last_OpCode))
+		goto done;
+
+	pd = to_ppd(qp->ib_qp.pd);
+
+	if (is_send) {
+		struct pib_recv_wqe *recv_wqe;
+
+		/* SRQ は RWQE を移す処理があるので対象外 */
+		if (qp->ib_qp_init_attr.srq || list_empty(&qp->responder.recv_wqe_head))
+			goto done;
+
+		recv_wqe = list_first_entry(&qp->responder.recv_wqe_head, struct pib_recv_wqe, list);
+
+		rcu_read_lock();
+		status = pib_util_mr_map_data(pd, recv_wqe->sge_array, recv_wqe->num_sge, &recv_wqe->cursor, zcopy,
+					      init ? 0 : qp->responder.offset, size,
+					      IB_ACCESS_LOCAL_WRITE);
+	} else {
+		u64 vaddr;
+		u32 rkey, dmalen, mr_offset;
+
+		if (with_reth) {
+			struct pib_packet_reth *reth = buffer + header_size;
+
+			vaddr     = be64_to_cpu(reth->vaddr);
+			rkey      = be32_to_cpu(reth->rkey);
+			dmalen    = be32_to_cpu(reth->dmalen);
+			mr_offset = 0;
+		} else {
+			vaddr     = qp->responder.rdma_write.vaddr;
+			rkey      = qp->responder.rdma_write.rkey;
+			dmalen    = qp->responder.rdma_write.dmalen;
+			mr_offset = qp->responder.offset;
+		}
+
+		if ((PIB_MAX_PAYLOAD_LEN < dmalen) || (dmalen < mr_offset + size))
+			goto done;
+
+		rcu_read_lock();
+		status = pib_util_mr_map_data_with_rkey(pd, rkey, zcopy, vaddr + mr_offset, size,
+							IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE);
+	}
+
+	rcu_read_unlock();
+
+	if (status != IB_WC_SUCCESS)
+		goto done;
+
+	if (zcopy->fast_reg)
+		goto done_release;
+
+	for (i=0 ; i < zcopy->nr_frags ; i++)
+		if (!zcopy->frags[i].page)
+			goto done_release;
+
+	pib_spin_unlock_irqrestore(&qp->lock, flags);
+
+	return offset;
+
+done_release:
+	pib_util_zcopy_release(zcopy);
+
+done:
+	pib_spin_unlock_irqrestore(&qp->lock, flags);
+
+	return 0;
+}
+
+
 /******************************************************************************/
 /* Responder: Receiving Inbound Request Packets                               */
 /******************************************************************************/
@@ -571,9 +1133,11 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 	s32 psn_diff;
 	int OpCode;
 	u32 psn;
+	int ackreq;
 
 	OpCode = bth->OpCode;
 	psn    = be32_to_cpu(bth->psn) & PIB_PSN_MASK;
+	ackreq = pib_packet_bth_get_ackreq(bth);
 
 	pib_trace_recv_ok(dev, port_num, OpCode, psn, qp->ib_qp.qp_num, size);
 
@@ -581,10 +1145,55 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 
 	psn_diff = get_psn_diff(psn, qp->responder.psn);
 
+	if (qp->qp_type == IB_QPT_UC) {
+		/* 以降は RC の OpCode で処理する */
+		OpCode = IB_OPCODE_RC + (OpCode & 0x1F);
+
+		switch (OpCode) {
+		case IB_OPCODE_RC_SEND_FIRST:
+		case IB_OPCODE_RC_SEND_MIDDLE:
+		case IB_OPCODE_RC_SEND_LAST:
+		case IB_OPCODE_RC_SEND_LAST_WITH_IMMEDIATE:
+		case IB_OPCODE_RC_SEND_ONLY:
+		case IB_OPCODE_RC_SEND_ONLY_WITH_IMMEDIATE:
+		case IB_OPCODE_RC_RDMA_WRITE_FIRST:
+		case IB_OPCODE_RC_RDMA_WRITE_MIDDLE:
+		case IB_OPCODE_RC_RDMA_WRITE_LAST:
+		case IB_OPCODE_RC_RDMA_WRITE_LAST_WITH_IMMEDIATE:
+		case IB_OPCODE_RC_RDMA_WRITE_ONLY:
+		case IB_OPCODE_RC_RDMA_WRITE_ONLY_WITH_IMMEDIATE:
+			break;
+		default:
+			/* silently drop */
+			return;
+		}
+
+		/*
+		 * UC は再送しないので、PSN が飛んだら受信中のメッセージを捨てて
+		 * 新しい PSN に合わせ直す。途中のパケットは次の FIRST か ONLY まで捨てる。
+		 */
+		if (psn_diff != 0) {
+			abort_uc_message(qp);
+			qp->responder.psn = psn;
+		}
+
+		if (!pib_opcode_is_in_order_sequence(OpCode, qp->responder.last_OpCode)) {
+			abort_uc_message(qp);
+			return;
+		}
+
+		goto in_order;
+	}
+
 	if (0 < psn_diff) {
-		/* Out of Sequence Request Packet */
-		push_acknowledge(qp, psn, PIB_SYND_NAK_CODE_PSN_SEQ_ERR);
-		/* @todo NAK の時の PSN はこれでいいのか？ */
+		/*
+		 * Out of Sequence Request Packet
+		 * 欠落ごとに一度だけ、次に期待する PSN で NAK を返す (IBA 9.7.5.2.1)
+		 */
+		if (!qp->responder.psn_seq_nak) {
+			push_acknowledge(qp, qp->responder.psn, PIB_SYND_NAK_CODE_PSN_SEQ_ERR);
+			qp->responder.psn_seq_nak = 1;
+		}
 		return;
 	}
 
@@ -597,7 +1206,7 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 		case IB_OPCODE_RC_COMPARE_SWAP:
 		case IB_OPCODE_RC_FETCH_ADD:
 			for (i=1 ; i <= qp->ib_qp_attr.max_dest_rd_atomic ; i++) {
-				int slot_index = ((unsigned int)(qp->responder.slot_index - i)) % PIB_MAX_RD_ATOM;
+				int slot_index = ((unsigned int)(qp->responder.slot_index - i)) % qp->responder.nr_slots;
 
 				slot = qp->responder.slots[slot_index];
 
@@ -624,8 +1233,12 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 			break;
 		}
 
-		/* Resend response for duplicated packet */
-		push_acknowledge(qp, psn, PIB_SYND_ACK_CODE);
+		/*
+		 * Resend response for duplicated packet.
+		 * 最後に受信したパケットまでの ACK が重複パケットもカバーする。
+		 */
+		push_acknowledge(qp, qp->responder.psn - 1, PIB_SYND_ACK_CODE);
+		flush_acknowledge(qp);
 		return;
 	}
 
@@ -638,6 +1251,7 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 		return;
 	}
 
+in_order:
 	switch (OpCode) {
 
 	case IB_OPCODE_RC_SEND_FIRST:
@@ -679,7 +1293,12 @@ receive_request(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib_
 	if (ret >= 0) {
 		qp->responder.psn += ret;
 		qp->responder.last_OpCode = OpCode;
+		qp->responder.psn_seq_nak = 0;
 	}
+
+	/* AckReq ビットが立っていれば ACK を遅延させない */
+	if (ackreq)
+		flush_acknowledge(qp);
 }
 
 
@@ -800,22 +1419,29 @@ receive_SEND_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, stru
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
-	status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
-				       buffer, qp->responder.offset, size,
-				       IB_ACCESS_LOCAL_WRITE,
-				       PIB_MR_COPY_TO);
+	rcu_read_lock();
+	if (pib_util_rx_payload_placed(dev, qp, psn))
+		/* ペイロードは受信時に RWQE の SGE へ直接書き込み済み */
+		status = IB_WC_SUCCESS;
+	else
+		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
+					       &recv_wqe->cursor,
+					       buffer, qp->responder.offset, size,
+					       IB_ACCESS_LOCAL_WRITE,
+					       PIB_MR_COPY_TO);
+	rcu_read_unlock();
 
 	if (with_inv && status == IB_WC_SUCCESS)
 	{
+		spin_lock_irqsave(&pd->lock, flags);
 		status = pib_util_mr_invalidate(pd, invalidate_rkey);
+		spin_unlock_irqrestore(&pd->lock, flags);
 		if (status != IB_WC_SUCCESS)
 		{
 			remote_invalidate_error = 1;
 			goto completion_error;
 		}
 	}
-	spin_unlock_irqrestore(&pd->lock, flags);
 
 	switch (status) {
 	case IB_WC_SUCCESS:
@@ -894,6 +1520,12 @@ completion_error:
 	if (!remote_invalidate_error)
 		push_acknowledge(qp, psn, syndrome);
 
+	/* UC の responder はメッセージを捨てるだけで QP をエラーにしない */
+	if (qp->qp_type == IB_QPT_UC) {
+		abort_uc_message(qp);
+		return -1;
+	}
+
 	qp->state = IB_QPS_ERR;
 	pib_util_flush_qp(qp, 0);
 
@@ -913,7 +1545,6 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 	struct pib_recv_wqe *recv_wqe = NULL;
 	struct pib_pd *pd;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	pmtu = (128U << qp->ib_qp_attr.path_mtu);
 
@@ -1015,14 +1646,21 @@ receive_RDMA_WRITE_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
-	status = pib_util_mr_copy_data_with_rkey(pd, qp->responder.rdma_write.rkey,
-						 buffer,
-						 qp->responder.rdma_write.vaddr + qp->responder.offset,
-						 size,
-						 IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE,
-						 PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_lock();
+	if (pib_util_rx_payload_placed(dev, qp, psn))
+		/* ペイロードは受信時に MR へ直接書き込み済み */
+		status = pib_util_mr_verify_rkey_validation(pd, qp->responder.rdma_write.rkey,
+							    qp->responder.rdma_write.vaddr + qp->responder.offset,
+							    size,
+							    IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE);
+	else
+		status = pib_util_mr_copy_data_with_rkey(pd, qp->responder.rdma_write.rkey,
+							 buffer,
+							 qp->responder.rdma_write.vaddr + qp->responder.offset,
+							 size,
+							 IB_ACCESS_LOCAL_WRITE | IB_ACCESS_REMOTE_WRITE,
+							 PIB_MR_COPY_TO);
+	rcu_read_unlock();
 
 	/*
 	 * IBA Spec. Vol.1 10.7.2.2 states the following sentence
@@ -1086,6 +1724,12 @@ nak_invalid_request:
 	return -1;
 
 asynchronous_error:
+	/* UC は非同期エラーを上げず、メッセージを捨てるだけ */
+	if (qp->qp_type == IB_QPT_UC) {
+		abort_uc_message(qp);
+		return -1;
+	}
+
 	pib_util_insert_async_qp_error(qp, IB_EVENT_QP_ACCESS_ERR);
 
 	abort_active_rwqe(dev, qp);
@@ -1113,6 +1757,11 @@ common_error:
 		break;
 	}
 
+	if (qp->qp_type == IB_QPT_UC) {
+		abort_uc_message(qp);
+		return -1;
+	}
+
 	qp->state = IB_QPS_ERR;
 	pib_util_flush_qp(qp, 0);
 
@@ -1129,7 +1778,6 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 	struct pib_rd_atom_slot slot;
 	u64 vaddr;
 	u64 result;
-	unsigned long flags;
 
 	if (size != sizeof(*atomiceth)) {
 		/* Invalid Request Local Work Queue Error */
@@ -1157,13 +1805,13 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
+	rcu_read_lock();
 	status = pib_util_mr_atomic(pd, be32_to_cpu(atomiceth->rkey), vaddr,
 				    be64_to_cpu(atomiceth->swap_dt),
 				    be64_to_cpu(atomiceth->cmp_dt),
 				    &result,
 				    (OpCode == IB_WR_ATOMIC_CMP_AND_SWP) ? PIB_MR_CAS : PIB_MR_FETCHADD);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_unlock();
 
 	if (status != IB_WC_SUCCESS) {
 		/* Local Access Violation Work Queue Error */
@@ -1177,7 +1825,7 @@ receive_Atomic_request(struct pib_dev *dev, u8 port_num, u32 psn, int OpCode, st
 	slot.expected_psn    = qp->responder.psn + 1;
 	slot.data.atomic.res = result;
 
-	qp->responder.slots[(qp->responder.slot_index++) % PIB_MAX_RD_ATOM] = slot;
+	qp->responder.slots[(qp->responder.slot_index++) % qp->responder.nr_slots] = slot;
 
 	push_atomic_acknowledge(qp, psn, result);
 
@@ -1197,7 +1845,6 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 	struct pib_rd_atom_slot slot;
 	struct pib_pd *pd;
 	enum ib_wc_status status = IB_WC_SUCCESS;
-	unsigned long flags;
 
 	if (size != sizeof(*reth))
 		goto nak_invalid_request;
@@ -1215,9 +1862,9 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
+	rcu_read_lock();
 	status = pib_util_mr_verify_rkey_validation(pd, rkey, remote_addr, dmalen, IB_ACCESS_REMOTE_READ);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_unlock();
 
 	if (status != IB_WC_SUCCESS) {
 		/* Local Access Violation Work Queue Error */
@@ -1235,7 +1882,7 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 		if (qp->ib_qp_attr.max_dest_rd_atomic <= qp->responder.nr_rd_atomic)
 			goto length_error_or_too_many_rdma_read;
 
-		overwrite_slot = qp->responder.slots[((unsigned int)(qp->responder.slot_index - qp->ib_qp_attr.max_dest_rd_atomic)) % PIB_MAX_RD_ATOM];
+		overwrite_slot = qp->responder.slots[((unsigned int)(qp->responder.slot_index - qp->ib_qp_attr.max_dest_rd_atomic)) % qp->responder.nr_slots];
 
 		slot.OpCode                  = IB_OPCODE_RC_RDMA_READ_REQUEST;
 		slot.psn                     = qp->responder.psn;
@@ -1244,7 +1891,7 @@ receive_RDMA_READ_request(struct pib_dev *dev, u8 port_num, u32 psn, struct pib_
 		slot.data.rdma_read.rkey     = rkey;
 		slot.data.rdma_read.dmalen   = dmalen;
 
-		qp->responder.slots[(qp->responder.slot_index++) % PIB_MAX_RD_ATOM] = slot;
+		qp->responder.slots[(qp->responder.slot_index++) % qp->responder.nr_slots] = slot;
 
 		/* rq_psn は RDMA READ response packets を投げる前に一気に進める */
 		ret = num_packets;
@@ -1299,6 +1946,10 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 {
 	struct pib_ack *ack;
 
+	/* UC は ACK を返さない */
+	if (qp->qp_type == IB_QPT_UC)
+		return;
+
 	if (!list_empty(&qp->responder.ack_head)) {
 		struct pib_ack *ack_last;
 
@@ -1317,9 +1968,15 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 
 			if (((syndrome & PIB_SYND_CODE_MASK)           == PIB_SYND_ACK_CODE) &&
 			    ((ack_last->syndrome & PIB_SYND_CODE_MASK) == PIB_SYND_ACK_CODE)) {
-				/* IBA Spec. Vol.1 9.7.5.1.2. Coalesced Acknowledge Messages */
-				ack_last->psn          = psn;
-				ack_last->expected_psn = psn + 1;
+				/*
+				 * IBA Spec. Vol.1 9.7.5.1.2. Coalesced Acknowledge Messages
+				 * 既にカバーされている PSN の ACK は併合するだけ
+				 */
+				if (get_psn_diff(psn, ack_last->psn) > 0) {
+					ack_last->psn          = psn;
+					ack_last->expected_psn = psn + 1;
+				}
+				ack_last->nr_packets++;
 				return;
 			}
 		}
@@ -1334,6 +1991,8 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 	ack->psn		= psn;
 	ack->expected_psn	= psn + 1;
 	ack->syndrome		= syndrome;
+	ack->nr_packets		= 1;
+	ack->deadline		= pib_sched_now() + pib_get_ack_delay_time();
 
 	list_add_tail(&ack->list, &qp->responder.ack_head);
 
@@ -1343,6 +2002,27 @@ push_acknowledge(struct pib_qp *qp, u32 psn, enum pib_syndrome syndrome)
 }
 
 
+/*
+ *  積まれている最後の ACK を遅延させずに送る。
+ */
+static void
+flush_acknowledge(struct pib_qp *qp)
+{
+	struct pib_ack *ack_last;
+
+	if (list_empty(&qp->responder.ack_head))
+		return;
+
+#ifdef list_last_entry
+	ack_last = list_last_entry(&qp->responder.ack_head, struct pib_ack, list);
+#else
+	ack_last = list_entry(qp->responder.ack_head.prev, struct pib_ack, list);
+#endif
+
+	ack_last->deadline = pib_sched_now();
+}
+
+
 static void
 remove_overlapped_rdma_read_acknowledge(struct pib_qp *qp, u32 psn, u32 expected_psn)
 {
@@ -1418,6 +2098,7 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 {
 	u8 port_num;
 	u16 dlid;
+	unsigned long now;
 	struct pib_ack *ack;
 
 	if (!pib_is_recv_ok(qp->state))
@@ -1441,6 +2122,10 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 		break;
 
 	case PIB_ACK_NORMAL:
+		now = pib_sched_now();
+		if (time_after(pib_get_rc_qp_acknowledge_time(qp, now), now))
+			return 0; /* 遅延 ACK */
+
 		generate_Normal_or_Atomic_acknowledge(dev, qp, dlid, ack);
 		break;
 
@@ -1450,9 +2135,13 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 
 		generate_RDMA_READ_response(dev, qp, dlid, ack);
 
-		if (ack->data.rdma_read.offset < ack->data.rdma_read.size)
+		if (ack->data.rdma_read.offset < ack->data.rdma_read.size) {
+			/* 残りの response packets は read_burst 個まで他の QP に回さず続けて送る */
+			qp->sched.burst = ((qp->responder.nr_contig_read_acks % max(pib_read_burst, 1U)) != 0);
 			return 1;
+		}
 
+		qp->sched.burst = 0;
 		qp->responder.nr_rd_atomic--;
 		break;
 
@@ -1467,6 +2156,36 @@ int pib_generate_rc_qp_acknowledge(struct pib_dev *dev, struct pib_qp *qp)
 }
 
 
+/*
+ *  ack_head の先頭の ACK を送信すべき時刻を返す。
+ *  後続のない正常な ACK だけは ack_coalesce パケット分か ack_delay まで遅延させる。
+ */
+unsigned long pib_get_rc_qp_acknowledge_time(const struct pib_qp *qp, unsigned long now)
+{
+	struct pib_ack *ack;
+
+	if (pib_ack_coalesce <= 1)
+		return now;
+
+	if (!list_is_singular(&qp->responder.ack_head))
+		return now;
+
+	ack = list_first_entry(&qp->responder.ack_head, struct pib_ack, list);
+
+	if ((ack->type != PIB_ACK_NORMAL) ||
+	    ((ack->syndrome & PIB_SYND_CODE_MASK) != PIB_SYND_ACK_CODE))
+		return now;
+
+	if (pib_ack_coalesce <= ack->nr_packets)
+		return now;
+
+	if (time_before_eq(ack->deadline, now))
+		return now;
+
+	return ack->deadline;
+}
+
+
 static void
 generate_Normal_or_Atomic_acknowledge(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, struct pib_ack *ack)
 {
@@ -1484,12 +2203,12 @@ generate_Normal_or_Atomic_acknowledge(struct pib_dev *dev, struct pib_qp *qp, u1
 					       IB_OPCODE_RC_ATOMIC_ACKNOWLEDGE, ack->psn,
 					       1, PIB_SYND_ACK_CODE, 1, ack->data.atomic.res, NULL);
 
-	dev->thread.port_num    = port_num;
-	dev->thread.slid	= dev->ports[port_num - 1].ib_port_attr.lid;
-	dev->thread.dlid	= dlid;
-	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.trace_id    = 0; /* @todo */
-	dev->thread.ready_to_send = 1;
+	qp->thread->port_num    = port_num;
+	qp->thread->slid	= dev->ports[port_num - 1].ib_port_attr.lid;
+	qp->thread->dlid	= dlid;
+	qp->thread->src_qp_num	= qp->ib_qp.qp_num;
+	qp->thread->trace_id    = 0; /* @todo */
+	qp->thread->ready_to_send = 1;
 }
 
 
@@ -1505,10 +2224,9 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 	struct pib_packet_lrh *lrh;
 	struct pib_packet_bth *bth;
 	enum ib_wc_status status;
-	unsigned long flags;
 	u8 port_num;
 
-	lrh = (struct pib_packet_lrh*)dev->thread.send_buffer;
+	lrh = (struct pib_packet_lrh*)qp->thread->send_buffer;
 
 	pmtu = (128U << qp->ib_qp_attr.path_mtu);
 
@@ -1539,15 +2257,26 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
-	status = pib_util_mr_copy_data_with_rkey(pd,
-						 ack->data.rdma_read.rkey,
-						 dev->thread.send_buffer + size,
-						 ack->data.rdma_read.vaddress + ack->data.rdma_read.offset,
-						 data_size,
-						 IB_ACCESS_REMOTE_READ,
-						 PIB_MR_COPY_FROM);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_lock();
+	if (pib_zcopy_tx && (pib_zcopy_tx <= ack->data.rdma_read.size) &&
+	    (pib_util_mr_map_data_with_rkey(pd,
+					    ack->data.rdma_read.rkey,
+					    &qp->thread->zcopy,
+					    ack->data.rdma_read.vaddress + ack->data.rdma_read.offset,
+					    data_size,
+					    IB_ACCESS_REMOTE_READ) == IB_WC_SUCCESS)) {
+		/* ペイロードはコピーせず送信時に MR のページから直接送る */
+		qp->thread->zcopy.offset = size;
+		status = IB_WC_SUCCESS;
+	} else
+		status = pib_util_mr_copy_data_with_rkey(pd,
+							 ack->data.rdma_read.rkey,
+							 qp->thread->send_buffer + size,
+							 ack->data.rdma_read.vaddress + ack->data.rdma_read.offset,
+							 data_size,
+							 IB_ACCESS_REMOTE_READ,
+							 PIB_MR_COPY_FROM);
+	rcu_read_unlock();
 
 	/* @todo data_size が 4 の倍数で終わらない場合に尻尾にゴミが入っている */
 
@@ -1557,12 +2286,12 @@ generate_RDMA_READ_response(struct pib_dev *dev, struct pib_qp *qp, u16 dlid, st
 
 	port_num = qp->ib_qp_attr.port_num;
 
-	dev->thread.port_num    = port_num;
-	dev->thread.slid	= dev->ports[port_num - 1].ib_port_attr.lid;
-	dev->thread.dlid	= dlid;
-	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.trace_id    = 0; /* @todo */
-	dev->thread.ready_to_send = 1;
+	qp->thread->port_num    = port_num;
+	qp->thread->slid	= dev->ports[port_num - 1].ib_port_attr.lid;
+	qp->thread->dlid	= dlid;
+	qp->thread->src_qp_num	= qp->ib_qp.qp_num;
+	qp->thread->trace_id    = 0; /* @todo */
+	qp->thread->ready_to_send = 1;
 
 	ack->data.rdma_read.offset += data_size;
 
@@ -1578,52 +2307,25 @@ pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32
 {
 	int size;
 	void *buffer;
-	u8 port_num;
-	struct ib_ah_attr ah_attr;
 	struct pib_packet_lrh *lrh;
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
 	struct pib_packet_aeth *aeth = NULL;
 	struct pib_packet_atomicacketh *atomicacketh = NULL;
-	u32 lnh;
 
-	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
-
-	buffer = dev->thread.send_buffer;
-
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth) + sizeof(*aeth) + sizeof(*atomicacketh));
-
-	/* @todo not yet implemented credit count */
-
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
-
-	lrh->sl_rsv_lnh = (qp->ib_qp_attr.ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid	= cpu_to_be16(qp->ib_qp_attr.ah_attr.dlid);
-	lrh->slid       = cpu_to_be16(dev->ports[port_num - 1].ib_port_attr.lid);
+	buffer = copy_header_template(dev, qp, &lrh, &grh, &bth);
 
 	bth->OpCode     = OpCode;
-	bth->pkey       = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP     = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
 	bth->psn        = cpu_to_be32(psn & PIB_PSN_MASK); /* A-bit is 0 */ 
 
 	if (with_aeth) {
 		aeth = (struct pib_packet_aeth*)buffer;
 		buffer += sizeof(*aeth);
 
+		/* ACK には送信時点の RQ の空きをクレジットとして載せる */
+		if ((syndrome & PIB_SYND_CODE_MASK) == PIB_SYND_ACK_CODE)
+			syndrome = PIB_SYND_ACK_CODE | get_credit_code(qp);
+
 		aeth->syndrome_msn = cpu_to_be32(syndrome << 24);
 	}
 
@@ -1634,7 +2336,7 @@ pack_acknowledge_packet(struct pib_dev *dev, struct pib_qp *qp, int OpCode, u32
 		atomicacketh->orig_rem_dt = cpu_to_be64(res);
 	}
 
-	size = buffer - dev->thread.send_buffer;
+	size = buffer - qp->thread->send_buffer;
 
 	pib_packet_lrh_set_pktlen(lrh, (size + 4)/ 4); /* add ICRC size */
 	pib_packet_bth_set_padcnt(bth, 0);
@@ -1658,15 +2360,12 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 	u32 psn, syndrome;
 	unsigned long rnr_nak_timeout = 0;
 	struct pib_packet_aeth *aeth;
-	struct pib_send_wqe *send_wqe, *next_send_wqe;
+	struct pib_send_wqe *send_wqe;
 
 	if (size < sizeof(*aeth))
 		/* @todo これはエラーにとらないでいいか？ */
 		return 0;
 
-	/* レスポンスを受ければ連続送信はクリアできる */
-	qp->requester.nr_contig_requests = 0;
-
 	/* response's PSN */
 	psn = be32_to_cpu(bth->psn) & PIB_PSN_MASK;
 
@@ -1678,14 +2377,18 @@ receive_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct pib
 
 	pib_trace_recv_ok(dev, port_num, bth->OpCode, psn, qp->ib_qp.qp_num, syndrome);
 
-	if (bth->OpCode == IB_OPCODE_RC_RDMA_READ_RESPONSE_MIDDLE)
+	if (bth->OpCode == IB_OPCODE_RC_RDMA_READ_RESPONSE_MIDDLE) {
 		/* RDMA READ response Middle packets have no AETH. */
+		update_acked_psn(qp, psn);
 		goto switch_OpCode;
+	}
 
 	switch (syndrome & PIB_SYND_CODE_MASK) {
 
 	case PIB_SYND_ACK_CODE:
 		/* ACK */
+		update_acked_psn(qp, psn);
+		update_credits(qp, psn, syndrome & PIB_SYND_CREDIT_MASK);
 		break;
 
 	case PIB_SYND_RNR_NAK_CODE:
@@ -1766,19 +2469,10 @@ switch_OpCode:
 	return ret;
 
 retry_send:
-	/* waiting list から sending list へ戻す */
-	list_for_each_entry_safe_reverse(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
-		send_wqe->processing.list_type = PIB_SWQE_SENDING;
-		list_del_init(&send_wqe->list);
-		list_add(&send_wqe->list, &qp->requester.sending_swqe_head);
-		qp->requester.nr_waiting_swqe--;
-		qp->requester.nr_sending_swqe++;
-	}
+	/* NAK の PSN より前のパケットは相手に届いている */
+	update_acked_psn(qp, psn - 1);
 
-	/* 送信したパケット数をキャンセルする */
-	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list) {
-		send_wqe->processing.sent_packets = send_wqe->processing.ack_packets;
-	}
+	pib_rewind_rc_qp_request(qp, psn);
 
 	/* 最初の Send WQE が SEND また RDMA WRITE w/Immediate なら rnr_retry を減算する */
 	if (rnr_nak_timeout && !list_empty(&qp->requester.sending_swqe_head)) {
@@ -1788,7 +2482,7 @@ retry_send:
 		case IB_WR_SEND:
 		case IB_WR_SEND_WITH_IMM:
 		case IB_WR_RDMA_WRITE_WITH_IMM:
-			send_wqe->processing.schedule_time = rnr_nak_timeout;
+			send_wqe->processing.schedule_time = pib_sched_now() + rnr_nak_timeout;
 				
 			if (qp->ib_qp_attr.rnr_retry < 7) /* The value of 7 means infinity */
 				send_wqe->processing.rnr_retry--;
@@ -1803,6 +2497,50 @@ retry_send:
 }
 
 
+/*
+ *  再送のために waiting list の Send WQE を sending list へ戻す。
+ *
+ *  selective_retransmit が有効なら psn より前のパケットは相手に届いているものとして、
+ *  psn 以降の欠落した範囲だけを再送する。そうでなければ ACK を受けたパケットの
+ *  直後から送信し直す。
+ */
+void pib_rewind_rc_qp_request(struct pib_qp *qp, u32 psn)
+{
+	struct pib_send_wqe *send_wqe, *next_send_wqe;
+
+	/* waiting list から sending list へ戻す */
+	list_for_each_entry_safe_reverse(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
+		/* psn までに送信し終えた Send WQE は ACK を待ち続ける */
+		if (pib_selective_retransmit &&
+		    (get_psn_diff(send_wqe->processing.expected_psn, psn) <= 0))
+			break;
+
+		send_wqe->processing.list_type = PIB_SWQE_SENDING;
+		list_del_init(&send_wqe->list);
+		list_add(&send_wqe->list, &qp->requester.sending_swqe_head);
+		qp->requester.nr_waiting_swqe--;
+		qp->requester.nr_sending_swqe++;
+	}
+
+	/* 送信したパケット数をキャンセルする */
+	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list) {
+		u32 sent_packets = send_wqe->processing.ack_packets;
+
+		if (pib_selective_retransmit && !pib_is_wr_opcode_rd_atomic(send_wqe->opcode)) {
+			s32 psn_diff = get_psn_diff(psn, send_wqe->processing.based_psn);
+
+			if ((s32)sent_packets < psn_diff)
+				sent_packets = min_t(u32, psn_diff, send_wqe->processing.sent_packets);
+		}
+
+		if (sent_packets < send_wqe->processing.sent_packets)
+			send_wqe->processing.retransmitted = 1;
+
+		send_wqe->processing.sent_packets = sent_packets;
+	}
+}
+
+
 /*
  *  QP 内の送信中の SEND WR から psn にあたるものを status の completion error とする。
  */
@@ -1831,6 +2569,52 @@ set_send_wqe_to_error(struct pib_qp *qp, u32 psn, enum ib_wc_status status)
 }
 
 
+/*
+ *  psn までのパケットは相手に届いた。送信ウィンドウを進める。
+ */
+static void
+update_acked_psn(struct pib_qp *qp, u32 psn)
+{
+	u32 acked_psn = (psn + 1) & PIB_PSN_MASK;
+
+	if ((get_psn_diff(acked_psn, qp->requester.acked_psn)    > 0) &&
+	    (get_psn_diff(acked_psn, qp->requester.expected_psn) <= 0))
+		qp->requester.acked_psn = acked_psn;
+}
+
+
+/*
+ *  ACK のクレジットは psn までを処理した時点の相手の RQ の空きなので、
+ *  psn 以降に送信済みで RWQE を消費するメッセージの分を差し引く。
+ */
+static void
+update_credits(struct pib_qp *qp, u32 psn, int credit_code)
+{
+	int credits;
+	struct pib_send_wqe *send_wqe;
+
+	if (credit_code == PIB_SYND_CREDIT_INVALID) {
+		qp->requester.credits = PIB_CREDITS_UNLIMITED;
+		return;
+	}
+
+	credits = credit_table[credit_code];
+
+	list_for_each_entry(send_wqe, &qp->requester.waiting_swqe_head, list)
+		if (is_consuming_rwqe(send_wqe->opcode) &&
+		    (get_psn_diff(send_wqe->processing.expected_psn, psn + 1) > 0))
+			credits--;
+
+	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list)
+		if (is_consuming_rwqe(send_wqe->opcode) &&
+		    (0 < send_wqe->processing.sent_packets) &&
+		    (get_psn_diff(send_wqe->processing.expected_psn, psn + 1) > 0))
+			credits--;
+
+	qp->requester.credits = credits;
+}
+
+
 enum {
 	RET_ERROR        = -1,
 	RET_COMPLETE,
@@ -1844,6 +2628,7 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 {
 	bool is_postpone_local_ack_timeout = true;
 	struct pib_send_wqe *send_wqe, *next_send_wqe;
+	LIST_HEAD(completed_head); /* この ACK で完了した Send WQE */
 
 	list_for_each_entry_safe(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
 
@@ -1857,7 +2642,7 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 		case RET_COMPLETE:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_waiting_swqe--;
-			pib_util_free_send_wqe(qp, send_wqe);
+			list_add_tail(&send_wqe->list, &completed_head);
 			is_postpone_local_ack_timeout = true;
 			break;
 
@@ -1882,7 +2667,7 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 		case RET_COMPLETE:
 			list_del_init(&send_wqe->list);
 			qp->requester.nr_sending_swqe--;
-			pib_util_free_send_wqe(qp, send_wqe);
+			list_add_tail(&send_wqe->list, &completed_head);
 			is_postpone_local_ack_timeout = true;
 			break;
 
@@ -1899,12 +2684,17 @@ receive_ACK_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 ps
 
 	/* @todo QP を再 enqueue する条件を考えよ */
 
+	pib_util_insert_wc_success_bulk(qp, &completed_head);
+
 	if (is_postpone_local_ack_timeout)
 		postpone_local_ack_timeout(qp);
 
 	return -1;
 
 completion_error:
+	/* 先に完了した Send WQE の WC を前に入れる */
+	pib_util_insert_wc_success_bulk(qp, &completed_head);
+
 	pib_util_insert_wc_error(qp->send_cq, qp, send_wqe->wr_id,
 				 send_wqe->processing.status, send_wqe->opcode);
 
@@ -1917,6 +2707,8 @@ completion_error:
 	return -1;
 
 stop:
+	pib_util_insert_wc_success_bulk(qp, &completed_head);
+
 	if (is_postpone_local_ack_timeout)
 		postpone_local_ack_timeout(qp);
 
@@ -1958,18 +2750,9 @@ process_acknowledge(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe
 
 	/* Complete to send */
 
-	if ((qp->ib_qp_init_attr.sq_sig_type == IB_SIGNAL_ALL_WR) || 
-	    (send_wqe->send_flags & IB_SEND_SIGNALED)) {
-		int ret;
-		struct ib_wc wc = {
-			.wr_id    = send_wqe->wr_id,
-			.status   = IB_WC_SUCCESS,
-			.opcode   = pib_convert_wr_opcode_to_wc_opcode(send_wqe->opcode),
-			.qp       = &qp->ib_qp,
-		};
+	update_rtt(qp, send_wqe);
 
-		ret = pib_util_insert_wc_success(qp->send_cq, &wc, 0);
-	}
+	/* WC は receive_ACK_response がまとめて挿入する */
 
 	qp->requester.psn = (send_wqe->processing.expected_psn & PIB_PSN_MASK);
 
@@ -1977,6 +2760,32 @@ process_acknowledge(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe
 }
 
 
+/*
+ *  再送していない Send WQE の送信から ACK までの時間で SRTT と RTTVAR を更新する。
+ */
+static void
+update_rtt(struct pib_qp *qp, const struct pib_send_wqe *send_wqe)
+{
+	u64 rtt, delta;
+
+	if (send_wqe->processing.retransmitted || !send_wqe->processing.sent_time)
+		return;
+
+	rtt = ktime_to_ns(ktime_get()) - send_wqe->processing.sent_time;
+
+	if (qp->requester.srtt == 0) {
+		qp->requester.srtt   = rtt;
+		qp->requester.rttvar = rtt / 2;
+	} else {
+		delta = (qp->requester.srtt < rtt) ? rtt - qp->requester.srtt : qp->requester.srtt - rtt;
+		qp->requester.rttvar = qp->requester.rttvar - qp->requester.rttvar / 4 + delta / 4;
+		qp->requester.srtt   = qp->requester.srtt   - qp->requester.srtt   / 8 + rtt   / 8;
+	}
+
+	qp->requester.rto = max_t(u64, qp->requester.srtt + 4 * qp->requester.rttvar, PIB_MIN_RTO);
+}
+
+
 static int
 receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32 psn, void *buffer, int size)
 {
@@ -1985,7 +2794,6 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 	int *nr_swqe_p;
 	struct pib_pd *pd;
 	enum ib_wc_status status;
-	unsigned long flags;
 	u32 dmalen, offset;
 
 	send_wqe = match_send_wqe(qp, psn, &first_send_wqe, &nr_swqe_p);
@@ -2014,14 +2822,15 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
+	rcu_read_lock();
 	status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+				       &send_wqe->processing.cursor,
 				       buffer,
 				       offset,
 				       size,
 				       IB_ACCESS_LOCAL_WRITE,
 				       PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_unlock();
 
 	if (status != IB_WC_SUCCESS) {
 		send_wqe->processing.status = status;
@@ -2029,14 +2838,19 @@ receive_RDMA_READ_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp,
 	}
 
 	/* ACK が受理できれば local_ack_time は延長可能 */
-	send_wqe->processing.local_ack_time = jiffies + qp->local_ack_timeout;
+	send_wqe->processing.local_ack_time = pib_sched_now() + qp->local_ack_timeout;
 
 	send_wqe->processing.sent_packets++;
 	send_wqe->processing.ack_packets++;
 
-	/* RDMA READ ACK に対して定期的に CNP を送信する */
+	/*
+	 *  RDMA READ ACK に対して定期的に CNP を送信する。
+	 *  ここは受信を行う kthread で動いているので、send_buffer を使っている
+	 *  かもしれない QP を担当する kthread に送信を任せる。
+	 */
 	if ((PIB_MAX_CONTIG_READ_ACKS / 3) < ++qp->requester.nr_contig_read_acks) {
-		process_cnp_notify_request(dev, qp, send_wqe);
+		qp->requester.cnp_pending  = 1;
+		qp->requester.cnp_trace_id = send_wqe->trace_id;
 		qp->requester.nr_contig_read_acks = 0;
 	}
 
@@ -2083,7 +2897,6 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 	struct pib_pd *pd;
 	enum ib_wc_status status;
 	u64 res;
-	unsigned long flags;
 
 	if (size !=  sizeof(*atomicacketh))
 		/* @todo これはエラーにとらないでいいか？ */
@@ -2112,12 +2925,12 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
-	status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+	rcu_read_lock();
+	status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge, NULL,
 				       (void*)&res, 0, sizeof(res),
 				       IB_ACCESS_LOCAL_WRITE,
 				       PIB_MR_COPY_TO);
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_unlock();
 
 	if (status != IB_WC_SUCCESS) {
 		send_wqe->processing.status = status;
@@ -2157,63 +2970,55 @@ receive_Atomic_response(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, u32
 /* Congestion Notification Packet                                             */
 /******************************************************************************/
 
+/*
+ *  受信側が要求した CNP を送信する。QP を担当する kthread から呼ぶこと。
+ *  パケットを組み立てた場合は 1 を返す。
+ */
+int pib_generate_rc_qp_cnp(struct pib_dev *dev, struct pib_qp *qp)
+{
+	if (!qp->requester.cnp_pending)
+		return 0;
+
+	qp->requester.cnp_pending = 0;
+
+	if (!pib_is_recv_ok(qp->state))
+		return 0;
+
+	process_cnp_notify_request(dev, qp);
+
+	return 1;
+}
+
+
 static void
-process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe)
+process_cnp_notify_request(struct pib_dev *dev, struct pib_qp *qp)
 {
 	void *buffer;
 	u8 port_num;
-	struct ib_ah_attr ah_attr;
 	u16 slid, dlid;
 	struct pib_packet_lrh *lrh;
 	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
-	u32 lnh;
-	u32 psn;
 
 	port_num = qp->ib_qp_attr.port_num;
-	ah_attr  = qp->ib_qp_attr.ah_attr;
-
-	buffer = dev->thread.send_buffer;
 
 	slid = dev->ports[port_num - 1].ib_port_attr.lid;
-	dlid = ah_attr.dlid;
-
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth));
+	dlid = qp->ib_qp_attr.ah_attr.dlid;
 
 	/* write IB Packet Header (LRH, GRH, BTH) */
-	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
+	buffer = copy_header_template(dev, qp, &lrh, &grh, &bth);
 
-	lrh->sl_rsv_lnh = (ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(dlid);
-	lrh->slid   = cpu_to_be16(slid);
-
-	pib_packet_lrh_set_pktlen(lrh, (buffer - dev->thread.send_buffer + 4) / 4); /* add ICRC size */
-
-	psn = send_wqe->processing.based_psn + send_wqe->processing.sent_packets;
+	pib_packet_lrh_set_pktlen(lrh, (buffer - qp->thread->send_buffer + 4) / 4); /* add ICRC size */
 
 	bth->OpCode = PIB_OPCODE_CNP_SEND_NOTIFY;
-	bth->pkey   = dev->ports[port_num - 1].pkey_table[qp->ib_qp_attr.pkey_index];
-	bth->destQP = cpu_to_be32(qp->ib_qp_attr.dest_qp_num);
 	bth->psn    = cpu_to_be32(qp->responder.psn & PIB_PSN_MASK); /* A-bit is 0 */
 
-	dev->thread.port_num	= port_num;
-	dev->thread.slid	= slid;
-	dev->thread.dlid	= dlid;
-	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.trace_id    = send_wqe->trace_id;
-	dev->thread.ready_to_send = 1;
+	qp->thread->port_num	= port_num;
+	qp->thread->slid	= slid;
+	qp->thread->dlid	= dlid;
+	qp->thread->src_qp_num	= qp->ib_qp.qp_num;
+	qp->thread->trace_id    = qp->requester.cnp_trace_id;
+	qp->thread->ready_to_send = 1;
 }
 
 
@@ -2240,6 +3045,12 @@ receive_cnp_notify(struct pib_dev *dev, u8 port_num, struct pib_qp *qp, struct p
 static void
 insert_async_qp_error(struct pib_dev *dev, struct pib_qp *qp, enum ib_event_type event)
 {
+	/* UC の responder はメッセージを捨てるだけで QP をエラーにしない */
+	if (qp->qp_type == IB_QPT_UC) {
+		abort_uc_message(qp);
+		return;
+	}
+
 	pib_util_insert_async_qp_error(qp, event);
 
 	abort_active_rwqe(dev, qp);
@@ -2249,6 +3060,18 @@ insert_async_qp_error(struct pib_dev *dev, struct pib_qp *qp, enum ib_event_type
 }
 
 
+/*
+ *  UC で受信中のメッセージを捨てる。
+ *  途中まで書き込んだ Receive WQE は消費せず、次のメッセージで使い直す。
+ */
+static void
+abort_uc_message(struct pib_qp *qp)
+{
+	qp->responder.offset      = 0;
+	qp->responder.last_OpCode = IB_OPCODE_RC_SEND_ONLY; /* dummy opcode */
+}
+
+
 /*
  *  Abort active receive WQE is completed in error
  */
@@ -2315,6 +3138,24 @@ issue_comm_est(struct pib_qp *qp)
 }
 
 
+/*
+ *  adaptive_rto が有効で RTT を測定済みなら RTO を使う。
+ *  ただし QP 属性の timeout から求めた値を上限とする。
+ */
+static unsigned long
+get_local_ack_timeout(const struct pib_qp *qp)
+{
+	unsigned long rto;
+
+	if (!pib_adaptive_rto || !qp->requester.rto)
+		return qp->local_ack_timeout;
+
+	rto = pib_get_rto_time(qp->requester.rto);
+
+	return min(rto, qp->local_ack_timeout);
+}
+
+
 /**
  *  受信が成功した場合には waiting list に入っている SWQE の local ack timeout
  *  を延期する
@@ -2325,7 +3166,7 @@ postpone_local_ack_timeout(struct pib_qp *qp)
 	unsigned long local_ack_timeout;
 	struct pib_send_wqe *send_wqe;
 
-	local_ack_timeout = jiffies + qp->local_ack_timeout;
+	local_ack_timeout = pib_sched_now() + get_local_ack_timeout(qp);
 
 	list_for_each_entry(send_wqe, &qp->requester.waiting_swqe_head, list) {
 		send_wqe->processing.retry_cnt = qp->ib_qp_attr.retry_cnt;
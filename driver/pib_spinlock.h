@@ -64,6 +64,19 @@ do {							\
 	}						\
 } while (0)
 
+#define pib_spin_trylock(lockp)				\
+({							\
+	int __ret = 1;					\
+	if ((lockp)->owner != current) {		\
+		__ret = spin_trylock(&(lockp)->lock);	\
+		if (__ret)				\
+			(lockp)->owner = current;	\
+	}						\
+	if (__ret)					\
+		(lockp)->depth++;			\
+	__ret;						\
+})
+
 static inline int pib_spin_is_locked(pib_spinlock_t *lockp)
 {
 	return spin_is_locked(&lockp->lock);
@@ -289,6 +289,7 @@ next_wr:
 
 	recv_wqe->wr_id   = ibwr->wr_id;
 	recv_wqe->num_sge = ibwr->num_sge;
+	memset(&recv_wqe->cursor, 0, sizeof(recv_wqe->cursor));
 
 	for (i=0 ; i<ibwr->num_sge ; i++) {
 		recv_wqe->sge_array[i] = ibwr->sg_list[i];
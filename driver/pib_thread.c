@@ -10,6 +10,7 @@
 #include <linux/version.h>
 #include <linux/bitmap.h>
 #include <linux/timer.h>
+#include <linux/hrtimer.h>
 #include <linux/slab.h>
 #include <linux/vmalloc.h>
 #include <linux/errno.h>
@@ -19,7 +20,14 @@
 #include <linux/if_vlan.h>
 #include <linux/random.h>
 #include <linux/kthread.h>
+#include <linux/sched.h> /* for local_clock() */
 #include <net/sock.h> /* for struct sock */
+#ifdef PIB_SOCKET_BUSY_POLL_SUPPORT
+#include <net/busy_poll.h>
+#endif
+#ifdef PIB_UDP_GSO_SUPPORT
+#include <linux/udp.h> /* for UDP_SEGMENT */
+#endif
 #include <rdma/ib_user_verbs.h>
 #include <rdma/ib_pack.h>
 
@@ -30,21 +38,38 @@
 
 
 static int kthread_routine(void *data);
-static void kthread_routine_iteration(struct pib_dev *dev);
+static void kthread_routine_iteration(struct pib_thread *thread);
+static bool busy_poll_thread(struct pib_thread *thread);
 static int create_socket(struct pib_dev *dev, u8 port_num);
 static void release_socket(struct pib_dev *dev, u8 port_num);
-static void process_on_qp_scheduler(struct pib_dev *dev);
+static bool is_burstable_request(const struct pib_qp *qp, enum ib_wr_opcode opcode);
+static void process_on_qp_scheduler(struct pib_thread *thread);
+static void process_doorbell(struct pib_thread *thread);
 static int process_new_send_wr(struct pib_qp *qp);
 static int process_send_wr(struct pib_dev *dev, struct pib_qp *qp, struct pib_send_wqe *send_wqe);
-static int receive_packet(struct pib_dev *dev, u8 port_num);
-static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buffer, int packet_size);
+static int receive_packets(struct pib_thread *thread, u8 port_num);
+static int receive_packet_zcopy(struct pib_thread *thread, u8 port_num, struct pib_recv_desc *ring, int count);
+static u32 get_dest_qp_num(void *buffer, int size);
+static bool is_same_zcopy(const struct pib_zcopy *a, const struct pib_zcopy *b);
+static void process_incoming_messages(struct pib_thread *thread, u8 port_num, struct pib_recv_desc *ring, int count);
+static int receive_loopback_packets(struct pib_thread *thread);
+static bool send_loopback_packet(struct pib_thread *thread, struct pib_port *port, u16 dlid, size_t msg_size);
+static int enqueue_loopback_packet(struct pib_dev *dest, u8 port_num, struct pib_thread *thread, size_t msg_size);
+static void parse_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_recv_desc *desc);
+static void process_multicast_message(struct pib_dev *dev, u8 port_num, struct pib_recv_desc *desc);
 static void process_incoming_message_per_qp(struct pib_dev *dev, u8 port_num, u16 dlid, u32 dest_qp_num, struct pib_packet_lrh *lrh, struct ib_grh *grh, struct pib_packet_bth *bth, void *buffer, int size);
 static void connect_pibnetd(struct pib_dev *dev, u8 port_num);
 static void disconnect_pibnetd(struct pib_dev *dev, u8 port_num);
 static void send_raw_packet_to_pibnetd(struct pib_dev *dev, u8 port_num, bool disconnect);
 static void process_raw_packet(struct pib_dev *dev, u8 port_num, struct pib_packet_lrh *lrh, void *buffer, int size);
 static void process_on_wq_scheduler(struct pib_dev *dev);
-static void process_sendmsg(struct pib_dev *dev);
+static void process_sendmsg(struct pib_thread *thread);
+static void flush_sendmsg(struct pib_thread *thread);
+static void send_packets(struct pib_thread *thread, struct pib_send_desc *desc, int count);
+static void unlink_scheduling_qp(struct pib_qp *qp);
+static void insert_qp_into_wheel(struct pib_thread *thread, struct pib_qp *qp);
+static void expire_wheel(struct pib_thread *thread, unsigned long now);
+static void update_wakeup_time(struct pib_thread *thread, unsigned long now);
 static struct sockaddr *get_sockaddr_from_dlid(struct pib_dev *dev, u8 port_num, u32 src_qp_num, u16 dlid);
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(3, 15, 0)
 static void sock_data_ready_callback(struct sock *sk);
@@ -52,6 +77,7 @@ static void sock_data_ready_callback(struct sock *sk);
 static void sock_data_ready_callback(struct sock *sk, int bytes);
 #endif
 static void timer_timeout_callback(unsigned long opaque);
+static enum hrtimer_restart hrtimer_timeout_callback(struct hrtimer *hrtimer);
 static void delayed_work_timeout_callback(unsigned long data);
 
 
@@ -67,62 +93,156 @@ static int pib_nice = PIB_DEFAULT_NICE;
 module_param_named(nice, pib_nice, int, 0644);
 MODULE_PARM_DESC(nice, "kthread priority (from -19 to 20)");
 
+/* direct loopback を受け付ける HCA。参照は RCU */
+static struct pib_dev *loopback_devs[PIB_MAX_HCA];
+
+static int num_kthreads = 1;
+module_param_named(num_kthreads, num_kthreads, int, S_IRUGO);
+MODULE_PARM_DESC(num_kthreads, "Number of kthreads per HCA to send packets (from 1 to 64, receiving is done by one)");
+
 
 int pib_create_kthread(struct pib_dev *dev)
 {
 	int i, j, ret;
 	struct task_struct *task;
+	struct pib_thread *thread;
+
+	dev->nr_thread = num_kthreads;
+	if (dev->nr_thread < 1)
+		dev->nr_thread = 1;
+	else if (PIB_MAX_KTHREAD < dev->nr_thread)
+		dev->nr_thread = PIB_MAX_KTHREAD;
+
+	dev->threads = vzalloc(sizeof(struct pib_thread) * dev->nr_thread);
+	if (!dev->threads)
+		return -ENOMEM;
+
+	for (i=0 ; i < dev->nr_thread ; i++) {
+		thread = &dev->threads[i];
+
+		thread->dev   = dev;
+		thread->index = i;
+
+		init_completion(&thread->completion);
+		init_timer(&thread->timer);
+
+		thread->timer.function	= timer_timeout_callback;
+		thread->timer.data	= (unsigned long)thread;
+
+		hrtimer_init(&thread->hrtimer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+		thread->hrtimer.function = hrtimer_timeout_callback;
+
+		spin_lock_init(&thread->qp_sched.lock);
+		thread->qp_sched.wakeup_time = pib_sched_now();
+		thread->qp_sched.wheel_base  = thread->qp_sched.wakeup_time;
+		INIT_LIST_HEAD(&thread->qp_sched.ready_head);
+		init_llist_head(&thread->doorbell_head);
+		spin_lock_init(&thread->doorbell_lock);
+		for (j=0 ; j < PIB_SCHED_WHEEL_LEVELS ; j++) {
+			int k;
+			for (k=0 ; k < PIB_SCHED_WHEEL_SIZE ; k++)
+				INIT_LIST_HEAD(&thread->qp_sched.wheel[j][k]);
+		}
+
+		thread->send_ring_buffer = vmalloc(PIB_PACKET_BUFFER * PIB_SEND_BATCH);
+		if (!thread->send_ring_buffer) {
+			ret = -ENOMEM;
+			goto err_vmalloc;
+		}
 
-	init_completion(&dev->thread.completion);
-	init_timer(&dev->thread.timer);
+		for (j=0 ; j < PIB_SEND_BATCH ; j++)
+			thread->send_ring[j].buffer = thread->send_ring_buffer + PIB_PACKET_BUFFER * j;
 
-	dev->thread.timer.function = timer_timeout_callback;
-	dev->thread.timer.data     = (unsigned long)dev;
+		thread->send_buffer = thread->send_ring_buffer;
+		thread->nr_send     = 0;
 
-	dev->thread.send_buffer	   = vmalloc(PIB_PACKET_BUFFER);
-	if (!dev->thread.send_buffer) {
-		ret = -ENOMEM;
-		goto err_send_vmalloc;
+		/* 受信リングはソケットから受信する最初の kthread だけが持つ */
+		if (i == 0) {
+			int k;
+
+			thread->recv_buffer = vmalloc(PIB_PACKET_BUFFER * PIB_RECV_BATCH);
+			if (!thread->recv_buffer) {
+				ret = -ENOMEM;
+				goto err_vmalloc;
+			}
+
+			for (k=0 ; k < PIB_RECV_BATCH ; k++)
+				thread->recv_ring[k].buffer = thread->recv_buffer + PIB_PACKET_BUFFER * k;
+		}
 	}
 
-	dev->thread.recv_buffer	   = vmalloc(PIB_PACKET_BUFFER);
-	if (!dev->thread.recv_buffer) {
+	dev->loopback.buffer = vmalloc(PIB_PACKET_BUFFER * PIB_LOOPBACK_RING_SIZE);
+	dev->loopback.slots  = vzalloc(sizeof(struct pib_loopback_slot) * PIB_LOOPBACK_RING_SIZE);
+	if (!dev->loopback.buffer || !dev->loopback.slots) {
 		ret = -ENOMEM;
-		goto err_recv_vmalloc;
+		goto err_vmalloc;
 	}
 
+	for (j=0 ; j < PIB_LOOPBACK_RING_SIZE ; j++) {
+		dev->loopback.slots[j].seq    = j;
+		dev->loopback.slots[j].buffer = dev->loopback.buffer + PIB_PACKET_BUFFER * j;
+	}
+
+	atomic_set(&dev->loopback.enqueue_pos, 0);
+	dev->loopback.dequeue_pos = 0;
+
 	for (i=0 ; i < dev->ib_dev.phys_port_cnt ; i++) {
 		ret = create_socket(dev, i + 1);
 		if (ret < 0)
 			goto err_sock;
 	}
 
-	task = kthread_create(kthread_routine, dev, "pib_%d", dev->dev_id);
-	if (IS_ERR(task))
-		goto err_task;
+	pib_set_busy_poll(dev, dev->busy_poll);
+
+	for (i=0 ; i < dev->nr_thread ; i++) {
+		thread = &dev->threads[i];
 
-	dev->thread.task = task;
+		if (i == 0)
+			task = kthread_create(kthread_routine, thread, "pib_%d", dev->dev_id);
+		else
+			task = kthread_create(kthread_routine, thread, "pib_%d_%d", dev->dev_id, i);
+
+		if (IS_ERR(task)) {
+			ret = PTR_ERR(task);
+			goto err_task;
+		}
+
+		thread->task = task;
+	}
+
+	for (i=0 ; i < dev->nr_thread ; i++)
+		wake_up_process(dev->threads[i].task);
 
-	wake_up_process(task);
+	rcu_assign_pointer(loopback_devs[dev->dev_id], dev);
 
 	return 0;
 
 err_task:
-	ret = PTR_ERR(task);
+	for (j = i-1 ; 0 <= j ; j--) {
+		kthread_stop(dev->threads[j].task);
+		dev->threads[j].task = NULL;
+	}
+
+	i = dev->ib_dev.phys_port_cnt;
 	
 err_sock:
 	for (j = i-1 ; 0 <= j ; j--)
 		release_socket(dev, j + 1);
 
-	vfree(dev->thread.recv_buffer);
-	dev->thread.recv_buffer = NULL;
+err_vmalloc:
+	vfree(dev->loopback.slots);
+	dev->loopback.slots = NULL;
 
-err_recv_vmalloc:
+	vfree(dev->loopback.buffer);
+	dev->loopback.buffer = NULL;
 
-	vfree(dev->thread.send_buffer);
-	dev->thread.send_buffer = NULL;
+	for (i=0 ; i < dev->nr_thread ; i++) {
+		vfree(dev->threads[i].recv_buffer);
+		vfree(dev->threads[i].send_ring_buffer);
+	}
 
-err_send_vmalloc:
+	vfree(dev->threads);
+	dev->threads = NULL;
 
 	return ret;
 }
@@ -131,27 +251,63 @@ err_send_vmalloc:
 void pib_release_kthread(struct pib_dev *dev)
 {
 	int i;
+	unsigned long flags;
+	struct pib_thread *thread;
 
-	smp_wmb();
+	/* 他の HCA からの direct loopback を止める */
+	if (!pib_multi_host_mode) {
+		spin_lock_irqsave(&dev->lock, flags);
+		for (i=0 ; i < dev->ib_dev.phys_port_cnt ; i++) {
+			u16 lid = dev->ports[i].ib_port_attr.lid;
+			if ((lid != 0) && (rcu_access_pointer(pib_lid_dev_table[lid]) == dev))
+				RCU_INIT_POINTER(pib_lid_dev_table[lid], NULL);
+		}
+		spin_unlock_irqrestore(&dev->lock, flags);
+	}
 
-	del_timer_sync(&dev->thread.timer);
+	RCU_INIT_POINTER(loopback_devs[dev->dev_id], NULL);
 
-	if (dev->thread.task) {
-		set_bit(PIB_THREAD_STOP, &dev->thread.flags);
-		complete(&dev->thread.completion);
-		/* flush_kthread_worker(worker); */
-		kthread_stop(dev->thread.task);
-		dev->thread.task = NULL;
+	/* loopback ring に書き込み中の他の HCA の kthread を待ってから解放する */
+	synchronize_rcu();
+
+	for (i=dev->nr_thread - 1 ; 0 <= i ; i--) {
+		thread = &dev->threads[i];
+
+		del_timer_sync(&thread->timer);
+
+		if (thread->task) {
+			set_bit(PIB_THREAD_STOP, &thread->flags);
+			complete(&thread->completion);
+			/* flush_kthread_worker(worker); */
+			kthread_stop(thread->task);
+			thread->task = NULL;
+		}
+
+		hrtimer_cancel(&thread->hrtimer);
 	}
 
 	for (i=dev->ib_dev.phys_port_cnt - 1 ; 0 <= i  ; i--)
 		release_socket(dev, i + 1);
 
-	vfree(dev->thread.recv_buffer);
-	dev->thread.recv_buffer = NULL;
+	vfree(dev->loopback.slots);
+	dev->loopback.slots = NULL;
+
+	vfree(dev->loopback.buffer);
+	dev->loopback.buffer = NULL;
+
+	for (i=0 ; i < dev->nr_thread ; i++) {
+		thread = &dev->threads[i];
+
+		vfree(thread->recv_buffer);
+		thread->recv_buffer = NULL;
 
-	vfree(dev->thread.send_buffer);
-	dev->thread.send_buffer = NULL;
+		vfree(thread->send_ring_buffer);
+		thread->send_ring_buffer = NULL;
+		thread->send_buffer      = NULL;
+	}
+
+	vfree(dev->threads);
+	dev->threads = NULL;
 }
 
 
@@ -226,6 +382,33 @@ err_sock:
 }
 
 
+/*
+ *  kthread の busy-poll 時間を変更する。
+ *  ソケットの busy polling (SO_BUSY_POLL 相当) も同じ時間に設定する。
+ */
+void pib_set_busy_poll(struct pib_dev *dev, unsigned int usec)
+{
+#ifdef PIB_SOCKET_BUSY_POLL_SUPPORT
+	u8 i;
+#endif
+
+	dev->busy_poll = usec;
+
+#ifdef PIB_SOCKET_BUSY_POLL_SUPPORT
+	for (i=0 ; i < dev->ib_dev.phys_port_cnt ; i++) {
+		struct socket *socket = dev->ports[i].socket;
+
+		if (!socket)
+			continue;
+
+		lock_sock(socket->sk);
+		socket->sk->sk_ll_usec = usec;
+		release_sock(socket->sk);
+	}
+#endif
+}
+
+
 static void release_socket(struct pib_dev *dev, u8 port_num)
 {
 	if (dev->ports[port_num - 1].sockaddr) {
@@ -243,12 +426,15 @@ static void release_socket(struct pib_dev *dev, u8 port_num)
 static int kthread_routine(void *data)
 {
 	int nice = INT_MIN;
+	struct pib_thread *thread;
 	struct pib_dev *dev;
 	u8 i, phys_port_cnt;
 
-	dev = (struct pib_dev *)data;
+	thread = (struct pib_thread *)data;
 
-	BUG_ON(!dev);
+	BUG_ON(!thread);
+
+	dev = thread->dev;
 
 	phys_port_cnt = dev->ib_dev.phys_port_cnt;
 
@@ -257,17 +443,20 @@ static int kthread_routine(void *data)
 	current->flags |= PF_NOFREEZE;
 #endif
 
-	if (pib_multi_host_mode)
-		for (i=0 ; i < phys_port_cnt ; i++)
-			connect_pibnetd(dev, i + 1);
-	else
-		for (i=0 ; i < phys_port_cnt ; i++)
-			pib_easy_sw.ports[1 + phys_port_cnt * dev->dev_id + i].to_udp_port
-				= ((const struct sockaddr_in*)dev->ports[i].sockaddr)->sin_port;
+	/* The first kthread is in charge of the connections with the switch */
+	if (thread->index == 0) {
+		if (pib_multi_host_mode)
+			for (i=0 ; i < phys_port_cnt ; i++)
+				connect_pibnetd(dev, i + 1);
+		else
+			for (i=0 ; i < phys_port_cnt ; i++)
+				pib_easy_sw.ports[1 + phys_port_cnt * dev->dev_id + i].to_udp_port
+					= ((const struct sockaddr_in*)dev->ports[i].sockaddr)->sin_port;
+	}
 
 	while (!kthread_should_stop()) {
 		unsigned long flags;
-		unsigned long timeout = HZ;
+		unsigned long now, timeout = HZ;
 
 		/* nice の設定に変更があった場合 */
 		if (nice != pib_nice) {
@@ -280,95 +469,275 @@ static int kthread_routine(void *data)
 			}
 		}
 
+		/* busy-poll 中に起床要因を見つけたら sleep しない */
+		if (dev->busy_poll && busy_poll_thread(thread))
+			goto woken;
+
 		/* 停止時間を計算。ただし1 秒以上は停止させない */
-		spin_lock_irqsave(&dev->qp_sched.lock, flags);
-		if (time_after(dev->qp_sched.wakeup_time, jiffies))
-			timeout = dev->qp_sched.wakeup_time - jiffies;
-		else
-			dev->qp_sched.wakeup_time = jiffies;
-		if (HZ < timeout)
-			timeout = HZ;
-		spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+		spin_lock_irqsave(&thread->qp_sched.lock, flags);
+		now = pib_sched_now();
+		if (pib_hr_sched) {
+			/* hrtimer で起床し、completion 待ちの timeout は 1 秒のまま */
+			if (time_after(thread->qp_sched.wakeup_time, now)) {
+				unsigned long usec = thread->qp_sched.wakeup_time - now;
+				if (USEC_PER_SEC < usec)
+					usec = USEC_PER_SEC;
+				hrtimer_start(&thread->hrtimer, ns_to_ktime((u64)usec * NSEC_PER_USEC),
+					      HRTIMER_MODE_REL);
+			} else
+				thread->qp_sched.wakeup_time = now;
+		} else {
+			if (time_after(thread->qp_sched.wakeup_time, now))
+				timeout = thread->qp_sched.wakeup_time - now;
+			else
+				thread->qp_sched.wakeup_time = now;
+			if (HZ < timeout)
+				timeout = HZ;
+		}
+		spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
 
-		wait_for_completion_interruptible_timeout(&dev->thread.completion, timeout);
+		wait_for_completion_interruptible_timeout(&thread->completion, timeout);
+woken:
 #if LINUX_VERSION_CODE < KERNEL_VERSION(3,13,0)
-		INIT_COMPLETION(dev->thread.completion);
+		INIT_COMPLETION(thread->completion);
 #else
-		reinit_completion(&dev->thread.completion);
+		reinit_completion(&thread->completion);
 #endif
 
-		while (dev->thread.flags) {
+		while (thread->flags) {
 			cond_resched();
-			kthread_routine_iteration(dev);
+			kthread_routine_iteration(thread);
 		}
 
-		process_on_qp_scheduler(dev);
+		process_on_qp_scheduler(thread);
 	}
 
-	if (pib_multi_host_mode)
-		for (i=0 ; i < phys_port_cnt ; i++)
-			disconnect_pibnetd(dev, i + 1);
-	else
-		for (i=0 ; i < phys_port_cnt ; i++)
-			pib_easy_sw.ports[1 + phys_port_cnt * dev->dev_id + i].to_udp_port
-				= 0;
+	if (thread->index == 0) {
+		if (pib_multi_host_mode)
+			for (i=0 ; i < phys_port_cnt ; i++)
+				disconnect_pibnetd(dev, i + 1);
+		else
+			for (i=0 ; i < phys_port_cnt ; i++)
+				pib_easy_sw.ports[1 + phys_port_cnt * dev->dev_id + i].to_udp_port
+					= 0;
+	}
 
 	return 0;
 }
 
 
-static void kthread_routine_iteration(struct pib_dev *dev)
+/*
+ *  sleep する前に dev->busy_poll マイクロ秒まで spin して起床要因を待つ。
+ *  起床要因を見つけた場合は true を返す。
+ */
+static bool busy_poll_thread(struct pib_thread *thread)
+{
+	struct pib_dev *dev = thread->dev;
+	u64 end;
+#ifdef PIB_SOCKET_BUSY_POLL_SUPPORT
+	u8 i;
+#endif
+
+	end = local_clock() + (u64)dev->busy_poll * NSEC_PER_USEC;
+
+	do {
+		if (thread->flags)
+			return true;
+
+		if (!list_empty(&thread->qp_sched.ready_head) ||
+		    time_before_eq(thread->qp_sched.wakeup_time, pib_sched_now()))
+			return true;
+
+		if (kthread_should_stop() || need_resched())
+			return false;
+
+#ifdef PIB_SOCKET_BUSY_POLL_SUPPORT
+		/* 受信担当の kthread はデバイスドライバのキューを直接 poll する */
+		if (thread->index == 0)
+			for (i=0 ; i < dev->ib_dev.phys_port_cnt ; i++) {
+				struct sock *sk = dev->ports[i].socket->sk;
+				if (sk_can_busy_loop(sk))
+					sk_busy_loop(sk, 1);
+			}
+#endif
+
+		cpu_relax();
+	} while (local_clock() < end);
+
+	return false;
+}
+
+
+static void kthread_routine_iteration(struct pib_thread *thread)
 {
-	if (test_and_clear_bit(PIB_THREAD_STOP, &dev->thread.flags))
+	struct pib_dev *dev = thread->dev;
+
+	if (test_and_clear_bit(PIB_THREAD_STOP, &thread->flags))
 		return;
 
-	if (test_and_clear_bit(PIB_THREAD_WQ_SCHEDULE, &dev->thread.flags)) {
+	if (test_and_clear_bit(PIB_THREAD_WQ_SCHEDULE, &thread->flags)) {
 		process_on_wq_scheduler(dev);
 		return;
 	}
 
-	if (test_and_clear_bit(PIB_THREAD_READY_TO_RECV, &dev->thread.flags)) {
-		int i;
+	if (test_and_clear_bit(PIB_THREAD_READY_TO_RECV, &thread->flags)) {
+		int i, count;
 		for (i=0 ; i < dev->ib_dev.phys_port_cnt ; i++) {
-			while (0 < receive_packet(dev, i + 1)) {
-				process_incoming_message(dev, i + 1,
-							 dev->thread.recv_buffer,
-							 dev->thread.recv_size);
-			}
+			do {
+				count = receive_packets(thread, i + 1);
+				if (0 < count)
+					process_incoming_messages(thread, i + 1, thread->recv_ring, count);
+			} while (0 < count);
 		}
+
+		while (0 < receive_loopback_packets(thread))
+			;
 		return;
 	}
 
-	if (test_and_clear_bit(PIB_THREAD_QP_SCHEDULE, &dev->thread.flags)) {
-		process_on_qp_scheduler(dev);
+	if (test_and_clear_bit(PIB_THREAD_DOORBELL, &thread->flags)) {
+		process_doorbell(thread);
+		return;
+	}
+
+	if (test_and_clear_bit(PIB_THREAD_QP_SCHEDULE, &thread->flags)) {
+		process_on_qp_scheduler(thread);
+		return;
+	}
+}
+
+
+/*
+ *  pib_post_send から呼ばれ、QP のロックを取らずに担当 kthread を起こす。
+ *  同じ QP は処理されるまで doorbell_head に一度だけ積まれる。
+ */
+void pib_util_ring_doorbell(struct pib_qp *qp)
+{
+	struct pib_thread *thread = qp->thread;
+
+	if (test_and_set_bit(0, &qp->requester.doorbell))
 		return;
+
+	llist_add(&qp->requester.doorbell_node, &thread->doorbell_head);
+
+	if (!test_and_set_bit(PIB_THREAD_DOORBELL, &thread->flags))
+		complete(&thread->completion);
+}
+
+
+/*
+ *  doorbell_head から取り出した QP は処理し終えるまで doorbell_lock で守る。
+ *  pib_util_cancel_doorbell() は同じロックの下で QP を外す。
+ */
+static void process_doorbell(struct pib_thread *thread)
+{
+	struct llist_node *node;
+	struct pib_qp *qp;
+	unsigned long flags;
+
+	spin_lock_irqsave(&thread->doorbell_lock, flags);
+
+	node = llist_del_all(&thread->doorbell_head);
+
+	while (node) {
+		qp   = llist_entry(node, struct pib_qp, requester.doorbell_node);
+		/* doorbell をクリアすると再び積まれうるので先に next を読む */
+		node = llist_next(node);
+
+		pib_spin_lock(&qp->lock);
+
+		test_and_clear_bit(0, &qp->requester.doorbell);
+
+		qp->requester.nr_contig_read_acks = 0;
+		qp->responder.nr_contig_read_acks = 0;
+
+		/* posted_swqe_head の回収もここで行われる */
+		pib_util_reschedule_qp(qp);
+
+		pib_spin_unlock(&qp->lock);
+	}
+
+	spin_unlock_irqrestore(&thread->doorbell_lock, flags);
+}
+
+
+/*
+ *  破棄する QP を doorbell_head から外す。
+ *  llist は途中の要素を外せないので、一度すべて取り出して他の QP を積み直す。
+ */
+void pib_util_cancel_doorbell(struct pib_qp *qp)
+{
+	struct pib_thread *thread = qp->thread;
+	struct llist_node *node, *next;
+	unsigned long flags;
+
+	spin_lock_irqsave(&thread->doorbell_lock, flags);
+
+	if (test_bit(0, &qp->requester.doorbell)) {
+		node = llist_del_all(&thread->doorbell_head);
+
+		while (node) {
+			next = llist_next(node);
+			if (node != &qp->requester.doorbell_node)
+				llist_add(node, &thread->doorbell_head);
+			node = next;
+		}
+
+		clear_bit(0, &qp->requester.doorbell);
+	}
+
+	spin_unlock_irqrestore(&thread->doorbell_lock, flags);
+}
+
+
+static bool is_burstable_request(const struct pib_qp *qp, enum ib_wr_opcode opcode)
+{
+	if ((qp->qp_type != IB_QPT_RC) && (qp->qp_type != IB_QPT_UC))
+		return false;
+
+	switch (opcode) {
+	case IB_WR_SEND:
+	case IB_WR_SEND_WITH_IMM:
+	case IB_WR_SEND_WITH_INV:
+	case IB_WR_RDMA_WRITE:
+	case IB_WR_RDMA_WRITE_WITH_IMM:
+		return true;
+	default:
+		return false;
 	}
 }
 
 
-static void process_on_qp_scheduler(struct pib_dev *dev)
+static void process_on_qp_scheduler(struct pib_thread *thread)
 {
 	int ret;
 	unsigned long now;
 	unsigned long flags;
+	struct pib_dev *dev = thread->dev;
 	struct pib_qp *qp;
-	struct pib_send_wqe *send_wqe, *next_send_wqe;
+	struct pib_send_wqe *send_wqe;
+	enum ib_wr_opcode opcode;
 
 restart:
-	now = jiffies;
+	now = pib_sched_now();
 
 	spin_lock_irqsave(&dev->lock, flags);
 
-	qp = pib_util_get_first_scheduling_qp(dev);
+	qp = pib_util_get_first_scheduling_qp(thread);
 	if (!qp) {
 		spin_unlock_irqrestore(&dev->lock, flags);
-		return;
+		goto flush;
 	}
 
 	/* @notice ロックの入れ子関係を一部崩している */
 	pib_spin_lock(&qp->lock);
 	spin_unlock(&dev->lock);
 
+	/* Requester: CNP requested by the receiving kthread */
+	if (qp->qp_type == IB_QPT_RC)
+		if (pib_generate_rc_qp_cnp(dev, qp) == 1)
+			goto done;
+
 	/* Responder: generating acknowledge packets */
 	if (qp->qp_type == IB_QPT_RC)
 		if (pib_generate_rc_qp_acknowledge(dev, qp) == 1)
@@ -407,6 +776,11 @@ restart:
 				qp->state = IB_QPS_ERR;
 				pib_util_flush_qp(qp, 0);
 				break;
+
+			case IB_QPT_UC:
+				qp->state = IB_QPS_SQE;
+				pib_util_flush_qp(qp, 1);
+				break;
 				
 			default:
 				pr_emerg("pib: Error qp_type=%s in %s at %s:%u\n",
@@ -430,26 +804,19 @@ restart:
 	if (time_after(send_wqe->processing.local_ack_time, now))
 		goto first_sending_wsqe;
 
-	pib_trace_retry(dev, qp->ib_qp_attr.port_num, send_wqe);
+	pib_trace_retry(dev, qp->ib_qp_attr.port_num, qp, send_wqe);
 
 	send_wqe->processing.retry_cnt--;
 	send_wqe->processing.local_ack_time = now + PIB_SCHED_TIMEOUT;
 
 	dev->perf.local_ack_timeout++;
 
-	/* waiting list から sending list へ戻す */
-	list_for_each_entry_safe_reverse(send_wqe, next_send_wqe, &qp->requester.waiting_swqe_head, list) {
-		send_wqe->processing.list_type = PIB_SWQE_SENDING;
-		list_del_init(&send_wqe->list);
-		list_add(&send_wqe->list, &qp->requester.sending_swqe_head);
-		qp->requester.nr_waiting_swqe--;
-		qp->requester.nr_sending_swqe++;
-	}
+	/* 測定した RTO で再送した場合は上限に達するまで倍に延ばす */
+	if (qp->requester.rto && (pib_get_rto_time(qp->requester.rto) < qp->local_ack_timeout))
+		qp->requester.rto *= 2;
 
-	/* 送信したパケット数をキャンセルする */
-	list_for_each_entry(send_wqe, &qp->requester.sending_swqe_head, list) {
-		send_wqe->processing.sent_packets = send_wqe->processing.ack_packets;
-	}
+	/* ACK を受けたパケットより後を再送する */
+	pib_rewind_rc_qp_request(qp, qp->requester.acked_psn);
 	    
 first_sending_wsqe:
 	if (list_empty(&qp->requester.sending_swqe_head)) {
@@ -471,9 +838,9 @@ first_sending_wsqe:
 			goto done;
 
 	/*
-	 *  SEND & RDMA WRITE が連続送信の制限に引掛る場合は、一時停止
+	 *  送信ウィンドウか相手のクレジットを使い切った場合は、ACK を受けるまで一時停止
 	 */
-	if (PIB_MAX_CONTIG_REQUESTS < qp->requester.nr_contig_requests)
+	if (pib_is_rc_qp_request_blocked(qp, send_wqe))
 		goto done;
 
 	/*
@@ -484,8 +851,20 @@ first_sending_wsqe:
 
 	send_wqe->processing.schedule_time = now;
 
+	opcode = send_wqe->opcode;
+
 	ret = process_send_wr(dev, qp, send_wqe);
-			
+
+	/*
+	 *  RC/UC の SEND と RDMA WRITE は send_burst 個のパケットまで
+	 *  他の QP に回さず続けて送る。送信ウィンドウやクレジットを使い切れば
+	 *  pib_util_reschedule_qp が ready list から外す。
+	 */
+	if (thread->ready_to_send && is_burstable_request(qp, opcode))
+		qp->sched.burst = ((++qp->sched.nr_burst_packets % max(pib_send_burst, 1U)) != 0);
+	else
+		qp->sched.nr_burst_packets = 0;
+
 	switch (send_wqe->processing.list_type) {
 
 	case PIB_SWQE_FREE:
@@ -515,22 +894,26 @@ done:
 
 	pib_spin_unlock_irqrestore(&qp->lock, flags);
 
-	if (dev->thread.ready_to_send)
-		process_sendmsg(dev);
+	if (thread->ready_to_send)
+		process_sendmsg(thread);
 
-	if (dev->thread.flags & ((1U << PIB_THREAD_QP_SCHEDULE) - 1))
-		return;
+	if (thread->flags & ((1U << PIB_THREAD_QP_SCHEDULE) - 1))
+		goto flush;
 
-	spin_lock_irqsave(&dev->qp_sched.lock, flags);
-	if (time_after(dev->qp_sched.wakeup_time, jiffies)) {
-		spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
-		return;
+	spin_lock_irqsave(&thread->qp_sched.lock, flags);
+	if (time_after(thread->qp_sched.wakeup_time, pib_sched_now())) {
+		spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
+		goto flush;
 	}
-	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+	spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
 
 	cond_resched();
 
 	goto restart;
+
+flush:
+	/* このターンで作成したパケットをまとめて送信する */
+	flush_sendmsg(thread);
 }
 
 
@@ -582,7 +965,7 @@ static int process_new_send_wr(struct pib_qp *qp)
 	/*
 	 *  Set expected PSN for SQ and etc.
 	 */
-	now = jiffies;
+	now = pib_sched_now();
 
 	num_packets = pib_get_num_of_packets(qp, send_wqe->total_length);
 
@@ -627,6 +1010,7 @@ static int process_send_wr(struct pib_dev *dev, struct pib_qp *qp, struct pib_se
 	switch (qp->qp_type) {
 
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 		return pib_process_rc_qp_request(dev, qp, send_wqe);
 
 	case IB_QPT_UD:
@@ -654,6 +1038,7 @@ completion_error:
 		pib_util_flush_qp(qp, 0);
 		break;
 
+	case IB_QPT_UC:
 	case IB_QPT_UD:
 	case IB_QPT_GSI:
 	case IB_QPT_SMI:
@@ -671,168 +1056,439 @@ completion_error:
 }
 
 
-static int receive_packet(struct pib_dev *dev, u8 port_num)
+/*
+ *  ソケットから最大 PIB_RECV_BATCH 個のパケットを受信リングに取り出す。
+ *  受信したパケット数を返す。
+ */
+static int receive_packets(struct pib_thread *thread, u8 port_num)
 {
-	int ret;
-	struct msghdr msghdr = {.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL};
-	struct kvec iov;
+	int ret, count;
+	struct pib_dev *dev = thread->dev;
 	struct pib_port *port;
 
-	iov.iov_base = dev->thread.recv_buffer;
-	iov.iov_len  = PIB_PACKET_BUFFER;
-
 	port = &dev->ports[port_num - 1];
 
-	ret = kernel_recvmsg(port->socket, &msghdr,
-			     &iov, 1, iov.iov_len, msghdr.msg_flags);
-
-	if (ret < 0) {
-		if (ret == -EINTR)
-			set_bit(PIB_THREAD_READY_TO_RECV, &dev->thread.flags);
-		return ret;
-	} else if (ret == 0)
-		return -EAGAIN;
+	for (count=0 ; count < PIB_RECV_BATCH ; count++) {
+		struct msghdr msghdr = {.msg_flags = MSG_DONTWAIT | MSG_NOSIGNAL};
+		struct kvec iov;
+		struct pib_recv_desc *desc = &thread->recv_ring[count];
 
-	dev->thread.recv_size = ret;
-	
-	return ret;
-}
+		desc->placed = false;
 
+		if (pib_zcopy_rx) {
+			ret = receive_packet_zcopy(thread, port_num, thread->recv_ring, count);
+			if (ret < 0) {
+				if (ret == -EINTR)
+					set_bit(PIB_THREAD_READY_TO_RECV, &thread->flags);
+				break;
+			} else if (0 < ret) {
+				desc->size = ret;
+				continue;
+			}
+		}
 
-static void process_incoming_message(struct pib_dev *dev, u8 port_num, void *buffer, int packet_size)
-{
-	int size, header_size;
-	struct pib_port *port;
-	struct pib_packet_lrh *lrh;
-	struct ib_grh         *grh;
-	struct pib_packet_bth *bth;
-	u32 dest_qp_num;
-	u16 slid, dlid;
+		iov.iov_base = desc->buffer;
+		iov.iov_len  = PIB_PACKET_BUFFER;
 
-	size = packet_size;
+		ret = kernel_recvmsg(port->socket, &msghdr,
+				     &iov, 1, iov.iov_len, msghdr.msg_flags);
 
-	port = &dev->ports[port_num - 1];
+		if (ret < 0) {
+			if (ret == -EINTR)
+				set_bit(PIB_THREAD_READY_TO_RECV, &thread->flags);
+			break;
+		} else if (ret == 0)
+			break;
 
-	if (size < sizeof(union pib_packet_footer)) {
-		pib_debug("pib: no packet footer(size=%u)\n", size);
-		goto silently_drop;
+		desc->size = ret;
 	}
 
-	size -= sizeof(union pib_packet_footer);
+	return count;
+}
 
-	port->perf.rcv_packets++;
-	port->perf.rcv_data += packet_size;
 
-	header_size = pib_parse_packet_header(buffer, size, &lrh, &grh, &bth);
-	if (header_size < 0) {
-		pib_debug("pib: wrong drop packet(size=%u)\n", size);
-		goto silently_drop;
-	}
+/*
+ *  Zero-copy 受信。
+ *
+ *  パケットの先頭を MSG_PEEK で覗き見て、RC SEND/RDMA WRITE のペイロードを
+ *  宛先の MR へ直接受信する。ヘッダとパディング以降は desc->buffer の
+ *  同じ位置に受信するので、以降の処理は通常のパケットと同じに扱える。
+ *
+ *  受信したパケットは ring[count] に置き、戻り値はそのサイズ。
+ *  ペイロードを MR に置けた場合は ring[count].placed を true にする。
+ *  対象外の場合は 0 を返す。
+ *
+ *  recvmsg はスリープしうるのでロックを持たずに呼ぶ。受信後に書き込み先を
+ *  もう一度求めて、変わっていたらペイロードを desc->buffer に書き戻して
+ *  通常のパケットとして処理する。
+ *
+ *  宛先の決定は QP の受信状態に依存するので、同じ QP 宛のパケットが
+ *  受信リングに先行している場合は対象外とする。別の QP 宛のパケットは
+ *  この QP の受信状態を変えないので、バッチ受信はそのまま続けられる。
+ */
+static int receive_packet_zcopy(struct pib_thread *thread, u8 port_num, struct pib_recv_desc *ring, int count)
+{
+	int ret, packet_size, peeked_size, offset, i, nr_iov;
+	u32 dest_qp_num;
+	struct msghdr msghdr;
+	struct kvec iov[PIB_MAX_ZCOPY_FRAGS + 2];
+	struct pib_dev *dev = thread->dev;
+	struct pib_zcopy *zcopy = &thread->rx_zcopy;
+	struct pib_zcopy *check = &thread->rx_zcopy_check;
+	struct pib_recv_desc *desc = &ring[count];
+	struct pib_port *port;
 
-	buffer += header_size;
-	size   -= header_size;
+	port = &dev->ports[port_num - 1];
 
-	if ((lrh->sl_rsv_lnh & 0x3) == 0)
-		goto raw_packet;
+	memset(&msghdr, 0, sizeof(msghdr));
 
-	/* Payload */
-	size -= pib_packet_bth_get_padcnt(bth); /* Pad Count */
-	if (size < 0) {
-		pib_debug("pib: drop packet: too small packet except LRH & BTH (size=%u)\n", size);
-		goto silently_drop;
-	}
+	iov[0].iov_base = desc->buffer;
+	iov[0].iov_len  = PIB_ZCOPY_RX_PEEK_SIZE;
 
-	/* Emit ICRC */
-	size -= 4;
-	if (size < 0) {
-		pib_debug("pib: drop packet: too small packet except ICRC (size=%u)\n", size);
-		goto silently_drop;
-	}
+	/* MSG_TRUNC を付けるとパケット全体の長さが返る */
+	ret = kernel_recvmsg(port->socket, &msghdr, iov, 1, iov[0].iov_len,
+			     MSG_DONTWAIT | MSG_NOSIGNAL | MSG_PEEK | MSG_TRUNC);
+	if (ret < 0)
+		return ret;
+	else if (ret == 0)
+		return -EAGAIN;
 
-	slid	    = be16_to_cpu(lrh->slid);	
-	dlid        = be16_to_cpu(lrh->dlid);
-	dest_qp_num = be32_to_cpu(bth->destQP) & PIB_QPN_MASK;
+	packet_size = ret;
+	peeked_size = min_t(int, packet_size, PIB_ZCOPY_RX_PEEK_SIZE);
 
-	switch (port->ib_port_attr.state) {
-	case IB_PORT_INIT:
-	case IB_PORT_ARMED:
-		/* The link layer can only receive SMP. */
-		if (dest_qp_num != PIB_QP0)
-			goto silently_drop;
-		break;
-	case IB_PORT_ACTIVE:
-		/* The link layer can transmit all packet types. */
-		break;
-	default:
-		/* The physical link is not up or error */
-		goto silently_drop;
-	}
+	if (PIB_PACKET_BUFFER < packet_size)
+		return 0;
 
-	pib_trace_recv(dev, port_num,
-		       bth->OpCode, be32_to_cpu(bth->psn) & PIB_PSN_MASK, packet_size,
-		       slid, dlid, dest_qp_num);
+	dest_qp_num = get_dest_qp_num(desc->buffer, peeked_size);
+	if (dest_qp_num == (u32)-1)
+		return 0;
 
-	if ((dest_qp_num == PIB_QP0) || (dlid < PIB_MCAST_LID_BASE)) {
-		/* Unicast */
-		process_incoming_message_per_qp(dev, port_num, dlid, dest_qp_num,
-						lrh, grh, bth, buffer, size);
-	} else {
-		/* Multicast */
-		int i, max;
-		struct pib_packet_deth *deth;
-		u16 port_lid, slid;
-		u32 src_qp_num;
-		struct pib_mcast_link *mcast_link;
-		u32 qp_nums[PIB_MCAST_QP_ATTACH];
-		unsigned long flags;
+	for (i=0 ; i < count ; i++)
+		if (get_dest_qp_num(ring[i].buffer, ring[i].size) == dest_qp_num)
+			return 0;
 
-		if ((bth->OpCode != IB_OPCODE_UD_SEND_ONLY) && 
-		    (bth->OpCode != IB_OPCODE_UD_SEND_ONLY_WITH_IMMEDIATE)) {
-			pib_debug("pib: drop packet: \n");
-			goto silently_drop;
-		}
+	offset = pib_prepare_rc_qp_zcopy_rx(dev, port_num, desc->buffer, peeked_size, packet_size, zcopy);
+	if (offset == 0)
+		return 0;
 
-		if (size < sizeof(struct pib_packet_deth))
-			goto silently_drop;
+	nr_iov = 0;
 
-		deth = (struct pib_packet_deth*)buffer;
+	iov[nr_iov].iov_base = desc->buffer;
+	iov[nr_iov].iov_len  = offset;
+	nr_iov++;
 
-		src_qp_num = be32_to_cpu(deth->srcQP) & PIB_QPN_MASK;
+	for (i=0 ; i < zcopy->nr_frags ; i++) {
+		iov[nr_iov].iov_base = zcopy->frags[i].vaddr;
+		iov[nr_iov].iov_len  = zcopy->frags[i].len;
+		nr_iov++;
+	}
 
-		spin_lock_irqsave(&dev->lock, flags);
-		i=0;
-		list_for_each_entry(mcast_link, &dev->mcast_table[dlid - PIB_MCAST_LID_BASE], lid_list) {
-			qp_nums[i] = mcast_link->qp_num;
-			i++;
-		}
-		spin_unlock_irqrestore(&dev->lock, flags);
+	iov[nr_iov].iov_base = desc->buffer + offset + zcopy->size;
+	iov[nr_iov].iov_len  = packet_size - offset - zcopy->size;
+	nr_iov++;
 
-		max = i;
+	memset(&msghdr, 0, sizeof(msghdr));
 
-		port_lid = port->ib_port_attr.lid;
-		slid     = be16_to_cpu(lrh->slid);
+	ret = kernel_recvmsg(port->socket, &msghdr, iov, nr_iov, packet_size,
+			     MSG_DONTWAIT | MSG_NOSIGNAL);
 
-		/* 
-		 * マルチキャストパケットを届ける QP は複数かもしれない。
-		 * ただし送信した QP 自身は受け取らない。
+	if (ret < 0)
+		goto done;
+
+	if (ret != packet_size) {
+		/*
+		 *  覗き見たパケットと異なる。パケットは既に取り出されているので
+		 *  落としたものとして扱い、0 を返して次のパケットを通常どおり受信させる。
+		 *  RC なので再送で回復する。
 		 */
-		for (i=0 ; i<max ; i++) {
-			if ((port_lid == slid) && (src_qp_num == qp_nums[i]))
-				continue;
+		ret = 0;
+		goto done;
+	}
 
-			pib_debug("pib: MC packet qp_num=0x%06x\n", qp_nums[i]);
-			process_incoming_message_per_qp(dev, port_num, dlid, qp_nums[i],
-							lrh, grh, bth, buffer, size);
+	/* 受信中に QP の受信状態や MR が変わっていないか確かめる */
+	if ((pib_prepare_rc_qp_zcopy_rx(dev, port_num, desc->buffer, peeked_size, packet_size, check) == offset) &&
+	    is_same_zcopy(zcopy, check))
+		desc->placed = true;
+	else {
+		/* ページは参照を保持しているので書き戻せる */
+		void *buffer = desc->buffer + offset;
+
+		for (i=0 ; i < zcopy->nr_frags ; i++) {
+			memcpy(buffer, zcopy->frags[i].vaddr, zcopy->frags[i].len);
+			buffer += zcopy->frags[i].len;
+		}
+	}
 
-			cond_resched();
+	pib_util_zcopy_release(check);
+
+done:
+	pib_util_zcopy_release(zcopy);
+
+	return ret;
+}
+
+
+static bool is_same_zcopy(const struct pib_zcopy *a, const struct pib_zcopy *b)
+{
+	int i;
+
+	if ((a->size != b->size) || (a->nr_frags != b->nr_frags))
+		return false;
+
+	for (i=0 ; i < a->nr_frags ; i++)
+		if ((a->frags[i].page  != b->frags[i].page)  ||
+		    (a->frags[i].vaddr != b->frags[i].vaddr) ||
+		    (a->frags[i].len   != b->frags[i].len))
+			return false;
+
+	return true;
+}
+
+
+/*
+ *  パケットの先頭から宛先 QPN を取り出す。BTH を持たない場合は (u32)-1 を返す。
+ */
+static u32 get_dest_qp_num(void *buffer, int size)
+{
+	int offset = sizeof(struct pib_packet_lrh);
+	struct pib_packet_lrh *lrh = buffer;
+	struct pib_packet_bth *bth;
+
+	if (size < offset)
+		return (u32)-1;
+
+	switch (lrh->sl_rsv_lnh & 0x3) {
+	case 0x3:
+		offset += sizeof(struct ib_grh);
+		break;
+	case 0x2:
+		break;
+	default:
+		return (u32)-1;
+	}
+
+	if (size < offset + sizeof(*bth))
+		return (u32)-1;
+
+	bth = buffer + offset;
+
+	return be32_to_cpu(bth->destQP) & PIB_QPN_MASK;
+}
+
+
+/*
+ *  受信リングのパケットのヘッダをすべて解析してから、宛先 QP 毎にまとめて処理する。
+ *  同じ QP 宛のパケットの順序は維持する。
+ */
+static void process_incoming_messages(struct pib_thread *thread, u8 port_num, struct pib_recv_desc *ring, int count)
+{
+	int i, j;
+	struct pib_dev *dev = thread->dev;
+
+	for (i=0 ; i < count ; i++)
+		parse_incoming_message(dev, port_num, &ring[i]);
+
+	for (i=0 ; i < count ; i++) {
+		struct pib_recv_desc *desc = &ring[i];
+
+		switch (desc->type) {
+
+		case PIB_RECV_UNICAST:
+			/* マルチキャストと Raw packet は追い越さない */
+			for (j=i ; j < count ; j++) {
+				struct pib_recv_desc *next = &ring[j];
+
+				if ((next->type == PIB_RECV_MULTICAST) || (next->type == PIB_RECV_RAW))
+					break;
+
+				if ((next->type != PIB_RECV_UNICAST) || (next->dest_qp_num != desc->dest_qp_num))
+					continue;
+
+				if (next->placed) {
+					thread->rx_placed.valid  = true;
+					thread->rx_placed.qp_num = next->dest_qp_num;
+					thread->rx_placed.psn    = be32_to_cpu(next->bth->psn) & PIB_PSN_MASK;
+				}
+
+				process_incoming_message_per_qp(dev, port_num, next->dlid, next->dest_qp_num,
+								next->lrh, next->grh, next->bth,
+								next->payload, next->payload_size);
+				next->type = PIB_RECV_DONE;
+
+				thread->rx_placed.valid = false;
+			}
+			break;
+
+		case PIB_RECV_MULTICAST:
+			process_multicast_message(dev, port_num, desc);
+			break;
+
+		case PIB_RECV_RAW:
+			process_raw_packet(dev, port_num, desc->lrh, desc->payload, desc->payload_size);
+			break;
+
+		default:
+			break;
 		}
+
+		desc->type = PIB_RECV_DONE;
 	}
+}
 
-silently_drop:
-	return;
 
-raw_packet:
-	process_raw_packet(dev, port_num, lrh, buffer, size);
+static void parse_incoming_message(struct pib_dev *dev, u8 port_num, struct pib_recv_desc *desc)
+{
+	int size, header_size;
+	void *buffer;
+	struct pib_port *port;
+	struct pib_packet_lrh *lrh;
+	struct ib_grh         *grh;
+	struct pib_packet_bth *bth;
+	u32 dest_qp_num;
+	u16 slid, dlid;
+
+	desc->type = PIB_RECV_DONE;
+
+	buffer = desc->buffer;
+	size   = desc->size;
+
+	port = &dev->ports[port_num - 1];
+
+	if (size < sizeof(union pib_packet_footer)) {
+		pib_debug("pib: no packet footer(size=%u)\n", size);
+		return;
+	}
+
+	size -= sizeof(union pib_packet_footer);
+
+	port->perf.rcv_packets++;
+	port->perf.rcv_data += desc->size;
+
+	header_size = pib_parse_packet_header(buffer, size, &lrh, &grh, &bth);
+	if (header_size < 0) {
+		pib_debug("pib: wrong drop packet(size=%u)\n", size);
+		return;
+	}
+
+	buffer += header_size;
+	size   -= header_size;
+
+	desc->lrh = lrh;
+
+	if ((lrh->sl_rsv_lnh & 0x3) == 0) {
+		desc->payload      = buffer;
+		desc->payload_size = size;
+		desc->type         = PIB_RECV_RAW;
+		return;
+	}
+
+	/* Payload */
+	size -= pib_packet_bth_get_padcnt(bth); /* Pad Count */
+	if (size < 0) {
+		pib_debug("pib: drop packet: too small packet except LRH & BTH (size=%u)\n", size);
+		return;
+	}
+
+	/* Emit ICRC */
+	size -= 4;
+	if (size < 0) {
+		pib_debug("pib: drop packet: too small packet except ICRC (size=%u)\n", size);
+		return;
+	}
+
+	slid	    = be16_to_cpu(lrh->slid);	
+	dlid        = be16_to_cpu(lrh->dlid);
+	dest_qp_num = be32_to_cpu(bth->destQP) & PIB_QPN_MASK;
+
+	switch (port->ib_port_attr.state) {
+	case IB_PORT_INIT:
+	case IB_PORT_ARMED:
+		/* The link layer can only receive SMP. */
+		if (dest_qp_num != PIB_QP0)
+			return;
+		break;
+	case IB_PORT_ACTIVE:
+		/* The link layer can transmit all packet types. */
+		break;
+	default:
+		/* The physical link is not up or error */
+		return;
+	}
+
+	pib_trace_recv(dev, port_num,
+		       bth->OpCode, be32_to_cpu(bth->psn) & PIB_PSN_MASK, desc->size,
+		       slid, dlid, dest_qp_num);
+
+	desc->grh          = grh;
+	desc->bth          = bth;
+	desc->payload      = buffer;
+	desc->payload_size = size;
+	desc->dlid         = dlid;
+	desc->dest_qp_num  = dest_qp_num;
+
+	if ((dest_qp_num == PIB_QP0) || (dlid < PIB_MCAST_LID_BASE))
+		desc->type = PIB_RECV_UNICAST;
+	else
+		desc->type = PIB_RECV_MULTICAST;
+}
+
+
+static void process_multicast_message(struct pib_dev *dev, u8 port_num, struct pib_recv_desc *desc)
+{
+	int i, max;
+	struct pib_port *port;
+	struct pib_packet_lrh *lrh = desc->lrh;
+	struct pib_packet_bth *bth = desc->bth;
+	struct pib_packet_deth *deth;
+	u16 port_lid, slid, dlid;
+	u32 src_qp_num;
+	struct pib_mcast_link *mcast_link;
+	u32 qp_nums[PIB_MCAST_QP_ATTACH];
+	unsigned long flags;
+
+	port = &dev->ports[port_num - 1];
+	dlid = desc->dlid;
+
+	if ((bth->OpCode != IB_OPCODE_UD_SEND_ONLY) && 
+	    (bth->OpCode != IB_OPCODE_UD_SEND_ONLY_WITH_IMMEDIATE)) {
+		pib_debug("pib: drop packet: \n");
+		return;
+	}
+
+	if (desc->payload_size < sizeof(struct pib_packet_deth))
+		return;
+
+	deth = (struct pib_packet_deth*)desc->payload;
+
+	src_qp_num = be32_to_cpu(deth->srcQP) & PIB_QPN_MASK;
+
+	spin_lock_irqsave(&dev->lock, flags);
+	i=0;
+	list_for_each_entry(mcast_link, &dev->mcast_table[dlid - PIB_MCAST_LID_BASE], lid_list) {
+		qp_nums[i] = mcast_link->qp_num;
+		i++;
+	}
+	spin_unlock_irqrestore(&dev->lock, flags);
+
+	max = i;
+
+	port_lid = port->ib_port_attr.lid;
+	slid     = be16_to_cpu(lrh->slid);
+
+	/* 
+	 * マルチキャストパケットを届ける QP は複数かもしれない。
+	 * ただし送信した QP 自身は受け取らない。
+	 */
+	for (i=0 ; i<max ; i++) {
+		if ((port_lid == slid) && (src_qp_num == qp_nums[i]))
+			continue;
+
+		pib_debug("pib: MC packet qp_num=0x%06x\n", qp_nums[i]);
+		process_incoming_message_per_qp(dev, port_num, dlid, qp_nums[i],
+						lrh, desc->grh, bth, desc->payload, desc->payload_size);
+
+		cond_resched();
+	}
 }
 
 
@@ -979,6 +1635,7 @@ pass_pkey_checking:
 	switch (qp->qp_type) {
 
 	case IB_QPT_RC:
+	case IB_QPT_UC:
 		pib_receive_rc_qp_incoming_message(dev, port_num, qp, lrh, grh, bth, buffer, size);
 		break;
 
@@ -998,9 +1655,6 @@ pass_pkey_checking:
 
 	pib_spin_unlock_irqrestore(&qp->lock, flags);
 
-	if (dev->thread.ready_to_send)
-		process_sendmsg(dev);
-
 silently_drop:
 
 	return;
@@ -1038,10 +1692,13 @@ static void disconnect_pibnetd(struct pib_dev *dev, u8 port_num)
 static void send_raw_packet_to_pibnetd(struct pib_dev *dev, u8 port_num, bool disconnect)
 {
 	void *buffer;
+	struct pib_thread *thread;
 	struct pib_packet_lrh *lrh;
 	struct pib_packet_link *link;
 
-	buffer = dev->thread.send_buffer;
+	thread = &dev->threads[0];
+
+	buffer = thread->send_buffer;
 
 	lrh    = buffer;
 
@@ -1057,15 +1714,16 @@ static void send_raw_packet_to_pibnetd(struct pib_dev *dev, u8 port_num, bool di
 
 	buffer += sizeof(*link);
 
-	pib_packet_lrh_set_pktlen(lrh, (buffer - dev->thread.send_buffer) / 4);
+	pib_packet_lrh_set_pktlen(lrh, (buffer - thread->send_buffer) / 4);
 
-	dev->thread.port_num	  = port_num;
-	dev->thread.src_qp_num	  = PIB_LINK_QP;
-	dev->thread.slid	  = PIB_LID_PERMISSIVE;
-	dev->thread.dlid	  = PIB_LID_PERMISSIVE;
-	dev->thread.ready_to_send = 1;
+	thread->port_num	  = port_num;
+	thread->src_qp_num	  = PIB_LINK_QP;
+	thread->slid		  = PIB_LID_PERMISSIVE;
+	thread->dlid		  = PIB_LID_PERMISSIVE;
+	thread->ready_to_send	  = 1;
 
-	process_sendmsg(dev);
+	process_sendmsg(thread);
+	flush_sendmsg(thread);
 }
 
 
@@ -1117,42 +1775,38 @@ void pib_netd_comm_handler(struct pib_work_struct *work)
 
 void pib_util_reschedule_qp(struct pib_qp *qp)
 {
-	struct pib_dev *dev;
+	struct pib_thread *thread;
 	unsigned long flags;
 	unsigned long now, schedule_time;
 	struct pib_send_wqe *send_wqe;
-	struct rb_node **link;
-	struct rb_node *parent = NULL;
-	struct rb_node *rb_node;
 
-	dev = to_pdev(qp->ib_qp.device);
+	thread = qp->thread;
 
-	/************************************************************/
-	/* Red/Black tree からの取り外し                            */
-	/************************************************************/
-
-	spin_lock_irqsave(&dev->qp_sched.lock, flags);
-	if (qp->sched.on) {
-		qp->sched.on = 0;
-		rb_erase(&qp->sched.rb_node, &dev->qp_sched.rb_root);
-	}
-	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+	pib_util_drain_posted_swqe(qp);
 
 	/************************************************************/
 	/* 再計算                                                   */
 	/************************************************************/
-	now = jiffies;
+	now = pib_sched_now();
 	schedule_time = now + PIB_SCHED_TIMEOUT;
 
+	/* 受信側が CNP の送信を頼んでいる */
+	if ((qp->qp_type == IB_QPT_RC) && pib_is_recv_ok(qp->state) && qp->requester.cnp_pending) {
+		schedule_time = now;
+		goto skip;
+	}
+
 	if ((qp->qp_type == IB_QPT_RC) && pib_is_recv_ok(qp->state))
 		if (!list_empty(&qp->responder.ack_head) &&
 		    (qp->responder.nr_contig_read_acks < PIB_MAX_CONTIG_READ_ACKS)) {
-			schedule_time = now;
-			goto skip;
+			/* 遅延 ACK は期限まで timer wheel で待つ */
+			schedule_time = pib_get_rc_qp_acknowledge_time(qp, now);
+			if (schedule_time == now)
+				goto skip;
 		}
 
 	if ((qp->state != IB_QPS_RTS) && (qp->state != IB_QPS_SQD))
-		return;
+		goto skip;
 
 	if (!list_empty(&qp->requester.waiting_swqe_head)) {
 		send_wqe = list_first_entry(&qp->requester.waiting_swqe_head, struct pib_send_wqe, list);
@@ -1168,7 +1822,7 @@ void pib_util_reschedule_qp(struct pib_qp *qp)
 			if (!list_empty(&qp->requester.waiting_swqe_head))
 				goto skip;
 
-		if (PIB_MAX_CONTIG_REQUESTS < qp->requester.nr_contig_requests)
+		if (pib_is_rc_qp_request_blocked(qp, send_wqe))
 			goto skip;
 
 		if (time_before(send_wqe->processing.schedule_time, schedule_time))
@@ -1187,71 +1841,264 @@ void pib_util_reschedule_qp(struct pib_qp *qp)
 
 skip:
 	if (schedule_time == now + PIB_SCHED_TIMEOUT)
-		return;
+		goto unschedule;
 
-	qp->sched.time = schedule_time;
-	qp->sched.tid  = dev->qp_sched.master_tid++;
+	spin_lock_irqsave(&thread->qp_sched.lock, flags);
 
-	/************************************************************/
-	/* Red/Black tree への登録                                  */
-	/************************************************************/
-	spin_lock_irqsave(&dev->qp_sched.lock, flags);
-	link = &dev->qp_sched.rb_root.rb_node;
-	while (*link) {
-		int cond;
-		struct pib_qp *qp_tmp;
+	/*
+	 * now はロックの外で取ったので、その間に他の kthread が expire_wheel で
+	 * wheel_base を進めているかもしれない。通過済みの時刻は ready list へ。
+	 */
+	if (time_after(schedule_time, now) &&
+	    time_after(schedule_time, thread->qp_sched.wheel_base)) {
+		/* タイムアウトを待つ QP は timer wheel へ */
+		if ((qp->sched.on != PIB_SCHED_WHEEL) || (qp->sched.time != schedule_time)) {
+			unlink_scheduling_qp(qp);
+			qp->sched.time = schedule_time;
+			insert_qp_into_wheel(thread, qp);
+		}
+		qp->sched.burst = 0;
+	} else {
+		/* 実行可能な QP は ready list へ。既に入っていれば動かさない */
+		if (qp->sched.on != PIB_SCHED_READY) {
+			unlink_scheduling_qp(qp);
+			list_add_tail(&qp->sched.list, &thread->qp_sched.ready_head);
+			qp->sched.on = PIB_SCHED_READY;
+		}
+		if (qp->sched.burst)
+			list_move(&qp->sched.list, &thread->qp_sched.ready_head);
+		qp->sched.time = schedule_time;
+	}
 
-		parent = *link;
-		qp_tmp = rb_entry(parent, struct pib_qp, sched.rb_node);
+	update_wakeup_time(thread, now);
 
-		if (qp_tmp->sched.time != schedule_time)
-			cond = time_after(qp_tmp->sched.time, schedule_time);
-		else
-			cond = ((long)(qp_tmp->sched.tid - qp->sched.tid) > 0);
+	spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
 
-		if (cond)
-			link = &parent->rb_left;
-		else
-			link = &parent->rb_right;
-	}
-	rb_link_node(&qp->sched.rb_node, parent, link);
-	rb_insert_color(&qp->sched.rb_node, &dev->qp_sched.rb_root);
-	qp->sched.on = 1;
+	if (time_before_eq(thread->qp_sched.wakeup_time, now))
+		set_bit(PIB_THREAD_QP_SCHEDULE, &thread->flags);
 
-	/* calculate the most early time  */
-	rb_node = rb_first(&dev->qp_sched.rb_root);
-	BUG_ON(rb_node == NULL);
-	qp = rb_entry(rb_node, struct pib_qp, sched.rb_node);
-	dev->qp_sched.wakeup_time = qp->sched.time;
+	/*
+	 * 受信処理などで他の kthread から再スケジュールされた場合は、
+	 * 停止時間を計算し直させるために起こす。
+	 */
+	if (thread->task != current)
+		complete(&thread->completion);
+
+	return;
 
-	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+unschedule:
+	qp->sched.burst = 0;
 
-	if (time_before_eq(dev->qp_sched.wakeup_time, now))
-		set_bit(PIB_THREAD_QP_SCHEDULE, &dev->thread.flags);
+	spin_lock_irqsave(&thread->qp_sched.lock, flags);
+	unlink_scheduling_qp(qp);
+	spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
 }
 
 
-struct pib_qp *pib_util_get_first_scheduling_qp(struct pib_dev *dev)
+/*
+ *  ready list の先頭の QP を取り出す。
+ *  取り出した QP は ready list の末尾に回すので、実行可能であり続ける QP は
+ *  ready list から外れることなく round-robin で処理される。
+ *  ただし sched.burst が立っている QP は一度だけ先頭に残す。
+ */
+struct pib_qp *pib_util_get_first_scheduling_qp(struct pib_thread *thread)
 {
 	unsigned long flags;
-	struct rb_node *rb_node;
+	unsigned long now;
 	struct pib_qp *qp = NULL;
 
-	spin_lock_irqsave(&dev->qp_sched.lock, flags);
+	spin_lock_irqsave(&thread->qp_sched.lock, flags);
 
-	rb_node = rb_first(&dev->qp_sched.rb_root);
+	now = pib_sched_now();
 
-	if (rb_node == NULL)
+	expire_wheel(thread, now);
+
+	if (list_empty(&thread->qp_sched.ready_head))
 		goto done;
 
-	qp = rb_entry(rb_node, struct pib_qp, sched.rb_node);
+	qp = list_first_entry(&thread->qp_sched.ready_head, struct pib_qp, sched.list);
+
+	/* バースト中の QP は先頭に残して続けて処理させる */
+	if (qp->sched.burst)
+		qp->sched.burst = 0;
+	else
+		list_move_tail(&qp->sched.list, &thread->qp_sched.ready_head);
+
 done:
+	update_wakeup_time(thread, now);
 
-	spin_unlock_irqrestore(&dev->qp_sched.lock, flags);
+	spin_unlock_irqrestore(&thread->qp_sched.lock, flags);
 
 	return qp;
 }
 
+
+/*
+ *  Lock: qp_sched
+ */
+static void unlink_scheduling_qp(struct pib_qp *qp)
+{
+	if (qp->sched.on == PIB_SCHED_OFF)
+		return;
+
+	/*
+	 * timer wheel の wheel_bitmap はここでは落とさない。
+	 * 空になったスロットは次に expire_wheel() が通過した時に落とす。
+	 */
+	list_del_init(&qp->sched.list);
+	qp->sched.on = PIB_SCHED_OFF;
+}
+
+
+/*
+ *  qp->sched.time が属するスロットに QP を登録する。
+ *  Level n は wheel_base から 64^(n+1) tick 未満の時刻を受け持つ。
+ *  最上位 level の範囲を超える時刻は最上位 level の最後のスロットに入れ、
+ *  そこを通過する時に入れ直す。
+ *
+ *  Lock: qp_sched
+ */
+static void insert_qp_into_wheel(struct pib_thread *thread, struct pib_qp *qp)
+{
+	int level, slot;
+	unsigned long time, delta;
+
+	time  = qp->sched.time;
+	delta = time - thread->qp_sched.wheel_base;
+
+	for (level = 0 ; level < PIB_SCHED_WHEEL_LEVELS - 1 ; level++)
+		if (delta < (1UL << (PIB_SCHED_WHEEL_BITS * (level + 1))))
+			break;
+
+	if ((PIB_SCHED_WHEEL_LEVELS - 1 == level) &&
+	    ((1UL << (PIB_SCHED_WHEEL_BITS * PIB_SCHED_WHEEL_LEVELS)) <= delta))
+		time = thread->qp_sched.wheel_base +
+			(1UL << (PIB_SCHED_WHEEL_BITS * PIB_SCHED_WHEEL_LEVELS)) - 1;
+
+	slot = (time >> (PIB_SCHED_WHEEL_BITS * level)) & PIB_SCHED_WHEEL_MASK;
+
+	list_add_tail(&qp->sched.list, &thread->qp_sched.wheel[level][slot]);
+	thread->qp_sched.wheel_bitmap[level] |= (1ULL << slot);
+	qp->sched.on = PIB_SCHED_WHEEL;
+}
+
+
+/*
+ *  wheel_base から now までに通過したスロットの QP を取り出し、
+ *  時刻に達したものは ready list へ、そうでないものは wheel に入れ直す。
+ *
+ *  Lock: qp_sched
+ */
+static void expire_wheel(struct pib_thread *thread, unsigned long now)
+{
+	int level, slot;
+	unsigned long base, from, to, index;
+	struct pib_qp *qp, *next_qp;
+	LIST_HEAD(expired_head);
+
+	base = thread->qp_sched.wheel_base;
+
+	if (!time_after(now, base))
+		return;
+
+	for (level = 0 ; level < PIB_SCHED_WHEEL_LEVELS ; level++) {
+		from = base >> (PIB_SCHED_WHEEL_BITS * level);
+		to   = now  >> (PIB_SCHED_WHEEL_BITS * level);
+
+		/* 上位の level のスロットは通過していない */
+		if (from == to)
+			break;
+
+		for (index = from + 1 ; ; index++) {
+			slot = index & PIB_SCHED_WHEEL_MASK;
+
+			list_splice_tail_init(&thread->qp_sched.wheel[level][slot], &expired_head);
+			thread->qp_sched.wheel_bitmap[level] &= ~(1ULL << slot);
+
+			if ((index == to) || (index - from == PIB_SCHED_WHEEL_SIZE))
+				break;
+		}
+	}
+
+	thread->qp_sched.wheel_base = now;
+
+	list_for_each_entry_safe(qp, next_qp, &expired_head, sched.list) {
+		list_del_init(&qp->sched.list);
+		if (time_after(qp->sched.time, now)) {
+			insert_qp_into_wheel(thread, qp);
+		} else {
+			list_add_tail(&qp->sched.list, &thread->qp_sched.ready_head);
+			qp->sched.on = PIB_SCHED_READY;
+		}
+	}
+}
+
+
+/*
+ *  kthread が次に起床すべき時刻を求める。
+ *  timer wheel の中では空でない最も近いスロットの開始時刻とする。
+ *
+ *  Lock: qp_sched
+ */
+static void update_wakeup_time(struct pib_thread *thread, unsigned long now)
+{
+	int level, pos;
+	u64 bitmap;
+	unsigned long index, time;
+	unsigned long wakeup_time;
+
+	if (!list_empty(&thread->qp_sched.ready_head)) {
+		thread->qp_sched.wakeup_time = now;
+		return;
+	}
+
+	wakeup_time = now + PIB_SCHED_TIMEOUT;
+
+	for (level = 0 ; level < PIB_SCHED_WHEEL_LEVELS ; level++) {
+		bitmap = thread->qp_sched.wheel_bitmap[level];
+		if (bitmap == 0)
+			continue;
+
+		index = (thread->qp_sched.wheel_base >> (PIB_SCHED_WHEEL_BITS * level)) + 1;
+		pos   = index & PIB_SCHED_WHEEL_MASK;
+
+		/* pos から循環的に最初に立っているビットを探す */
+		if (pos != 0)
+			bitmap = (bitmap >> pos) | (bitmap << (PIB_SCHED_WHEEL_SIZE - pos));
+
+		time = (index + __ffs64(bitmap)) << (PIB_SCHED_WHEEL_BITS * level);
+
+		if (time_before(time, wakeup_time))
+			wakeup_time = time;
+	}
+
+	thread->qp_sched.wakeup_time = wakeup_time;
+}
+
+
+/*
+ *  受信処理中のパケットのペイロードが zero-copy 受信で既に QP の
+ *  書き込み先へ置かれていれば true を返す。
+ */
+bool pib_util_rx_payload_placed(struct pib_dev *dev, struct pib_qp *qp, u32 psn)
+{
+	struct pib_thread *thread = &dev->threads[0];
+
+	return thread->rx_placed.valid &&
+		(thread->rx_placed.qp_num == qp->ib_qp.qp_num) &&
+		(thread->rx_placed.psn    == psn);
+}
+
+
+/*
+ *  QP を担当する kthread を QPN から決める。
+ *  QPN は round-robin で割り当てられるので、剰余で各 kthread に均等に分散する。
+ */
+struct pib_thread *pib_util_get_thread(struct pib_dev *dev, u32 qp_num)
+{
+	return &dev->threads[qp_num % dev->nr_thread];
+}
+
 /******************************************************************************/
 /*                                                                            */
 /******************************************************************************/
@@ -1291,8 +2138,8 @@ void pib_queue_work(struct pib_dev *dev, struct pib_work_struct *work)
 	list_add_tail(&work->entry, &dev->wq_sched.head);
 	spin_unlock_irqrestore(&dev->wq_sched.lock, flags);
 
-	set_bit(PIB_THREAD_WQ_SCHEDULE, &dev->thread.flags);
-	complete(&dev->thread.completion);
+	set_bit(PIB_THREAD_WQ_SCHEDULE, &dev->threads[0].flags);
+	complete(&dev->threads[0].completion);
 }
 
 
@@ -1340,24 +2187,27 @@ void pib_stop_delayed_queue(struct pib_dev *dev)
 /******************************************************************************/
 /*                                                                            */
 /******************************************************************************/
-static void process_sendmsg(struct pib_dev *dev)
+/*
+ *  作成したパケットを送信リングに積む。
+ *  リングが一杯になるか flush_sendmsg() が呼ばれるまで実際には送信しない。
+ */
+static void process_sendmsg(struct pib_thread *thread)
 {
-	int ret;
 	u8 port_num;
 	u32 src_qp_num;
 	u16 slid;
 	u16 dlid;
 	struct sockaddr *sockaddr;
-	struct msghdr	msghdr;
-	struct kvec	iov;
 	struct pib_port *port;
+	struct pib_send_desc *desc;
 	union pib_packet_footer *footer;
 	size_t msg_size;
+	struct pib_dev *dev = thread->dev;
 
-	port_num   = dev->thread.port_num;
-	src_qp_num = dev->thread.src_qp_num;
-	slid       = dev->thread.slid;
-	dlid       = dev->thread.dlid;
+	port_num   = thread->port_num;
+	src_qp_num = thread->src_qp_num;
+	slid       = thread->slid;
+	dlid       = thread->dlid;
 
 	port = &dev->ports[port_num - 1];
 
@@ -1369,37 +2219,43 @@ static void process_sendmsg(struct pib_dev *dev)
 	switch (port->ib_port_attr.state) {
 	case IB_PORT_DOWN:
 		if (src_qp_num != PIB_LINK_QP)
-			return;
+			goto drop;
 		break;
 	case IB_PORT_INIT:
 	case IB_PORT_ARMED:
 		/* The link layer can only transmit and receive SMP. */
 		if ((src_qp_num != PIB_QP0) && (src_qp_num != PIB_LINK_QP))
-			return;
+			goto drop;
 		break;
 	case IB_PORT_ACTIVE:
 		/* The link layer can transmit and receive all packet types. */
 		break;
 	default:
 		/* The physical link is not up or error */
-		return;
+		goto drop;
 	}
 
 	/* 送信サイズを確定 */
-	msg_size = pib_packet_lrh_get_pktlen(dev->thread.send_buffer) * 4;
+	msg_size = pib_packet_lrh_get_pktlen(thread->send_buffer) * 4;
 
 	if ((0 == msg_size) || (PIB_PACKET_BUFFER < msg_size)) {
 		pr_err("pib: wrong length = %zu\n", msg_size);
-		return;
+		goto drop;
 	}
 
 	/* フッターとして VCRC が入る領域に Port GUID を入れる */
-	footer = dev->thread.send_buffer + msg_size;
+	footer = thread->send_buffer + msg_size;
 	footer->pib.port_guid = port->gid[0].global.interface_id;
 
 	msg_size += sizeof(*footer);
 
-	pib_trace_send(dev, port_num, msg_size);
+	pib_trace_send(dev, thread, port_num, msg_size);
+
+	/* single-host-mode ではソケットを使わずに宛先の HCA へ直接渡す */
+	if (!pib_multi_host_mode && pib_direct_loopback &&
+	    (src_qp_num != PIB_QP0) && (src_qp_num != PIB_LINK_QP) && (dlid != 0))
+		if (send_loopback_packet(thread, port, dlid, msg_size))
+			goto done;
 
 	sockaddr = get_sockaddr_from_dlid(dev, port_num, src_qp_num, dlid);
 	if (!sockaddr) {
@@ -1407,28 +2263,160 @@ static void process_sendmsg(struct pib_dev *dev)
 		goto done;
 	}
 
+	desc = &thread->send_ring[thread->nr_send];
+
+	desc->size     = msg_size;
+	desc->port_num = port_num;
+	desc->mcast    = !pib_is_unicast_lid(dlid);
+	desc->sockaddr = sockaddr;
+	desc->zcopy    = thread->zcopy;
+
+	thread->zcopy.size     = 0;
+	thread->zcopy.nr_frags = 0;
+
+	thread->nr_send++;
+
+	if (thread->nr_send == PIB_SEND_BATCH)
+		flush_sendmsg(thread);
+	else
+		thread->send_buffer = thread->send_ring[thread->nr_send].buffer;
+
+done:
+	thread->trace_id	  = 0;
+	thread->ready_to_send	  = 0;
+
+drop:
+	/* 送信しなかったパケットのページ参照を解放する */
+	pib_util_zcopy_release(&thread->zcopy);
+}
+
+
+/*
+ *  送信リングに積まれたパケットを送信する。
+ *  同じ宛先への連続するパケットは UDP_SEGMENT を使って 1 回で送る。
+ */
+static void flush_sendmsg(struct pib_thread *thread)
+{
+	int i, j;
+	struct pib_send_desc *ring = thread->send_ring;
+
+	for (i=0 ; i < thread->nr_send ; i = j) {
+		j = i + 1;
+#ifdef PIB_UDP_GSO_SUPPORT
+		if (!ring[i].mcast) {
+			size_t total = ring[i].size;
+
+			/* 最後のセグメント以外は同じサイズでなければならない */
+			for ( ; j < thread->nr_send ; j++) {
+				if ((ring[j].port_num != ring[i].port_num) ||
+				    (ring[j].sockaddr != ring[i].sockaddr) ||
+				    ring[j].mcast)
+					break;
+				if ((ring[j - 1].size != ring[i].size) || (ring[i].size < ring[j].size))
+					break;
+				if (PIB_GSO_MAX_SIZE < total + ring[j].size)
+					break;
+				total += ring[j].size;
+			}
+		}
+#endif
+		send_packets(thread, &ring[i], j - i);
+	}
+
+	thread->nr_send     = 0;
+	thread->send_buffer = thread->send_ring_buffer;
+}
+
+
+static void send_packets(struct pib_thread *thread, struct pib_send_desc *desc, int count)
+{
+	int i, nr_iov = 0, ret;
+	size_t total = 0;
+	struct sockaddr *sockaddr;
+	struct msghdr	msghdr;
+	struct kvec    *iov = thread->send_iov;
+	struct pib_port *port;
+	struct pib_dev *dev = thread->dev;
+#ifdef PIB_UDP_GSO_SUPPORT
+	char control[CMSG_SPACE(sizeof(u16))];
+	struct cmsghdr *cmsg;
+#endif
+
+	port = &dev->ports[desc->port_num - 1];
+
+	for (i=0 ; i < count ; i++) {
+		struct pib_zcopy *zcopy = &desc[i].zcopy;
+		int j;
+
+		total += desc[i].size;
+
+		if (zcopy->nr_frags == 0) {
+			iov[nr_iov].iov_base = desc[i].buffer;
+			iov[nr_iov].iov_len  = desc[i].size;
+			nr_iov++;
+			continue;
+		}
+
+		/* ヘッダ、MR のページ上のペイロード、パディング以降の順に並べる */
+		iov[nr_iov].iov_base = desc[i].buffer;
+		iov[nr_iov].iov_len  = zcopy->offset;
+		nr_iov++;
+
+		for (j=0 ; j < zcopy->nr_frags ; j++) {
+			iov[nr_iov].iov_base = zcopy->frags[j].vaddr;
+			iov[nr_iov].iov_len  = zcopy->frags[j].len;
+			nr_iov++;
+		}
+
+		iov[nr_iov].iov_base = desc[i].buffer + zcopy->offset + zcopy->size;
+		iov[nr_iov].iov_len  = desc[i].size - zcopy->offset - zcopy->size;
+		nr_iov++;
+	}
+
 	memset(&msghdr, 0, sizeof(msghdr));
 
+	sockaddr           = desc->sockaddr;
 	msghdr.msg_name    = sockaddr;
 	msghdr.msg_namelen = (sockaddr->sa_family == AF_INET6) ?
 		sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 
-	iov.iov_base = dev->thread.send_buffer;
-	iov.iov_len  = msg_size;
+#ifdef PIB_UDP_GSO_SUPPORT
+	if (1 < count) {
+		msghdr.msg_control    = control;
+		msghdr.msg_controllen = sizeof(control);
+
+		cmsg = CMSG_FIRSTHDR(&msghdr);
+		cmsg->cmsg_level = SOL_UDP;
+		cmsg->cmsg_type  = UDP_SEGMENT;
+		cmsg->cmsg_len   = CMSG_LEN(sizeof(u16));
+		*(u16 *)CMSG_DATA(cmsg) = desc->size;
+	}
+#endif
 
-	ret = kernel_sendmsg(port->socket, &msghdr, &iov, 1, iov.iov_len);
+	ret = kernel_sendmsg(port->socket, &msghdr, iov, nr_iov, total);
 
 	if (ret < 0) {
 		if ((ret == -EINTR) || (ret == -EAGAIN))
 			goto done;
+#ifdef PIB_UDP_GSO_SUPPORT
+		/*
+		 * セグメントが経路の MTU を超えると UDP_SEGMENT は -EINVAL になる。
+		 * IP フラグメントで届くように 1 パケットずつ送り直す。
+		 */
+		if ((ret == -EINVAL) && (1 < count)) {
+			for (i=0 ; i < count ; i++)
+				send_packets(thread, &desc[i], 1);
+			return;
+		}
+#endif
 		pr_err("pib: kernel_sendmsg (errno=%d)\n", ret);
 		goto done;
 	}
 
-	port->perf.xmit_packets++;
-	port->perf.xmit_data += msg_size;
+	port->perf.xmit_packets += count;
+	port->perf.xmit_data    += total;
 
-	if (pib_is_unicast_lid(dlid))
+	if (!desc->mcast)
 		goto done;
 
 	/*
@@ -1440,11 +2428,211 @@ static void process_sendmsg(struct pib_dev *dev)
 	msghdr.msg_namelen = (sockaddr->sa_family == AF_INET6) ?
 		sizeof(struct sockaddr_in6) : sizeof(struct sockaddr_in);
 
-	ret = kernel_sendmsg(port->socket, &msghdr, &iov, 1, iov.iov_len);
+	ret = kernel_sendmsg(port->socket, &msghdr, iov, nr_iov, total);
+
+done:
+	/*
+	 * UDP ソケットは kernel_sendmsg() から戻るまでにペイロードを skb に
+	 * 取り込むので、ここで MR のページを解放してよい。
+	 */
+	for (i=0 ; i < count ; i++)
+		pib_util_zcopy_release(&desc[i].zcopy);
+}
+
+
+/*
+ *  Direct loopback (single-host-mode)
+ *
+ *  DLID がローカルの HCA のポートなら、その HCA の loopback ring に
+ *  パケットを積む。マルチキャストは easy switch を経由せずにすべての
+ *  ローカルのポートへ配る (送信元の QP は受信側で除外される)。
+ *  ring が一杯の場合はパケットを破棄して xmit_discards に数える。
+ *  ソケットで送るべきパケットなら false を返す。
+ */
+static bool send_loopback_packet(struct pib_thread *thread, struct pib_port *port, u16 dlid, size_t msg_size)
+{
+	int i, j;
+	bool sent = false;
+	struct pib_dev *dest;
+
+	rcu_read_lock();
+
+	if (pib_is_unicast_lid(dlid)) {
+		dest = pib_util_find_loopback_dev(dlid);
+		if (!dest)
+			goto done;
+
+		for (j=0 ; j < dest->ib_dev.phys_port_cnt ; j++)
+			if (dest->ports[j].ib_port_attr.lid == dlid)
+				break;
+
+		if (j == dest->ib_dev.phys_port_cnt)
+			goto done;
+
+		if (enqueue_loopback_packet(dest, j + 1, thread, msg_size))
+			port->perf.xmit_discards++;
+		else {
+			port->perf.xmit_packets++;
+			port->perf.xmit_data += msg_size;
+		}
+
+		sent = true;
+		goto done;
+	}
+
+	if ((dlid < PIB_MCAST_LID_BASE) || pib_is_permissive_lid(dlid))
+		goto done;
+
+	for (i=0 ; i < PIB_MAX_HCA ; i++) {
+		dest = rcu_dereference(loopback_devs[i]);
+		if (!dest)
+			continue;
+
+		for (j=0 ; j < dest->ib_dev.phys_port_cnt ; j++)
+			if (enqueue_loopback_packet(dest, j + 1, thread, msg_size))
+				port->perf.xmit_discards++;
+	}
+
+	port->perf.xmit_packets++;
+	port->perf.xmit_data += msg_size;
+
+	sent = true;
 
 done:
-	dev->thread.trace_id	  = 0;
-	dev->thread.ready_to_send = 0;
+	rcu_read_unlock();
+
+	return sent;
+}
+
+
+/*
+ *  LID を持つローカルの HCA のうち、direct loopback を受け付けるものを返す。
+ *
+ *  Lock: rcu_read_lock
+ */
+struct pib_dev *pib_util_find_loopback_dev(u16 lid)
+{
+	struct pib_dev *dest;
+
+	dest = rcu_dereference(pib_lid_dev_table[lid]);
+	if (!dest || (rcu_dereference(loopback_devs[dest->dev_id]) != dest))
+		return NULL;
+
+	return dest;
+}
+
+
+static int enqueue_loopback_packet(struct pib_dev *dest, u8 port_num, struct pib_thread *thread, size_t msg_size)
+{
+	unsigned int pos, seq;
+	int diff;
+	struct pib_loopback_slot *slot;
+	struct pib_thread *dest_thread;
+	struct pib_zcopy *zcopy = &thread->zcopy;
+
+	/* 空きスロットを予約する */
+	pos = (unsigned int)atomic_read(&dest->loopback.enqueue_pos);
+	for (;;) {
+		slot = &dest->loopback.slots[pos & (PIB_LOOPBACK_RING_SIZE - 1)];
+
+		seq  = ACCESS_ONCE(slot->seq);
+		smp_rmb();
+		diff = (int)(seq - pos);
+
+		if (diff == 0) {
+			unsigned int old;
+
+			old = (unsigned int)atomic_cmpxchg(&dest->loopback.enqueue_pos, (int)pos, (int)(pos + 1));
+			if (old == pos)
+				break;
+			pos = old;
+		} else if (diff < 0)
+			/* ring is full */
+			return -ENOBUFS;
+		else
+			pos = (unsigned int)atomic_read(&dest->loopback.enqueue_pos);
+	}
+
+	if (zcopy->nr_frags == 0)
+		memcpy(slot->buffer, thread->send_buffer, msg_size);
+	else {
+		int i;
+		void *buffer = slot->buffer;
+
+		memcpy(buffer, thread->send_buffer, zcopy->offset);
+		buffer += zcopy->offset;
+
+		for (i=0 ; i < zcopy->nr_frags ; i++) {
+			memcpy(buffer, zcopy->frags[i].vaddr, zcopy->frags[i].len);
+			buffer += zcopy->frags[i].len;
+		}
+
+		memcpy(buffer, thread->send_buffer + zcopy->offset + zcopy->size,
+		       msg_size - zcopy->offset - zcopy->size);
+	}
+
+	slot->port_num = port_num;
+	slot->size     = msg_size;
+
+	smp_wmb();
+	slot->seq = pos + 1;
+
+	/* 受信担当の kthread を起こす */
+	dest_thread = &dest->threads[0];
+	if (!test_and_set_bit(PIB_THREAD_READY_TO_RECV, &dest_thread->flags))
+		complete(&dest_thread->completion);
+
+	return 0;
+}
+
+
+/*
+ *  loopback ring から同じポート宛のパケットを最大 PIB_RECV_BATCH 個取り出して処理する。
+ */
+static int receive_loopback_packets(struct pib_thread *thread)
+{
+	int i, count;
+	unsigned int pos;
+	u8 port_num = 0;
+	struct pib_dev *dev = thread->dev;
+	struct pib_loopback_slot *slot;
+
+	pos = dev->loopback.dequeue_pos;
+
+	for (count=0 ; count < PIB_RECV_BATCH ; count++) {
+		struct pib_recv_desc *desc = &thread->loopback_ring[count];
+
+		slot = &dev->loopback.slots[(pos + count) & (PIB_LOOPBACK_RING_SIZE - 1)];
+
+		if (ACCESS_ONCE(slot->seq) != pos + count + 1)
+			break;
+		smp_rmb();
+
+		if ((0 < count) && (slot->port_num != port_num))
+			break;
+
+		port_num     = slot->port_num;
+
+		desc->buffer = slot->buffer;
+		desc->size   = slot->size;
+		desc->placed = false;
+	}
+
+	if (count == 0)
+		return 0;
+
+	process_incoming_messages(thread, port_num, thread->loopback_ring, count);
+
+	/* スロットを送信側に返す */
+	smp_mb();
+	for (i=0 ; i < count ; i++) {
+		slot = &dev->loopback.slots[(pos + i) & (PIB_LOOPBACK_RING_SIZE - 1)];
+		slot->seq = pos + i + PIB_LOOPBACK_RING_SIZE;
+	}
+
+	dev->loopback.dequeue_pos = pos + count;
+
+	return count;
 }
 
 
@@ -1489,26 +2677,37 @@ static void sock_data_ready_callback(struct sock *sk)
 {
 	struct pib_dev* dev  = (struct pib_dev*)sk->sk_user_data;
 
-	set_bit(PIB_THREAD_READY_TO_RECV, &dev->thread.flags);
-	complete(&dev->thread.completion);
+	set_bit(PIB_THREAD_READY_TO_RECV, &dev->threads[0].flags);
+	complete(&dev->threads[0].completion);
 }
 #else
 static void sock_data_ready_callback(struct sock *sk, int bytes)
 {
 	struct pib_dev* dev  = (struct pib_dev*)sk->sk_user_data;
 
-	set_bit(PIB_THREAD_READY_TO_RECV, &dev->thread.flags);
-	complete(&dev->thread.completion);
+	set_bit(PIB_THREAD_READY_TO_RECV, &dev->threads[0].flags);
+	complete(&dev->threads[0].completion);
 }
 #endif
 
 
 static void timer_timeout_callback(unsigned long opaque)
 {
-	struct pib_dev* dev  = (struct pib_dev*)opaque;
+	struct pib_thread* thread = (struct pib_thread*)opaque;
 	
-	set_bit(PIB_THREAD_QP_SCHEDULE, &dev->thread.flags);
-	complete(&dev->thread.completion);
+	set_bit(PIB_THREAD_QP_SCHEDULE, &thread->flags);
+	complete(&thread->completion);
+}
+
+
+static enum hrtimer_restart hrtimer_timeout_callback(struct hrtimer *hrtimer)
+{
+	struct pib_thread* thread = container_of(hrtimer, struct pib_thread, hrtimer);
+
+	set_bit(PIB_THREAD_QP_SCHEDULE, &thread->flags);
+	complete(&thread->completion);
+
+	return HRTIMER_NORESTART;
 }
 
 
@@ -1524,6 +2723,6 @@ static void delayed_work_timeout_callback(unsigned long data)
 	list_add_tail(&work->entry, &dev->wq_sched.head);
 	spin_unlock_irqrestore(&dev->wq_sched.lock, flags);
 
-	set_bit(PIB_THREAD_WQ_SCHEDULE, &dev->thread.flags);
-	complete(&dev->thread.completion);
+	set_bit(PIB_THREAD_WQ_SCHEDULE, &dev->threads[0].flags);
+	complete(&dev->threads[0].completion);
 }
@@ -44,14 +44,12 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	struct pib_ah *ah;
 	u16 slid, dlid;
 	struct pib_packet_lrh *lrh;
-	struct ib_grh         *grh;
 	struct pib_packet_bth *bth;
 	struct pib_packet_deth *deth;
-	u8 lnh;
+	u8 length;
 	enum ib_wr_opcode opcode;
 	enum ib_wc_status status = IB_WC_SUCCESS;
 	int with_imm;
-	unsigned long flags;
 	u32 packet_length, fix_packet_length;
 
 	opcode = send_wqe->opcode;
@@ -110,33 +108,21 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	buffer = dev->thread.send_buffer;
-
-	memset(buffer, 0, sizeof(*lrh) + sizeof(*grh) + sizeof(*bth) + sizeof(*deth));
+	buffer = qp->thread->send_buffer;
 
 	/* write IB Packet Header (LRH, GRH, BTH, DETH) */
+	length = pib_copy_header_template(dev, &ah->header_template, port_num, buffer);
+	if (length == 0)
+		length = pib_fill_packet_header(dev, port_num, &ah->ib_ah_attr, 0, 0, buffer);
+
 	lrh = (struct pib_packet_lrh*)buffer; 
-	buffer += sizeof(*lrh);
-	if (ah->ib_ah_attr.ah_flags & IB_AH_GRH) {
-		grh = (struct ib_grh*)buffer;
-		pib_fill_grh(dev, port_num, grh, &ah->ib_ah_attr.grh);
-		buffer += sizeof(*grh);
-		lnh = 0x3;
-	} else {
-		grh = NULL;
-		lnh = 0x2;
-	}
-	bth = (struct pib_packet_bth*)buffer;
-	buffer += sizeof(*bth);
+	bth = (struct pib_packet_bth*)(buffer + length - sizeof(*bth));
+	buffer += length;
 	deth = (struct pib_packet_deth*)buffer;
 	buffer += sizeof(*deth);
 
 	bth->OpCode = with_imm ? IB_OPCODE_UD_SEND_ONLY_WITH_IMMEDIATE : IB_OPCODE_UD_SEND_ONLY;
 
-	lrh->sl_rsv_lnh = (ah->ib_ah_attr.sl << 4) | lnh; /* Transport: IBA & Next Header: BTH */
-	lrh->dlid   = cpu_to_be16(ah->ib_ah_attr.dlid);
-	lrh->slid   = cpu_to_be16(slid);
-
 	bth->pkey   = dev->ports[port_num - 1].pkey_table[send_wqe->wr.ud.pkey_index];
 	bth->destQP = cpu_to_be32(send_wqe->wr.ud.remote_qpn);
 	bth->psn    = cpu_to_be32(qp->ib_qp_attr.sq_psn & PIB_PSN_MASK); /* A-bit is 0 */
@@ -179,12 +165,12 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	} else if (send_wqe->send_flags & IB_SEND_INLINE) {
 		memcpy(buffer, send_wqe->inline_data_buffer, send_wqe->total_length);
 	} else {
-		spin_lock_irqsave(&pd->lock, flags);
-		status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge,
+		rcu_read_lock();
+		status = pib_util_mr_copy_data(pd, send_wqe->sge_array, send_wqe->num_sge, NULL,
 					       buffer, 0, send_wqe->total_length,
 					       0,
 					       PIB_MR_COPY_FROM);
-		spin_unlock_irqrestore(&pd->lock, flags);
+		rcu_read_unlock();
 	}
 
 	if (status != IB_WC_SUCCESS)
@@ -193,19 +179,19 @@ int pib_process_ud_qp_request(struct pib_dev *dev, struct pib_qp *qp, struct pib
 	buffer += send_wqe->total_length;
 
 	/* サイズの再計算 */
-	packet_length     = buffer - dev->thread.send_buffer;
+	packet_length     = buffer - qp->thread->send_buffer;
 	fix_packet_length = (packet_length + 3) & ~3;
 
 	pib_packet_lrh_set_pktlen(lrh, (fix_packet_length + 4)/ 4); /* add ICRC size */
 	pib_packet_bth_set_padcnt(bth, fix_packet_length - packet_length);
 	pib_packet_bth_set_solicited(bth, send_wqe->send_flags & IB_SEND_SOLICITED);
 
-	dev->thread.port_num	= port_num;
-	dev->thread.src_qp_num	= qp->ib_qp.qp_num;
-	dev->thread.slid	= slid;
-	dev->thread.dlid	= dlid;
-	dev->thread.trace_id    = send_wqe->trace_id;
-	dev->thread.ready_to_send = 1;
+	qp->thread->port_num	= port_num;
+	qp->thread->src_qp_num	= qp->ib_qp.qp_num;
+	qp->thread->slid	= slid;
+	qp->thread->dlid	= dlid;
+	qp->thread->trace_id    = send_wqe->trace_id;
+	qp->thread->ready_to_send = 1;
 
 	qp->ib_qp_attr.sq_psn++;
 
@@ -254,7 +240,6 @@ void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 	u32 qkey;
 	enum ib_wc_status status = IB_WC_SUCCESS;
 	__be32 imm_data = 0;
-	unsigned long flags;
 
 	if (!pib_is_recv_ok(qp->state))
 		goto silently_drop;
@@ -337,20 +322,20 @@ void pib_receive_ud_qp_incoming_message(struct pib_dev *dev, u8 port_num, struct
 
 	pd = to_ppd(qp->ib_qp.pd);
 
-	spin_lock_irqsave(&pd->lock, flags);
+	rcu_read_lock();
 
 	if (grh)
-		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
+		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge, NULL,
 					       grh, 0, sizeof(*grh),
 					       IB_ACCESS_LOCAL_WRITE,
 					       PIB_MR_COPY_TO);
 	if (status == IB_WC_SUCCESS)
-		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge,
+		status = pib_util_mr_copy_data(pd, recv_wqe->sge_array, recv_wqe->num_sge, NULL,
 					       buffer, sizeof(*grh), size,
 					       IB_ACCESS_LOCAL_WRITE,
 					       PIB_MR_COPY_TO);
 
-	spin_unlock_irqrestore(&pd->lock, flags);
+	rcu_read_unlock();
 
 	if (status != IB_WC_SUCCESS) {
 		if (status == IB_WC_LOC_LEN_ERR) {
@@ -0,0 +1,311 @@
+/*
+ * Check that a receive length error on a UC QP completes the Receive WQE
+ * in error but does not move the QP into the error state.
+ *
+ * Copyright (c) 2014 Minoru NAKAMURA <nminoru@nminoru.jp>
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <unistd.h>
+#include <infiniband/verbs.h>
+
+enum {
+	MSG_SIZE       = 64,
+	SMALL_BUF_SIZE = 16,
+	PSN            = 0x123,
+	MAX_POLL       = 1000000
+};
+
+static void usage(const char *argv0)
+{
+	printf("Usage: [-d <dev>] [-i <port>]\n");
+	printf("  -d, --ib-dev=<dev>     use IB device <dev> (default first device found)\n");
+	printf("  -i, --ib-port=<port>   use port <port> of IB device (default 1)\n");
+}
+
+static int connect_qp(struct ibv_qp *qp, int ib_port, uint16_t dlid, uint32_t dest_qp_num)
+{
+	struct ibv_qp_attr attr = {
+		.qp_state        = IBV_QPS_INIT,
+		.pkey_index      = 0,
+		.port_num        = ib_port,
+		.qp_access_flags = IBV_ACCESS_REMOTE_WRITE,
+	};
+
+	if (ibv_modify_qp(qp, &attr,
+			  IBV_QP_STATE | IBV_QP_PKEY_INDEX | IBV_QP_PORT | IBV_QP_ACCESS_FLAGS))
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state           = IBV_QPS_RTR;
+	attr.path_mtu           = IBV_MTU_1024;
+	attr.dest_qp_num        = dest_qp_num;
+	attr.rq_psn             = PSN;
+	attr.ah_attr.dlid       = dlid;
+	attr.ah_attr.port_num   = ib_port;
+
+	if (ibv_modify_qp(qp, &attr,
+			  IBV_QP_STATE | IBV_QP_AV | IBV_QP_PATH_MTU | IBV_QP_DEST_QPN | IBV_QP_RQ_PSN))
+		return -1;
+
+	memset(&attr, 0, sizeof(attr));
+	attr.qp_state           = IBV_QPS_RTS;
+	attr.sq_psn             = PSN;
+
+	if (ibv_modify_qp(qp, &attr, IBV_QP_STATE | IBV_QP_SQ_PSN))
+		return -1;
+
+	return 0;
+}
+
+static int post_recv(struct ibv_qp *qp, struct ibv_mr *mr, void *buffer, uint32_t length)
+{
+	struct ibv_recv_wr *bad_wr;
+	struct ibv_sge sge = {
+		.addr   = (uintptr_t)buffer,
+		.length = length,
+		.lkey   = mr->lkey,
+	};
+	struct ibv_recv_wr wr = {
+		.wr_id   = length,
+		.sg_list = &sge,
+		.num_sge = 1,
+	};
+
+	return ibv_post_recv(qp, &wr, &bad_wr);
+}
+
+static int post_send(struct ibv_qp *qp, struct ibv_mr *mr, void *buffer, uint32_t length)
+{
+	struct ibv_send_wr *bad_wr;
+	struct ibv_sge sge = {
+		.addr   = (uintptr_t)buffer,
+		.length = length,
+		.lkey   = mr->lkey,
+	};
+	struct ibv_send_wr wr = {
+		.wr_id      = length,
+		.sg_list    = &sge,
+		.num_sge    = 1,
+		.opcode     = IBV_WR_SEND,
+		.send_flags = IBV_SEND_SIGNALED,
+	};
+
+	return ibv_post_send(qp, &wr, &bad_wr);
+}
+
+static int poll_one(struct ibv_cq *cq, struct ibv_wc *wc)
+{
+	int i, ret;
+
+	for (i = 0 ; i < MAX_POLL ; i++) {
+		ret = ibv_poll_cq(cq, 1, wc);
+		if (ret != 0)
+			return ret;
+		usleep(1);
+	}
+
+	return 0;
+}
+
+int main(int argc, char *argv[])
+{
+	struct ibv_device *ib_dev;
+	char                *ib_devname = NULL;
+	int                  ib_port = 1;
+	int                  result = 0;
+
+	while (1) {
+		int c;
+
+		static struct option long_options[] = {
+			{ .name = "ib-dev",   .has_arg = 1, .val = 'd' },
+			{ .name = "ib-port",  .has_arg = 1, .val = 'i' },
+			{ 0 }
+		};
+
+		c = getopt_long(argc, argv, "d:i:", long_options, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+
+		case 'd':
+			ib_devname = strdupa(optarg);
+			break;
+
+		case 'i':
+			ib_port = strtol(optarg, NULL, 10);
+			if (ib_port < 0) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+
+		default:
+			usage(argv[0]);
+			return 1;
+		}
+	}
+
+	struct ibv_device **dev_list = ibv_get_device_list(NULL);
+	if (!dev_list) {
+		fprintf(stderr, "Failed to get IB devices list: errnor=%d\n", errno);
+		return 1;
+	}
+
+	if (!ib_devname) {
+		ib_dev = *dev_list;
+		if (!ib_dev) {
+			fprintf(stderr, "No IB devices found\n");
+			return 1;
+		}
+	} else {
+		int i;
+		for (i = 0; dev_list[i]; ++i)
+			if (!strcmp(ibv_get_device_name(dev_list[i]), ib_devname))
+				break;
+		ib_dev = dev_list[i];
+		if (!ib_dev) {
+			fprintf(stderr, "IB device %s not found\n", ib_devname);
+			return 1;
+		}
+	}
+
+	struct ibv_context *context = ibv_open_device(ib_dev);
+	if (!context) {
+		fprintf(stderr, "Couldn't get context for %s: errno=%d\n",
+			ibv_get_device_name(ib_dev), errno);
+		return 1;
+	}
+
+	struct ibv_port_attr port_attr;
+	if (ibv_query_port(context, ib_port, &port_attr)) {
+		fprintf(stderr, "Couldn't query port %d: errno=%d\n", ib_port, errno);
+		return 1;
+	}
+
+	struct ibv_pd *pd = ibv_alloc_pd(context);
+	if (!pd) {
+		fprintf(stderr, "Couldn't allocate protection domain: errno=%d\n",
+			errno);
+		return 1;
+	}
+
+	char *buffer = calloc(1, MSG_SIZE * 2);
+	struct ibv_mr *mr = ibv_reg_mr(pd, buffer, MSG_SIZE * 2, IBV_ACCESS_LOCAL_WRITE);
+	if (!mr) {
+		fprintf(stderr, "Couldn't register memory region: errno=%d\n", errno);
+		return 1;
+	}
+
+	struct ibv_cq *send_cq = ibv_create_cq(context, 16, NULL, NULL, 0);
+	struct ibv_cq *recv_cq = ibv_create_cq(context, 16, NULL, NULL, 0);
+	if (!send_cq || !recv_cq) {
+		fprintf(stderr, "Couldn't create CQ: errno=%d\n", errno);
+		return 1;
+	}
+
+	struct ibv_qp_init_attr qp_init_attr = {
+		.send_cq = send_cq,
+		.recv_cq = recv_cq,
+		.cap     = {
+			.max_send_wr  = 4,
+			.max_recv_wr  = 4,
+			.max_send_sge = 1,
+			.max_recv_sge = 1,
+		},
+		.qp_type = IBV_QPT_UC,
+	};
+
+	struct ibv_qp *qp1 = ibv_create_qp(pd, &qp_init_attr);
+	struct ibv_qp *qp2 = ibv_create_qp(pd, &qp_init_attr);
+	if (!qp1 || !qp2) {
+		fprintf(stderr, "Couldn't create QP: errno=%d\n", errno);
+		return 1;
+	}
+
+	if (connect_qp(qp1, ib_port, port_attr.lid, qp2->qp_num) ||
+	    connect_qp(qp2, ib_port, port_attr.lid, qp1->qp_num)) {
+		fprintf(stderr, "Couldn't connect QPs: errno=%d\n", errno);
+		return 1;
+	}
+
+	struct ibv_wc wc;
+	struct ibv_qp_attr attr;
+	struct ibv_qp_init_attr init_attr;
+
+	/* 1st message is longer than the receive buffer */
+	if (post_recv(qp2, mr, buffer + MSG_SIZE, SMALL_BUF_SIZE) ||
+	    post_send(qp1, mr, buffer, MSG_SIZE)) {
+		fprintf(stderr, "Couldn't post WRs: errno=%d\n", errno);
+		return 1;
+	}
+
+	if (poll_one(recv_cq, &wc) != 1) {
+		printf("recv length error: NG (no completion)\n");
+		return 1;
+	}
+
+	if (wc.status == IBV_WC_LOC_LEN_ERR) {
+		printf("recv length error: OK\n");
+	} else {
+		printf("recv length error: NG (status=%s)\n", ibv_wc_status_str(wc.status));
+		result = 1;
+	}
+
+	poll_one(send_cq, &wc);
+
+	if (ibv_query_qp(qp2, &attr, IBV_QP_STATE, &init_attr)) {
+		fprintf(stderr, "Couldn't query QP: errno=%d\n", errno);
+		return 1;
+	}
+
+	if (attr.qp_state == IBV_QPS_RTS) {
+		printf("QP state after the error: OK\n");
+	} else {
+		printf("QP state after the error: NG (state=%d)\n", attr.qp_state);
+		result = 1;
+	}
+
+	/* 2nd message must still be received */
+	if (post_recv(qp2, mr, buffer + MSG_SIZE, MSG_SIZE) ||
+	    post_send(qp1, mr, buffer, MSG_SIZE)) {
+		fprintf(stderr, "Couldn't post WRs: errno=%d\n", errno);
+		return 1;
+	}
+
+	if ((poll_one(recv_cq, &wc) == 1) && (wc.status == IBV_WC_SUCCESS) && (wc.byte_len == MSG_SIZE)) {
+		printf("recv after the error: OK\n");
+	} else {
+		printf("recv after the error: NG\n");
+		result = 1;
+	}
+
+	poll_one(send_cq, &wc);
+
+	ibv_destroy_qp(qp2);
+	ibv_destroy_qp(qp1);
+	ibv_destroy_cq(recv_cq);
+	ibv_destroy_cq(send_cq);
+	ibv_dereg_mr(mr);
+	free(buffer);
+
+	if (ibv_dealloc_pd(pd)) {
+		fprintf(stderr, "Couldn't deallocate PD\n");
+		return 1;
+	}
+
+	if (ibv_close_device(context)) {
+		fprintf(stderr, "Couldn't release context\n");
+		return 1;
+	}
+
+	ibv_free_device_list(dev_list);
+
+	return result;
+}